@@ -0,0 +1,717 @@
+#include "../lib/blur.hxx"
+#include "../lib/bmp_image.hxx"
+#include "../lib/convolution.hxx"
+#include "../lib/edge.hxx"
+#include "../lib/equalization.hxx"
+#include "../lib/frequency.hxx"
+#include "../lib/hough.hxx"
+#include "../lib/integral_image.hxx"
+#include "../lib/linalg.hxx"
+#include "../lib/linear_transform.hxx"
+#include "../lib/morphology.hxx"
+#include "../lib/numeric_array.hxx"
+#include "../lib/plot.hxx"
+#include "../lib/pyramid.hxx"
+#include "../lib/segmentation.hxx"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// Benchmarks every library module on synthetic square images of a range of
+// sizes and worker counts. Results are written as JSON and can be compared
+// against an earlier run. Gaussian blur output is also checked against the
+// exact kernel first. The exit code is 1 when an accuracy check fails or any
+// case got slower than the baseline by more than the threshold.
+//
+//   bench [--sizes 256,1024] [--threads 1,4] [--filter kernel]
+//         [--min-time ms] [--output results.json]
+//         [--baseline baseline.json] [--threshold 0.15]
+namespace Bench {
+
+struct Options {
+  std::vector<int> sizes = {256, 512, 1024, 2048, 4096, 8192};
+  std::vector<int> threads;
+  std::string filter;
+  double min_time_ms = 300;
+  size_t min_reps = 3;
+  size_t max_reps = 20;
+  std::string output = "bench/results.json";
+  std::string baseline;
+  double threshold = 0.15;
+};
+
+struct Result {
+  std::string name;
+  int size;
+  int threads;
+  double median_ms;
+  double min_ms;
+  int reps;
+};
+
+// `setup` builds the inputs for one size outside of the timed region and
+// returns the operation to time
+struct Case {
+  std::string name;
+  int max_size;
+  std::function<std::function<void()>(int)> setup;
+};
+
+// Deterministic test card: a gradient, a checkerboard of blocks, a few lines
+// and low-amplitude noise
+BmpImage::BmpImage synthetic_image(int size) {
+  auto image = Plot::generate_blank_canvas(size, size);
+  int block = std::max(1, size / 8);
+  uint32_t state = 0x2545F491u;
+  image.image.data.foreach_sync([&](BmpImage::BmpPixel &pixel, size_t idx) {
+    int x = idx % size;
+    int y = idx / size;
+    state = state * 1664525u + 1013904223u;
+    int noise = static_cast<int>(state >> 28);
+    int value = (x + y) * 96 / (2 * size) + noise;
+    if ((x / block + y / block) % 2 == 0) {
+      value += 128;
+    }
+    auto v = static_cast<uint8_t>(std::clamp(value, 0, 255));
+    pixel = {v, static_cast<uint8_t>(255 - v), static_cast<uint8_t>(v / 2),
+             255};
+  });
+  for (int i = 1; i < 4; i++) {
+    Plot::draw_line(image, 0, i * size / 4, size - 1, i * size / 4,
+                    {255, 255, 255, 255});
+    Plot::draw_line(image, i * size / 4, 0, i * size / 4, size - 1,
+                    {255, 255, 255, 255});
+  }
+  return image;
+}
+
+// Sparse edge map for the Hough transform: a box and its diagonals
+std::vector<double> synthetic_edges(int size) {
+  std::vector<double> edges(static_cast<size_t>(size) * size, 0);
+  int lo = size / 8, hi = size - 1 - size / 8;
+  for (int i = lo; i <= hi; i++) {
+    edges[static_cast<size_t>(lo) * size + i] = 1;
+    edges[static_cast<size_t>(hi) * size + i] = 1;
+    edges[static_cast<size_t>(i) * size + lo] = 1;
+    edges[static_cast<size_t>(i) * size + hi] = 1;
+    edges[static_cast<size_t>(i) * size + i] = 1;
+  }
+  return edges;
+}
+
+std::shared_ptr<BmpImage::BmpImage> shared_image(int size) {
+  return std::make_shared<BmpImage::BmpImage>(synthetic_image(size));
+}
+
+std::string temp_path(const std::string &name) {
+  return (std::filesystem::temp_directory_path() / name).string();
+}
+
+std::vector<Case> all_cases() {
+  using Image = BmpImage::BmpImage;
+  std::vector<Case> cases;
+
+  cases.push_back({"bmp_write_24", 8192, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       std::ofstream file(temp_path("bench_24.bmp"),
+                                          std::ios::binary);
+                       BmpImage::write_bmp(file, *image);
+                     };
+                   }});
+  cases.push_back({"bmp_read_24", 8192, [](int size) {
+                     auto image = synthetic_image(size);
+                     std::ofstream file(temp_path("bench_24.bmp"),
+                                        std::ios::binary);
+                     BmpImage::write_bmp(file, image);
+                     return []() {
+                       std::ifstream file(temp_path("bench_24.bmp"),
+                                          std::ios::binary);
+                       BmpImage::read_bmp(file);
+                     };
+                   }});
+  cases.push_back({"bmp_write_8", 8192, [](int size) {
+                     auto image = std::make_shared<Image>(
+                         BmpImage::to_bmp(BmpImage::to_gray(synthetic_image(
+                             size))));
+                     return [image]() {
+                       std::ofstream file(temp_path("bench_8.bmp"),
+                                          std::ios::binary);
+                       BmpImage::write_bmp(file, *image);
+                     };
+                   }});
+  cases.push_back({"bmp_read_8", 8192, [](int size) {
+                     auto image = BmpImage::to_bmp(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     std::ofstream file(temp_path("bench_8.bmp"),
+                                        std::ios::binary);
+                     BmpImage::write_bmp(file, image);
+                     return []() {
+                       std::ifstream file(temp_path("bench_8.bmp"),
+                                          std::ios::binary);
+                       BmpImage::read_bmp(file);
+                     };
+                   }});
+  // Each kernel through apply_kernel, which runs it as a compiled stencil,
+  // and through the generic loop
+  using Kernel = std::vector<std::vector<double>>;
+  Kernel box5(5, std::vector<double>(5, 1.0 / 25));
+  for (auto [name, kernel, max_size] :
+       {std::tuple{"3x3", Kernel{{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}}, 8192},
+        std::tuple{"5x5", Kernel{{0, 0, -1, 0, 0},
+                                 {0, -1, -2, -1, 0},
+                                 {-1, -2, 16, -2, -1},
+                                 {0, -1, -2, -1, 0},
+                                 {0, 0, -1, 0, 0}},
+                   4096},
+        std::tuple{"box_5x5", box5, 4096}}) {
+    cases.push_back({std::format("apply_kernel_{}", name), max_size,
+                     [kernel](int size) {
+                       auto image = shared_image(size);
+                       return [image, kernel]() {
+                         Convolution::apply_kernel(*image, kernel);
+                       };
+                     }});
+    cases.push_back({std::format("apply_kernel_{}_generic", name), max_size,
+                     [kernel](int size) {
+                       auto image = shared_image(size);
+                       return [image, kernel]() {
+                         Convolution::apply_kernel_generic(image->image.view(),
+                                                           kernel);
+                       };
+                     }});
+  }
+  cases.push_back({"edge_map_sobel", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       Edge::edge_map(gray->view(), Edge::sobel);
+                     };
+                   }});
+  cases.push_back({"canny", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() { Edge::canny(gray->view()); };
+                   }});
+  for (int side : {3, 15}) {
+    cases.push_back(
+        {std::format("dilate_gray_{}x{}", side, side), 8192, [side](int size) {
+           auto gray = std::make_shared<BmpImage::GrayImage>(
+               BmpImage::to_gray(synthetic_image(size)));
+           return [gray, side]() {
+             Morphology::dilate(gray->view(), {side, side});
+           };
+         }});
+    cases.push_back(
+        {std::format("dilate_binary_{}x{}", side, side), 8192,
+         [side](int size) {
+           auto gray = BmpImage::to_gray(synthetic_image(size));
+           for (auto &value : gray.data.data) {
+             value = value > 128 ? 255 : 0;
+           }
+           auto mask = std::make_shared<Morphology::BitImage>(
+               Morphology::pack(gray.view()));
+           return [mask, side]() { Morphology::dilate(*mask, {side, side}); };
+         }});
+  }
+  cases.push_back({"gray_balanced_image", 8192, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       BmpImage::gray_balanced_image(*image);
+                     };
+                   }});
+  cases.push_back({"clahe", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() { Equalization::clahe(gray->view()); };
+                   }});
+  cases.push_back({"clahe_sliding_63", 2048, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       Equalization::clahe_sliding(gray->view(), 63);
+                     };
+                   }});
+  for (auto [method, name] : {std::pair{Blur::Method::Recursive, "recursive"},
+                              std::pair{Blur::Method::Box, "box"}}) {
+    for (int sigma : {2, 8}) {
+      cases.push_back({std::format("gaussian_blur_{}_s{}", name, sigma), 8192,
+                       [method, sigma](int size) {
+                         auto gray = std::make_shared<BmpImage::GrayImage>(
+                             BmpImage::to_gray(synthetic_image(size)));
+                         return [gray, method, sigma]() {
+                           Blur::gaussian_blur(gray->view(), sigma, method);
+                         };
+                       }});
+    }
+  }
+  cases.push_back({"integer_convolve_log_5x5", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       Edge::convolve(gray->view(),
+                                      Edge::laplacian_of_gaussian);
+                     };
+                   }});
+  cases.push_back({"apply_mid_value_kernel_5x5", 2048, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       Convolution::apply_mid_value_kernel(*image, 5, 12);
+                     };
+                   }});
+  cases.push_back({"threshold_otsu", 8192, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       Segmentation::SegmentationByThreshold::
+                           auto_find_threshold_by_otsu(*image);
+                     };
+                   }});
+  cases.push_back({"integral_image", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       IntegralImage::integral_image(gray->view());
+                     };
+                   }});
+  cases.push_back({"threshold_sauvola_31", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       Segmentation::SegmentationByThreshold::
+                           segment_by_sauvola(gray->view(), 31);
+                     };
+                   }});
+  auto shared_regions = [](int size) {
+    auto gray = BmpImage::to_gray(synthetic_image(size));
+    for (auto &value : gray.data.data) {
+      value = value > 128 ? 255 : 0;
+    }
+    return std::make_shared<Segmentation::SegmentationByGrowth::RegionLabels>(
+        Segmentation::SegmentationByGrowth::label_regions(gray.view()));
+  };
+  cases.push_back({"distance_transform", 8192, [=](int size) {
+                     auto regions = shared_regions(size);
+                     return [regions]() {
+                       Segmentation::SegmentationByWatershed::
+                           distance_transform(regions->view());
+                     };
+                   }});
+  cases.push_back({"separate_regions", 4096, [=](int size) {
+                     auto regions = shared_regions(size);
+                     return [regions]() {
+                       Segmentation::SegmentationByWatershed::separate_regions(
+                           regions->view());
+                     };
+                   }});
+  cases.push_back({"threshold_iteration", 8192, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       Segmentation::SegmentationByThreshold::
+                           auto_find_threshold_by_iteration(*image);
+                     };
+                   }});
+  cases.push_back({"fft_2d", 2048, [](int size) {
+                     auto image = synthetic_image(size);
+                     auto gray = std::make_shared<Frequency::RealMatrix>(
+                         size, std::vector<double>(size));
+                     for (int i = 0; i < size * size; i++) {
+                       (*gray)[i / size][i % size] =
+                           image.image.data.data[i].gray();
+                     }
+                     return [gray]() { Frequency::fft(*gray); };
+                   }});
+  cases.push_back({"hough_lines", 1024, [](int size) {
+                     auto edges = std::make_shared<std::vector<double>>(
+                         synthetic_edges(size));
+                     return [edges, size]() {
+                       Hough::HoughLineParam param{.theta_steps = 360};
+                       auto votes = Hough::hough_linear_transform(
+                           ImageView::ImageView<const double>(edges->data(),
+                                                              size, size),
+                           param);
+                       Hough::get_lines_bfs(votes, param, 1, -1, 0.5);
+                     };
+                   }});
+  cases.push_back({"hough_lines_coarse_to_fine", 1024, [](int size) {
+                     auto edges = synthetic_edges(size);
+                     BmpImage::GrayImage gray{
+                         {size, size},
+                         NumericArray::NumericArray<uint8_t>(edges.size(), 0)};
+                     for (size_t i = 0; i < edges.size(); i++) {
+                       gray.data.data[i] = edges[i] > 1e-5 ? 255 : 0;
+                     }
+                     return [gray]() {
+                       Pyramid::Pyramid pyramid(gray, Pyramid::Reduce::Area);
+                       Hough::HoughLineParam param{.theta_steps = 360};
+                       auto votes =
+                           Hough::hough_linear_transform(pyramid, param);
+                       Hough::get_lines_bfs(votes, param, 1, -1, 0.5);
+                     };
+                   }});
+  cases.push_back({"pyramid_gaussian_all_levels", 8192, [](int size) {
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(synthetic_image(size)));
+                     return [gray]() {
+                       Pyramid::Pyramid pyramid(*gray);
+                       pyramid.level(pyramid.levels - 1);
+                     };
+                   }});
+  cases.push_back({"split_region", 2048, [](int size) {
+                     auto image = std::make_shared<Image>(
+                         Segmentation::SegmentationByThreshold::
+                             segment_by_threshold(synthetic_image(size), 128));
+                     return [image]() {
+                       Segmentation::SegmentationByGrowth::split_region(
+                           *image);
+                     };
+                   }});
+  cases.push_back({"grow_region", 512, [](int size) {
+                     auto image = shared_image(size);
+                     return [image, size]() {
+                       int min_gray = 255, max_gray = 0;
+                       Segmentation::SegmentationByGrowth::grow_region(
+                           *image, {{size / 16, size / 16}},
+                           [&](Segmentation::SegmentationByGrowth::Point p,
+                               const Image &img, const auto &) {
+                             auto [x, y] = p;
+                             int gray =
+                                 img.image.data.data[y * size + x].gray();
+                             int lo = std::min(min_gray, gray);
+                             int hi = std::max(max_gray, gray);
+                             if (hi - lo >= 64) {
+                               return false;
+                             }
+                             min_gray = lo;
+                             max_gray = hi;
+                             return true;
+                           },
+                           false);
+                     };
+                   }});
+  cases.push_back({"quad_tree", 4096, [](int size) {
+                     auto image = shared_image(size);
+                     auto gray = std::make_shared<BmpImage::GrayImage>(
+                         BmpImage::to_gray(*image));
+                     return [image, gray, size]() {
+                       using Segmentation::SegmentationByQuadTree::Box;
+                       auto integral =
+                           IntegralImage::integral_image(gray->view());
+                       Segmentation::SegmentationByQuadTree::build_quad_tree(
+                           *image,
+                           [&](const Image &, const std::vector<Box> &boxes) {
+                             for (auto [l, r, t, b] : boxes) {
+                               if (r - l <= 8 || b - t <= 8) {
+                                 continue;
+                               }
+                               if (integral.box_variance(l, t, r, b) > 64.0) {
+                                 return false;
+                               }
+                             }
+                             return true;
+                           },
+                           {0, size - 1, 0, size - 1});
+                     };
+                   }});
+  cases.push_back({"linear_transform_rotate", 1024, [](int size) {
+                     auto image = shared_image(size);
+                     return [image]() {
+                       LinearTransform::linear_transform(
+                           *image,
+                           Linalg::LinearTransformMatrix().rotate(0.5).take());
+                     };
+                   }});
+  return cases;
+}
+
+// Difference from the sampled Gaussian (radius 4 sigma, applied in double
+// precision), in gray levels
+struct Accuracy {
+  std::string name;
+  double sigma;
+  double max_error;
+  double rms_error;
+  bool passed;
+};
+
+std::vector<double> exact_gaussian(const BmpImage::GrayImage &gray,
+                                   double sigma) {
+  int width = gray.size.width;
+  int height = gray.size.height;
+  int radius = std::ceil(4 * sigma);
+  auto weights = Blur::gaussian_weights(sigma, radius);
+  std::vector<double> rows(gray.data.data.size());
+  std::vector<double> result(gray.data.data.size());
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double sum = 0;
+      for (int i = -radius; i <= radius; i++) {
+        sum += weights[i + radius] *
+               gray.data.data[y * width + std::clamp(x + i, 0, width - 1)];
+      }
+      rows[y * width + x] = sum;
+    }
+  }
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double sum = 0;
+      for (int i = -radius; i <= radius; i++) {
+        sum += weights[i + radius] *
+               rows[std::clamp(y + i, 0, height - 1) * width + x];
+      }
+      result[y * width + x] = sum;
+    }
+  }
+  return result;
+}
+
+// From sigma 2 up both backends approximate the kernel shape, so the
+// limits only catch broken coefficients or borders. Below that both run the
+// sampled kernel and must match it up to rounding.
+std::vector<Accuracy> check_accuracy(const std::string &filter) {
+  auto gray = BmpImage::to_gray(synthetic_image(512));
+  std::vector<Accuracy> checks;
+  for (double sigma : {0.5, 1.0, 1.5, 2.0, 4.0, 8.0, 16.0}) {
+    bool sampled = sigma < 2;
+    double max_limit = sampled ? 1 : 8;
+    double rms_limit = sampled ? 0.5 : 1;
+    std::vector<double> exact;
+    for (auto [method, name] :
+         {std::pair{Blur::Method::Recursive, "recursive"},
+          std::pair{Blur::Method::Box, "box"}}) {
+      auto check_name = std::format("gaussian_blur_{}_accuracy", name);
+      if (check_name.find(filter) == std::string::npos) {
+        continue;
+      }
+      if (exact.empty()) {
+        exact = exact_gaussian(gray, sigma);
+      }
+      auto blurred = Blur::gaussian_blur(gray.view(), sigma, method);
+      double max_error = 0, squares = 0;
+      for (size_t i = 0; i < exact.size(); i++) {
+        double error = std::abs(blurred.data.data[i] - exact[i]);
+        max_error = std::max(max_error, error);
+        squares += error * error;
+      }
+      double rms_error = std::sqrt(squares / exact.size());
+      checks.push_back({check_name, sigma, max_error, rms_error,
+                        max_error <= max_limit && rms_error <= rms_limit});
+    }
+  }
+  return checks;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+Result run_case(const Case &bench_case, int size, int threads,
+                const Options &options) {
+  NumericArray::set_default_workers(threads);
+  auto operation = bench_case.setup(size);
+  std::vector<double> times;
+  double total = 0;
+  while (times.size() < options.min_reps ||
+         (total < options.min_time_ms && times.size() < options.max_reps)) {
+    auto start = std::chrono::steady_clock::now();
+    operation();
+    times.push_back(elapsed_ms(start));
+    total += times.back();
+  }
+  NumericArray::set_default_workers(0);
+  std::sort(times.begin(), times.end());
+  return {bench_case.name, size,     threads,
+          times[times.size() / 2], times[0], static_cast<int>(times.size())};
+}
+
+std::string to_json(const std::vector<Result> &results) {
+  std::string json = std::format("{{\n  \"hardware_concurrency\": {},\n"
+                                 "  \"results\": [\n",
+                                 std::thread::hardware_concurrency());
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &r = results[i];
+    json += std::format(
+        "    {{\"name\": \"{}\", \"size\": {}, \"threads\": {}, "
+        "\"median_ms\": {:.4f}, \"min_ms\": {:.4f}, \"reps\": {}}}{}\n",
+        r.name, r.size, r.threads, r.median_ms, r.min_ms, r.reps,
+        i + 1 < results.size() ? "," : "");
+  }
+  return json + "  ]\n}\n";
+}
+
+// Reads back the files written by to_json
+std::vector<Result> from_json(const std::string &json) {
+  auto field = [](const std::string &object, const std::string &key) {
+    auto pos = object.find("\"" + key + "\":");
+    if (pos == std::string::npos) {
+      throw std::runtime_error(std::format("Missing \"{}\" in baseline", key));
+    }
+    pos = object.find_first_not_of(" \"", pos + key.size() + 3);
+    auto end = object.find_first_of(",\"}", pos);
+    return object.substr(pos, end - pos);
+  };
+  std::vector<Result> results;
+  for (size_t pos = json.find("{\"name\""); pos != std::string::npos;
+       pos = json.find("{\"name\"", pos + 1)) {
+    auto object = json.substr(pos, json.find('}', pos) - pos + 1);
+    results.push_back({field(object, "name"), std::stoi(field(object, "size")),
+                       std::stoi(field(object, "threads")),
+                       std::stod(field(object, "median_ms")),
+                       std::stod(field(object, "min_ms")),
+                       std::stoi(field(object, "reps"))});
+  }
+  return results;
+}
+
+std::vector<int> parse_list(const std::string &text) {
+  std::vector<int> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    values.push_back(std::stoi(item));
+  }
+  return values;
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      throw std::invalid_argument("Missing value for " + arg);
+    }
+    std::string value = argv[++i];
+    if (arg == "--sizes") {
+      options.sizes = parse_list(value);
+    } else if (arg == "--threads") {
+      options.threads = parse_list(value);
+    } else if (arg == "--filter") {
+      options.filter = value;
+    } else if (arg == "--min-time") {
+      options.min_time_ms = std::stod(value);
+    } else if (arg == "--output") {
+      options.output = value;
+    } else if (arg == "--baseline") {
+      options.baseline = value;
+    } else if (arg == "--threshold") {
+      options.threshold = std::stod(value);
+    } else {
+      throw std::invalid_argument("Unknown argument " + arg);
+    }
+  }
+  if (options.threads.empty()) {
+    options.threads = {1};
+    int hardware = std::thread::hardware_concurrency();
+    if (hardware > 1) {
+      options.threads.push_back(hardware);
+    }
+  }
+  return options;
+}
+
+} // namespace Bench
+
+int main(int argc, char **argv) {
+  Bench::Options options;
+  try {
+    options = Bench::parse_options(argc, argv);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+
+  std::map<std::string, Bench::Result> baseline;
+  if (!options.baseline.empty()) {
+    std::ifstream file(options.baseline);
+    if (!file) {
+      std::cerr << "Cannot open baseline " << options.baseline << std::endl;
+      return 2;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    for (auto &result : Bench::from_json(buffer.str())) {
+      baseline[std::format("{}/{}/{}", result.name, result.size,
+                           result.threads)] = result;
+    }
+  }
+
+  int failures = 0;
+  auto checks = Bench::check_accuracy(options.filter);
+  if (!checks.empty()) {
+    std::cout << std::format("{:<34}{:>6}{:>10}{:>10}{:>8}\n", "accuracy",
+                             "sigma", "max", "rms", "");
+    for (auto &check : checks) {
+      std::cout << std::format("{:<34}{:>6}{:>10.3f}{:>10.3f}{:>8}\n",
+                               check.name, check.sigma, check.max_error,
+                               check.rms_error, check.passed ? "ok" : "FAIL");
+      failures += !check.passed;
+    }
+    std::cout << std::endl;
+  }
+
+  std::vector<Bench::Result> results;
+  int regressions = 0;
+  std::cout << std::format("{:<28}{:>6}{:>8}{:>12}{:>12}{:>6}{:>10}\n",
+                           "benchmark", "size", "threads", "median ms",
+                           "min ms", "reps", "vs base");
+  for (auto &bench_case : Bench::all_cases()) {
+    if (bench_case.name.find(options.filter) == std::string::npos) {
+      continue;
+    }
+    for (int size : options.sizes) {
+      if (size > bench_case.max_size) {
+        continue;
+      }
+      for (int threads : options.threads) {
+        auto result = Bench::run_case(bench_case, size, threads, options);
+        results.push_back(result);
+
+        std::string change;
+        auto it = baseline.find(
+            std::format("{}/{}/{}", result.name, result.size, threads));
+        if (it != baseline.end()) {
+          double ratio = result.median_ms / it->second.median_ms - 1;
+          change = std::format("{:+.1f}%", ratio * 100);
+          if (ratio > options.threshold) {
+            change += " !";
+            regressions++;
+          }
+        }
+        std::cout << std::format(
+            "{:<28}{:>6}{:>8}{:>12.3f}{:>12.3f}{:>6}{:>10}\n", result.name,
+            result.size, threads, result.median_ms, result.min_ms,
+            result.reps, change);
+      }
+    }
+  }
+
+  std::ofstream file(options.output);
+  file << Bench::to_json(results);
+  std::cout << "Results written to " << options.output << std::endl;
+  if (failures > 0) {
+    std::cout << failures << " accuracy check(s) failed" << std::endl;
+  }
+  if (regressions > 0) {
+    std::cout << regressions << " benchmark(s) regressed by more than "
+              << options.threshold * 100 << "%" << std::endl;
+  }
+  if (failures > 0 || regressions > 0) {
+    return 1;
+  }
+  return 0;
+}
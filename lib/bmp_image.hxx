@@ -5,13 +5,19 @@
 #ifndef IMAGE_PROCESSING_BMP_IMAGE_HXX
 #define IMAGE_PROCESSING_BMP_IMAGE_HXX
 
+#include "buffer_pool.hxx"
+#include "image_view.hxx"
 #include "numeric_array.hxx"
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <format>
 #include <fstream>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <set>
 #include <thread>
 #include <vector>
@@ -60,7 +66,11 @@ struct BmpPixel {
   uint8_t blue;
   uint8_t alpha;
 
-  uint8_t gray() const { return 0.299 * red + 0.587 * green + 0.114 * blue; }
+  // BT.601 luma in 16.16 fixed point. The weights sum to 65536, so gray
+  // pixels map to themselves exactly.
+  uint8_t gray() const {
+    return (19595u * red + 38470u * green + 7471u * blue) >> 16;
+  }
 
   double diff(const BmpPixel &other) const {
     return (std::abs(red - other.red) + std::abs(green - other.green) +
@@ -81,13 +91,196 @@ struct ColorPalette {
   }
 };
 
+// Perfect hash from 24-bit RGB to palette index, small enough to stay in cache.
+// Falls back to a flat 2^24 table when no multiplier separates the palette.
+struct PaletteIndex {
+  static constexpr uint32_t empty = 0xFFFFFFFF;
+  uint32_t multiplier = 256;
+  int shift = 8;
+  std::vector<uint32_t> keys;
+  std::vector<uint8_t> values;
+
+  static uint32_t key(const BmpPixel &pixel) {
+    return static_cast<uint32_t>(pixel.red) << 16 |
+           static_cast<uint32_t>(pixel.green) << 8 | pixel.blue;
+  }
+
+  explicit PaletteIndex(const ColorPalette &palette) {
+    for (int bits = 10; bits <= 16; bits++) {
+      for (uint32_t i = 0; i < 64; i++) {
+        multiplier = (0x9E3779B1u + i * 0x632BE5ABu) | 1u;
+        shift = 32 - bits;
+        if (try_build(palette, 1 << bits)) {
+          return;
+        }
+      }
+    }
+    multiplier = 256;
+    shift = 8;
+    try_build(palette, 1 << 24);
+  }
+
+  bool try_build(const ColorPalette &palette, size_t slots) {
+    keys.assign(slots, empty);
+    values.assign(slots, 0);
+    for (int i = 0; i < palette.data.size(); i++) {
+      auto k = key(palette.data[i]);
+      auto slot = slot_of(k);
+      if (keys[slot] != empty && keys[slot] != k) {
+        return false;
+      }
+      // Duplicate colors map to the last entry, as generate_map does
+      keys[slot] = k;
+      values[slot] = static_cast<uint8_t>(i);
+    }
+    return true;
+  }
+
+  uint32_t slot_of(uint32_t k) const { return (k * multiplier) >> shift; }
+
+  uint8_t operator()(const BmpPixel &pixel) const {
+    auto k = key(pixel);
+    auto slot = slot_of(k);
+    if (keys[slot] != k) {
+      throw std::runtime_error(std::format(
+          "Color ({}, {}, {}) is not in the palette", pixel.red, pixel.green,
+          pixel.blue));
+    }
+    return values[slot];
+  }
+};
+
 template <typename T> struct Image {
   ImageSize size;
   NumericArray::NumericArray<T> data;
 
   T &operator[](int i) { return data.data[i]; }
+
+  ImageView::ImageView<T> view() {
+    return {data.data.data(), size.width, size.height};
+  }
+
+  ImageView::ImageView<const T> view() const {
+    return {data.data.data(), size.width, size.height};
+  }
+};
+
+using GrayImage = Image<uint8_t>;
+
+// Structure-of-arrays RGB, one contiguous plane per channel
+struct PlanarImage {
+  ImageSize size;
+  NumericArray::NumericArray<uint8_t> red;
+  NumericArray::NumericArray<uint8_t> green;
+  NumericArray::NumericArray<uint8_t> blue;
 };
 
+GrayImage to_gray(const Image<BmpPixel> &image) {
+  GrayImage gray{image.size, NumericArray::NumericArray<uint8_t>(
+                                 image.data.data.size(), 0)};
+  const BmpPixel *src = image.data.data.data();
+  uint8_t *dst = gray.data.data.data();
+  NumericArray::parallel_for(
+      gray.data.data.size(), [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+          dst[i] = src[i].gray();
+        }
+      });
+  return gray;
+}
+
+GrayImage to_gray(const PlanarImage &image) {
+  GrayImage gray{image.size,
+                 NumericArray::NumericArray<uint8_t>(image.red.data.size(), 0)};
+  const uint8_t *r = image.red.data.data();
+  const uint8_t *g = image.green.data.data();
+  const uint8_t *b = image.blue.data.data();
+  uint8_t *dst = gray.data.data.data();
+  NumericArray::parallel_for(
+      gray.data.data.size(), [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+          dst[i] = (19595u * r[i] + 38470u * g[i] + 7471u * b[i]) >> 16;
+        }
+      });
+  return gray;
+}
+
+PlanarImage to_planar(const Image<BmpPixel> &image) {
+  size_t size = image.data.data.size();
+  PlanarImage planar{image.size, NumericArray::NumericArray<uint8_t>(size, 0),
+                     NumericArray::NumericArray<uint8_t>(size, 0),
+                     NumericArray::NumericArray<uint8_t>(size, 0)};
+  const BmpPixel *src = image.data.data.data();
+  uint8_t *r = planar.red.data.data();
+  uint8_t *g = planar.green.data.data();
+  uint8_t *b = planar.blue.data.data();
+  NumericArray::parallel_for(size, [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      r[i] = src[i].red;
+      g[i] = src[i].green;
+      b[i] = src[i].blue;
+    }
+  });
+  return planar;
+}
+
+Image<BmpPixel> to_pixels(const PlanarImage &planar) {
+  size_t size = planar.red.data.size();
+  Image<BmpPixel> image{planar.size, NumericArray::NumericArray<BmpPixel>(
+                                         size, BmpPixel{0, 0, 0, 255})};
+  const uint8_t *r = planar.red.data.data();
+  const uint8_t *g = planar.green.data.data();
+  const uint8_t *b = planar.blue.data.data();
+  BmpPixel *dst = image.data.data.data();
+  NumericArray::parallel_for(size, [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      dst[i] = {r[i], g[i], b[i], 255};
+    }
+  });
+  return image;
+}
+
+Image<BmpPixel> to_pixels(const GrayImage &gray) {
+  size_t size = gray.data.data.size();
+  Image<BmpPixel> image{gray.size, NumericArray::NumericArray<BmpPixel>(
+                                       size, BmpPixel{0, 0, 0, 255})};
+  const uint8_t *src = gray.data.data.data();
+  BmpPixel *dst = image.data.data.data();
+  NumericArray::parallel_for(size, [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      dst[i] = {src[i], src[i], src[i], 255};
+    }
+  });
+  return image;
+}
+
+// Distinct colors of an image, sorted by RGB. Uses one bit per 24-bit color;
+// the alpha of the first occurrence is kept.
+ColorPalette discover_palette(const std::vector<BmpPixel> &pixels) {
+  ColorPalette palette;
+  BufferPool::Scratch<uint64_t> seen((1 << 24) / 64, 0);
+  size_t unique_colors = 0;
+  for (auto &pixel : pixels) {
+    auto key = PaletteIndex::key(pixel);
+    auto bit = uint64_t{1} << (key & 63);
+    if (!(seen[key >> 6] & bit)) {
+      seen[key >> 6] |= bit;
+      if (++unique_colors <= 256) {
+        palette.data.push_back(pixel);
+      }
+    }
+  }
+  if (unique_colors > 256) {
+    throw std::runtime_error(std::format(
+        "Should be fewer than 256 colors, but got {} colors", unique_colors));
+  }
+  std::sort(palette.data.begin(), palette.data.end(),
+            [](const BmpPixel &lhs, const BmpPixel &rhs) {
+              return PaletteIndex::key(lhs) < PaletteIndex::key(rhs);
+            });
+  return palette;
+}
+
 struct BmpImage {
   BmpHeader header;
   Image<BmpPixel> image;
@@ -105,24 +298,7 @@ struct BmpImage {
 
   void set_bbp(int bbp) { header.infoHeader.bitsPerPixel = bbp; }
 
-  void regenerate_palette() {
-    palette.data.clear();
-    std::set<std::tuple<uint8_t, uint8_t, uint8_t, uint8_t>> unique_colors;
-    for (int i = 0; i < image.data.data.size(); i++) {
-      auto pixel = image.data.data[i];
-      unique_colors.insert(
-          std::make_tuple(pixel.red, pixel.green, pixel.blue, pixel.alpha));
-    }
-    for (auto color : unique_colors) {
-      palette.data.push_back({std::get<0>(color), std::get<1>(color),
-                              std::get<2>(color), std::get<3>(color)});
-    }
-    if (unique_colors.size() > 256) {
-      throw std::runtime_error(
-          std::format("Should be fewer than 256 colors, but got {} colors",
-                      unique_colors.size()));
-    }
-  }
+  void regenerate_palette() { palette = discover_palette(image.data.data); }
 
   void regenerate_header() {
     int header_size = 14 + this->header.infoHeader.headerSize;
@@ -158,6 +334,22 @@ struct BmpImage {
   }
 };
 
+GrayImage to_gray(const BmpImage &bmpImage) { return to_gray(bmpImage.image); }
+
+// Wraps a gray image as an 8-bit BMP; to_gray() gives back the same pixels
+BmpImage to_bmp(const GrayImage &gray) {
+  BmpImage bmpImage{
+      .header = {.fileHeader = {.fileType = 0x4D42},
+                 .infoHeader = {.headerSize = 40,
+                                .width = gray.size.width,
+                                .height = gray.size.height,
+                                .planes = 1,
+                                .bitsPerPixel = 8}},
+      .image = to_pixels(gray)};
+  bmpImage.change_to_eight_bit();
+  return bmpImage;
+}
+
 bool has_palette(int bbp) { return bbp <= 8; }
 
 void read_header(std::ifstream &file, BmpHeader &header) {
@@ -220,7 +412,8 @@ std::vector<BmpPixel> read_8_bit_image(std::ifstream &file, BmpHeader &header,
   auto image_size = width * height;
   auto padding =
       (4 - (width % 4)) % 4; // Padding per row to align to a 4-byte boundary
-  std::vector<BmpPixel> image(image_size);
+  auto image = BufferPool::acquire<BmpPixel>(image_size);
+  image.resize(image_size);
 
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
@@ -244,7 +437,8 @@ std::vector<BmpPixel> read_24_bit_image(std::ifstream &file,
   auto height = header.infoHeader.height;
   auto padding = (4 - (width * 3) % 4) %
                  4; // Each row must be padded to a multiple of 4 bytes
-  std::vector<BmpPixel> image(width * height);
+  auto image = BufferPool::acquire<BmpPixel>(width * height);
+  image.resize(width * height);
 
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
@@ -263,6 +457,7 @@ std::vector<BmpPixel> read_24_bit_image(std::ifstream &file,
 }
 
 BmpImage read_bmp(std::ifstream &file) {
+  Trace::Scope trace("read_bmp");
   BmpHeader header;
   read_header(file, header);
   if (header.fileHeader.fileType != 0x4D42) {
@@ -273,11 +468,7 @@ BmpImage read_bmp(std::ifstream &file) {
     palette = read_palette(file, header);
   }
   auto bbp = header.infoHeader.bitsPerPixel;
-  auto image_size = abs(static_cast<int64_t>(header.infoHeader.width) *
-                        static_cast<int64_t>(header.infoHeader.height));
-  auto padding = (4 - (header.infoHeader.width * bbp / 8) % 4) % 4;
   auto image = std::vector<BmpPixel>();
-  image.resize(image_size);
   if (has_palette(bbp)) {
     if (bbp == 8) {
       image = read_8_bit_image(file, header, palette);
@@ -294,8 +485,9 @@ BmpImage read_bmp(std::ifstream &file) {
   BmpImage bmpImage;
   bmpImage.header = header;
   bmpImage.image.size = {header.infoHeader.width, header.infoHeader.height};
-  bmpImage.image.data.data = image;
+  bmpImage.image.data.data = std::move(image);
   bmpImage.palette = palette;
+  trace.items = bmpImage.image.data.data.size();
   return bmpImage;
 }
 
@@ -343,58 +535,60 @@ void write_palette(std::ofstream &file, std::vector<BmpPixel> &palette) {
   }
 }
 
+// Encodes rows into a reusable band buffer in parallel and writes each band
+// with a single call. Padding bytes stay zero since they are never encoded.
+void write_rows(std::ofstream &file, int width, int height,
+                int bytes_per_pixel,
+                std::function<void(int, uint8_t *)> encode_row) {
+  size_t row_bytes = (static_cast<size_t>(width) * bytes_per_pixel + 3) & ~3;
+  if (row_bytes == 0 || height <= 0) {
+    return;
+  }
+  int band_rows = std::clamp<int>((1 << 20) / row_bytes, 1, height);
+  BufferPool::Scratch<uint8_t> band(band_rows * row_bytes, 0);
+
+  for (int y0 = 0; y0 < height; y0 += band_rows) {
+    int rows = std::min(band_rows, height - y0);
+    NumericArray::parallel_for(rows, [&](size_t start, size_t end) {
+      for (size_t r = start; r < end; r++) {
+        encode_row(y0 + r, band.data() + r * row_bytes);
+      }
+    });
+    file.write(reinterpret_cast<char *>(band.data()), rows * row_bytes);
+  }
+}
+
 void write_8_bit_image(std::ofstream &file, BmpImage &bmpImage) {
-  auto palette = bmpImage.palette.generate_map();
-  auto image = bmpImage.image.data.data;
-  auto bbp = bmpImage.header.infoHeader.bitsPerPixel;
+  PaletteIndex palette(bmpImage.palette);
+  auto &image = bmpImage.image.data.data;
   auto width = bmpImage.image.size.width;
   auto height = bmpImage.image.size.height;
-  auto padding = (4 - (width * bbp / 8) % 4) %
-                 4; // Padding per row to align to 4-byte boundary
 
-  for (int y = 0; y < height; y++) {
+  write_rows(file, width, height, 1, [&](int y, uint8_t *row) {
+    auto *pixels = image.data() + static_cast<size_t>(y) * width;
     for (int x = 0; x < width; x++) {
-      auto pixel = image[y * width + x];
-      auto index =
-          std::make_tuple(pixel.red, pixel.green, pixel.blue, pixel.alpha);
-
-      // Retrieve the corresponding palette index for the pixel color
-      uint8_t palette_pixel = static_cast<uint8_t>(palette.at(index));
-      file.write(reinterpret_cast<char *>(&palette_pixel),
-                 sizeof(palette_pixel));
+      row[x] = palette(pixels[x]);
     }
-
-    // Write padding bytes at the end of each row
-    for (int p = 0; p < padding; p++) {
-      uint8_t padding_byte = 0;
-      file.write(reinterpret_cast<char *>(&padding_byte), sizeof(padding_byte));
-    }
-  }
+  });
 }
 
 void write_24_bit_image(std::ofstream &file, BmpImage &bmpImage) {
-  auto image = bmpImage.image.data.data;
-  auto bbp = bmpImage.header.infoHeader.bitsPerPixel;
+  auto &image = bmpImage.image.data.data;
   auto width = bmpImage.image.size.width;
   auto height = bmpImage.image.size.height;
-  auto padding = (4 - (width * bbp / 8) % 4) %
-                 4; // Padding per row to align to 4-byte boundary
-  for (int y = 0; y < height; y++) {
+
+  write_rows(file, width, height, 3, [&](int y, uint8_t *row) {
+    auto *pixels = image.data() + static_cast<size_t>(y) * width;
     for (int x = 0; x < width; x++) {
-      auto pixel = image[y * width + x];
-      file.write(reinterpret_cast<char *>(&pixel.blue), sizeof(pixel.blue));
-      file.write(reinterpret_cast<char *>(&pixel.green), sizeof(pixel.green));
-      file.write(reinterpret_cast<char *>(&pixel.red), sizeof(pixel.red));
+      row[3 * x] = pixels[x].blue;
+      row[3 * x + 1] = pixels[x].green;
+      row[3 * x + 2] = pixels[x].red;
     }
-    // Write padding bytes at the end of each row
-    for (int p = 0; p < padding; p++) {
-      uint8_t padding_byte = 0;
-      file.write(reinterpret_cast<char *>(&padding_byte), sizeof(padding_byte));
-    }
-  }
+  });
 }
 
 void write_bmp(std::ofstream &file, BmpImage &bmpImage) {
+  Trace::Scope trace("write_bmp", bmpImage.image.data.data.size());
   if (bmpImage.header.infoHeader.bitsPerPixel == 8) {
     bmpImage.regenerate_palette();
     bmpImage.regenerate_header();
@@ -408,15 +602,25 @@ void write_bmp(std::ofstream &file, BmpImage &bmpImage) {
   }
 }
 
-BmpImage gray_balanced_image(BmpImage &bmpImage) {
-  // copy the image
-  BmpImage gray_balanced_image = bmpImage;
-  gray_balanced_image.change_to_eight_bit();
-  std::vector<int> counter(256, 0);
-  gray_balanced_image.image.data.foreach (
-      [&](BmpPixel &pixel) { counter[pixel.gray()]++; });
-  int total_pixels = gray_balanced_image.image.size.width *
-                     gray_balanced_image.image.size.height;
+// Global equalization of the luma, as an 8-bit gray image. The histogram is
+// counted per worker and merged, and the palette is built once at the end.
+BmpImage gray_balanced_image(const BmpImage &bmpImage) {
+  Trace::Scope trace("gray_balanced_image",
+                     bmpImage.image.data.data.size());
+  size_t total_pixels = bmpImage.image.data.data.size();
+  const BmpPixel *src = bmpImage.image.data.data.data();
+  std::vector<int64_t> counter(256, 0);
+  std::mutex mutex;
+  NumericArray::parallel_for(total_pixels, [&](size_t start, size_t end) {
+    std::vector<int64_t> local(256, 0);
+    for (size_t i = start; i < end; i++) {
+      local[src[i].gray()]++;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < 256; i++) {
+      counter[i] += local[i];
+    }
+  });
   std::vector<double> prob(256, 0);
   for (int i = 0; i < 256; i++) {
     prob[i] = static_cast<double>(counter[i]) / total_pixels;
@@ -426,14 +630,22 @@ BmpImage gray_balanced_image(BmpImage &bmpImage) {
   for (int i = 1; i < 256; i++) {
     cdf[i] = cdf[i - 1] + prob[i];
   }
-  gray_balanced_image.image.data.foreach ([&](BmpPixel &pixel) {
-    auto value = static_cast<uint8_t>(cdf[pixel.gray()] * 255);
-    pixel.red = value;
-    pixel.green = value;
-    pixel.blue = value;
+  std::array<uint8_t, 256> lut;
+  for (int i = 0; i < 256; i++) {
+    lut[i] = static_cast<uint8_t>(cdf[i] * 255);
+  }
+
+  BmpImage gray_balanced_image = bmpImage;
+  BmpPixel *dst = gray_balanced_image.image.data.data.data();
+  NumericArray::parallel_for(total_pixels, [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      auto value = lut[dst[i].gray()];
+      dst[i].red = value;
+      dst[i].green = value;
+      dst[i].blue = value;
+    }
   });
-  gray_balanced_image.regenerate_palette();
-  gray_balanced_image.regenerate_header();
+  gray_balanced_image.change_to_eight_bit();
   return gray_balanced_image;
 }
 
@@ -0,0 +1,235 @@
+#ifndef IMAGE_PROCESSING_BMP_STREAM_HXX
+#define IMAGE_PROCESSING_BMP_STREAM_HXX
+
+#include "bmp_image.hxx"
+#include "convolution.hxx"
+#include "plot.hxx"
+#include "segmentation.hxx"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Strip-based BMP processing: only a few rows of the image are held in memory
+// at a time, so images larger than RAM can be filtered.
+namespace BmpStream {
+
+size_t row_bytes(int width, int bbp) {
+  return (static_cast<size_t>(width) * bbp / 8 + 3) & ~size_t{3};
+}
+
+struct BmpReader {
+  std::ifstream file;
+  BmpImage::BmpHeader header;
+  BmpImage::ColorPalette palette;
+  int width;
+  int height;
+
+  explicit BmpReader(const std::string &path)
+      : file(path, std::ios::binary) {
+    if (!file) {
+      throw std::runtime_error(std::format("Cannot open {}", path));
+    }
+    BmpImage::read_header(file, header);
+    if (header.fileHeader.fileType != 0x4D42) {
+      throw std::runtime_error("Not a BMP file");
+    }
+    auto bbp = header.infoHeader.bitsPerPixel;
+    if (bbp != 8 && bbp != 24) {
+      throw std::runtime_error("Unsupported bit depth");
+    }
+    if (header.infoHeader.height < 0) {
+      throw std::runtime_error("Top-down BMP files are not supported");
+    }
+    if (BmpImage::has_palette(bbp)) {
+      palette = BmpImage::read_palette(file, header);
+    }
+    width = header.infoHeader.width;
+    height = header.infoHeader.height;
+  }
+
+  // Reads rows [y, y + rows) as a standalone 24-bit strip image
+  BmpImage::BmpImage read_rows(int y, int rows) {
+    auto bbp = header.infoHeader.bitsPerPixel;
+    auto stride = row_bytes(width, bbp);
+    std::vector<uint8_t> raw(stride * rows);
+    file.seekg(header.fileHeader.pixelDataOffset + y * stride);
+    file.read(reinterpret_cast<char *>(raw.data()), raw.size());
+
+    auto strip = Plot::generate_blank_canvas(width, rows);
+    auto &pixels = strip.image.data.data;
+    NumericArray::parallel_for(rows, [&](size_t start, size_t end) {
+      for (size_t r = start; r < end; r++) {
+        const uint8_t *src = raw.data() + r * stride;
+        BmpImage::BmpPixel *dst = pixels.data() + r * width;
+        for (int x = 0; x < width; x++) {
+          if (bbp == 8) {
+            dst[x] = palette.data[src[x]];
+          } else {
+            dst[x] = {src[3 * x + 2], src[3 * x + 1], src[3 * x], 255};
+          }
+        }
+      }
+    });
+    return strip;
+  }
+};
+
+struct BmpWriter {
+  std::ofstream file;
+  BmpImage::BmpHeader header;
+  BmpImage::ColorPalette palette;
+  std::optional<BmpImage::PaletteIndex> index;
+  int width;
+
+  // 8-bit output needs its palette up front, since the header precedes rows
+  BmpWriter(const std::string &path, int width, int height, int bbp = 24,
+            BmpImage::ColorPalette palette = {})
+      : file(path, std::ios::binary), palette(std::move(palette)),
+        width(width) {
+    if (bbp != 8 && bbp != 24) {
+      throw std::runtime_error("Unsupported bit depth");
+    }
+    if (bbp == 8) {
+      if (this->palette.data.empty() || this->palette.data.size() > 256) {
+        throw std::runtime_error(
+            "8-bit output needs a palette of 1-256 colors");
+      }
+      index.emplace(this->palette);
+    }
+    int palette_size = this->palette.data.size() * 4;
+    header = BmpImage::BmpHeader{
+        .fileHeader = {.fileType = 0x4D42},
+        .infoHeader = {
+            .headerSize = 40,
+            .width = width,
+            .height = height,
+            .planes = 1,
+            .bitsPerPixel = static_cast<uint16_t>(bbp),
+            .totalColors = static_cast<uint32_t>(this->palette.data.size()),
+        }};
+    header.fileHeader.pixelDataOffset = 14 + 40 + palette_size;
+    header.fileHeader.fileSize =
+        header.fileHeader.pixelDataOffset + row_bytes(width, bbp) * height;
+    BmpImage::write_header(file, header);
+    BmpImage::write_palette(file, this->palette.data);
+  }
+
+  // Appends rows [first_row, first_row + rows) of a strip image
+  void write_rows(BmpImage::BmpImage &strip, int first_row, int rows) {
+    auto *pixels = strip.image.data.data.data() +
+                   static_cast<size_t>(first_row) * width;
+    if (index) {
+      BmpImage::write_rows(file, width, rows, 1, [&](int y, uint8_t *row) {
+        for (int x = 0; x < width; x++) {
+          row[x] = (*index)(pixels[static_cast<size_t>(y) * width + x]);
+        }
+      });
+    } else {
+      BmpImage::write_rows(file, width, rows, 3, [&](int y, uint8_t *row) {
+        for (int x = 0; x < width; x++) {
+          auto &pixel = pixels[static_cast<size_t>(y) * width + x];
+          row[3 * x] = pixel.blue;
+          row[3 * x + 1] = pixel.green;
+          row[3 * x + 2] = pixel.red;
+        }
+      });
+    }
+  }
+};
+
+// An operation applied to one strip. `halo` is the number of extra rows the
+// operation needs above and below each output row.
+struct StripOperation {
+  int halo = 0;
+  std::function<BmpImage::BmpImage(BmpImage::BmpImage &)> apply;
+};
+
+StripOperation
+pointwise(std::function<BmpImage::BmpPixel(BmpImage::BmpPixel)> func) {
+  return {0, [func](BmpImage::BmpImage &strip) {
+            strip.image.data.foreach (
+                [&](BmpImage::BmpPixel &pixel) { pixel = func(pixel); });
+            return strip;
+          }};
+}
+
+StripOperation convolution(std::vector<std::vector<double>> kernel) {
+  int halo = kernel.size() / 2;
+  return {halo, [kernel](BmpImage::BmpImage &strip) {
+            return Convolution::apply_kernel(strip, kernel);
+          }};
+}
+
+StripOperation median(size_t kernel_size, int k) {
+  return {static_cast<int>(kernel_size / 2),
+          [kernel_size, k](BmpImage::BmpImage &strip) {
+            return Convolution::apply_mid_value_kernel(strip, kernel_size, k);
+          }};
+}
+
+StripOperation threshold(int threshold,
+                         BmpImage::BmpPixel left_color = {0, 0, 0, 255},
+                         BmpImage::BmpPixel right_color = {255, 255, 255,
+                                                           255}) {
+  return {0, [=](BmpImage::BmpImage &strip) {
+            return Segmentation::SegmentationByThreshold::segment_by_threshold(
+                strip, threshold, left_color, right_color);
+          }};
+}
+
+// Streams `in_path` through `operations` strip by strip into `out_path`. Each
+// strip is read with the summed halo of all operations, so rows written out
+// match whole-image processing. The next strip is read while the current one
+// is processed and written.
+void process_strips(const std::string &in_path, const std::string &out_path,
+                    const std::vector<StripOperation> &operations,
+                    int strip_height = 256, int out_bbp = 24,
+                    BmpImage::ColorPalette out_palette = {}) {
+  if (strip_height <= 0) {
+    throw std::invalid_argument("Strip height must be positive.");
+  }
+  BmpReader reader(in_path);
+  BmpWriter writer(out_path, reader.width, reader.height, out_bbp,
+                   std::move(out_palette));
+  Trace::Scope trace("process_strips",
+                     static_cast<size_t>(reader.width) * reader.height);
+  int halo = 0;
+  for (auto &operation : operations) {
+    halo += operation.halo;
+  }
+
+  struct Strip {
+    BmpImage::BmpImage image;
+    int top_halo;
+    int rows;
+  };
+  auto read_strip = [&](int y) {
+    int rows = std::min(strip_height, reader.height - y);
+    int first = std::max(0, y - halo);
+    int last = std::min(reader.height, y + rows + halo);
+    return Strip{reader.read_rows(first, last - first), y - first, rows};
+  };
+
+  if (reader.height == 0) {
+    return;
+  }
+  auto next = std::async(std::launch::async, read_strip, 0);
+  for (int y = 0; y < reader.height; y += strip_height) {
+    auto strip = next.get();
+    if (y + strip_height < reader.height) {
+      next = std::async(std::launch::async, read_strip, y + strip_height);
+    }
+    for (auto &operation : operations) {
+      strip.image = operation.apply(strip.image);
+    }
+    writer.write_rows(strip.image, strip.top_halo, strip.rows);
+  }
+}
+
+} // namespace BmpStream
+
+#endif
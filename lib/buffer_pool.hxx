@@ -0,0 +1,236 @@
+#ifndef IMAGE_PROCESSING_BUFFER_POOL_HXX
+#define IMAGE_PROCESSING_BUFFER_POOL_HXX
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Recycles large element buffers between processing stages. Released buffers
+// are kept in buckets by capacity (one per power of two), so a later request
+// of a similar size reuses one instead of going back to the allocator.
+// NumericArray draws from and returns to the pool, which keeps a batch run
+// from allocating fresh multi-megabyte buffers for every stage of every image.
+namespace BufferPool {
+
+// Smaller buffers bypass the pool and are not counted
+constexpr size_t min_pooled_bytes = 64 * 1024;
+
+struct Counters {
+  size_t acquired = 0;        // requests for pooled-size buffers
+  size_t reused = 0;          // requests served from the pool
+  size_t allocations = 0;     // requests that had to allocate
+  size_t allocated_bytes = 0; // bytes reserved by those allocations
+  size_t released = 0;        // buffers taken back into the pool
+  size_t dropped = 0;         // buffers freed because the pool was full
+};
+
+namespace detail {
+
+struct AtomicCounters {
+  std::atomic<size_t> acquired{0};
+  std::atomic<size_t> reused{0};
+  std::atomic<size_t> allocations{0};
+  std::atomic<size_t> allocated_bytes{0};
+  std::atomic<size_t> released{0};
+  std::atomic<size_t> dropped{0};
+};
+
+// Never destroyed, so arrays released during static destruction are safe
+AtomicCounters &counters() {
+  static auto *instance = new AtomicCounters();
+  return *instance;
+}
+
+struct Limit {
+  std::atomic<size_t> max_bytes{size_t{1} << 30};
+  std::atomic<size_t> pooled_bytes{0};
+};
+
+Limit &limit() {
+  static auto *instance = new Limit();
+  return *instance;
+}
+
+template <typename T> struct Pool {
+  std::mutex mutex;
+  // buckets[b] holds buffers whose capacity is in [2^b, 2^(b + 1))
+  std::vector<std::vector<std::vector<T>>> buckets =
+      std::vector<std::vector<std::vector<T>>>(64);
+
+  // A pooled buffer with capacity for `size` elements, or an empty one
+  std::vector<T> take(size_t size) {
+    int bucket = std::bit_width(size) - 1;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &same = buckets[bucket];
+    for (size_t i = 0; i < same.size(); i++) {
+      if (same[i].capacity() >= size) {
+        return pop(same, i);
+      }
+    }
+    // Anything one bucket up is large enough without wasting more than 4x
+    if (bucket + 1 < 64 && !buckets[bucket + 1].empty()) {
+      return pop(buckets[bucket + 1], buckets[bucket + 1].size() - 1);
+    }
+    return {};
+  }
+
+  std::vector<T> pop(std::vector<std::vector<T>> &bucket, size_t i) {
+    std::swap(bucket[i], bucket.back());
+    auto buffer = std::move(bucket.back());
+    bucket.pop_back();
+    limit().pooled_bytes -= buffer.capacity() * sizeof(T);
+    return buffer;
+  }
+
+  // Returns false when the buffer does not fit under the pool limit. The
+  // bytes are reserved before the buffer is stored, so concurrent releases
+  // into any pool cannot overshoot the shared cap.
+  bool put(std::vector<T> &&buffer) {
+    size_t bytes = buffer.capacity() * sizeof(T);
+    auto &pooled = limit().pooled_bytes;
+    size_t current = pooled.load();
+    do {
+      if (current + bytes > limit().max_bytes) {
+        return false;
+      }
+    } while (!pooled.compare_exchange_weak(current, current + bytes));
+    buffer.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    buckets[std::bit_width(buffer.capacity()) - 1].push_back(
+        std::move(buffer));
+    return true;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &bucket : buckets) {
+      for (auto &buffer : bucket) {
+        limit().pooled_bytes -= buffer.capacity() * sizeof(T);
+      }
+      bucket.clear();
+    }
+  }
+};
+
+template <typename T> Pool<T> &pool() {
+  static auto *instance = new Pool<T>();
+  return *instance;
+}
+
+// `size` rounded up to an eighth of its power of two, so that images of
+// similar shape (e.g. a batch from one camera) can use each other's buffers
+size_t rounded_capacity(size_t size) {
+  size_t step = std::max<size_t>(std::bit_floor(size) / 8, 1);
+  return (size + step - 1) / step * step;
+}
+
+} // namespace detail
+
+// An empty vector with capacity for at least `size` elements
+template <typename T> std::vector<T> acquire(size_t size) {
+  if (size * sizeof(T) < min_pooled_bytes) {
+    std::vector<T> buffer;
+    buffer.reserve(size);
+    return buffer;
+  }
+  auto &counters = detail::counters();
+  counters.acquired++;
+  auto buffer = detail::pool<T>().take(size);
+  if (buffer.capacity() >= size) {
+    counters.reused++;
+    return buffer;
+  }
+  buffer.reserve(detail::rounded_capacity(size));
+  counters.allocations++;
+  counters.allocated_bytes += buffer.capacity() * sizeof(T);
+  return buffer;
+}
+
+// Hands a buffer back; small buffers are simply freed
+template <typename T> void release(std::vector<T> &&buffer) {
+  if (buffer.capacity() * sizeof(T) < min_pooled_bytes) {
+    return;
+  }
+  auto &counters = detail::counters();
+  if (detail::pool<T>().put(std::move(buffer))) {
+    counters.released++;
+  } else {
+    counters.dropped++;
+  }
+}
+
+// Counts a large buffer allocated outside the pool (e.g. a nested-vector
+// accumulator), so per-image allocation figures cover it too
+void count_allocation(size_t bytes) {
+  if (bytes < min_pooled_bytes) {
+    return;
+  }
+  auto &counters = detail::counters();
+  counters.allocations++;
+  counters.allocated_bytes += bytes;
+}
+
+// Working storage of a stage: `size` elements drawn from the pool and handed
+// back when it goes out of scope
+template <typename T> struct Scratch {
+  std::vector<T> buffer;
+
+  Scratch() = default;
+
+  explicit Scratch(size_t size, const T &value = T{})
+      : buffer(acquire<T>(size)) {
+    buffer.assign(size, value);
+  }
+
+  Scratch(const Scratch &) = delete;
+  Scratch &operator=(const Scratch &) = delete;
+
+  ~Scratch() { release(std::move(buffer)); }
+
+  // Contents up to the old size are kept, like std::vector::resize
+  void resize(size_t size) {
+    if (size > buffer.capacity()) {
+      auto larger = acquire<T>(size);
+      larger.assign(buffer.begin(), buffer.end());
+      release(std::move(buffer));
+      buffer = std::move(larger);
+    }
+    buffer.resize(size);
+  }
+
+  T *data() { return buffer.data(); }
+  const T *data() const { return buffer.data(); }
+  size_t size() const { return buffer.size(); }
+  T *begin() { return buffer.data(); }
+  T *end() { return buffer.data() + buffer.size(); }
+  T &operator[](size_t i) { return buffer[i]; }
+  const T &operator[](size_t i) const { return buffer[i]; }
+};
+
+// Frees every pooled buffer of element type T
+template <typename T> void clear() { detail::pool<T>().clear(); }
+
+// Caps the bytes held by all pools together; buffers released beyond the
+// cap are freed instead
+void set_limit(size_t max_bytes) { detail::limit().max_bytes = max_bytes; }
+
+size_t pooled_bytes() { return detail::limit().pooled_bytes; }
+
+Counters counters() {
+  auto &c = detail::counters();
+  return {c.acquired, c.reused, c.allocations,
+          c.allocated_bytes, c.released, c.dropped};
+}
+
+void reset_counters() {
+  auto &c = detail::counters();
+  c.acquired = c.reused = c.allocations = 0;
+  c.allocated_bytes = c.released = c.dropped = 0;
+}
+
+} // namespace BufferPool
+
+#endif
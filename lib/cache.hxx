@@ -0,0 +1,380 @@
+#ifndef IMAGE_PROCESSING_CACHE_HXX
+#define IMAGE_PROCESSING_CACHE_HXX
+
+#include "image_view.hxx"
+#include "trace.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// On-disk cache for expensive stage results. Entries are keyed by a hash
+// of the stage's input pixels and parameters, so a rerun on unchanged
+// inputs loads the result instead of recomputing it. Each entry is one
+// file: a fixed header followed by the raw rows x columns elements, which
+// load() maps read-only without copying. Touching an entry on every hit
+// keeps file times in use order, and the oldest entries are deleted once
+// the directory outgrows its size limit. Inputs too small to be worth a
+// file are never cached. Disabled until enable() is called; a disabled
+// lookup costs one relaxed atomic load.
+namespace Cache {
+
+// 64-bit content hash, 8 bytes per multiply-fold step
+struct Hasher {
+  uint64_t state = 0x9e3779b97f4a7c15;
+  size_t bytes = 0;
+
+  static uint64_t mix(uint64_t a, uint64_t b) {
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^
+           static_cast<uint64_t>(product >> 64);
+  }
+
+  Hasher &add(const void *data, size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    this->bytes += size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i, 8);
+      state = mix(state ^ word, 0xbf58476d1ce4e5b9);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    state = mix(state ^ tail ^ (static_cast<uint64_t>(size) << 56),
+                0x94d049bb133111eb);
+    return *this;
+  }
+
+  template <typename T>
+    requires std::is_trivially_copyable_v<T>
+  Hasher &add(const T &value) {
+    return add(&value, sizeof(T));
+  }
+
+  Hasher &add(const std::string &value) {
+    return add(value.data(), value.size());
+  }
+
+  // Pixels row by row, so strided views hash like contiguous ones
+  template <typename T> Hasher &add(ImageView::ImageView<const T> view) {
+    add(view.width).add(view.height);
+    for (int y = 0; y < view.height; y++) {
+      add(view.row(y), sizeof(T) * view.width);
+    }
+    return *this;
+  }
+
+  uint64_t digest() const { return mix(state, 0xff51afd7ed558ccd); }
+};
+
+namespace detail {
+
+struct Config {
+  std::atomic<bool> enabled{false};
+  std::mutex mutex;
+  std::filesystem::path dir;
+  size_t max_bytes = 0;
+  // Size of the entries in dir, counted once by enable() and kept up to
+  // date by store() and evict()
+  uintmax_t total_bytes = 0;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+};
+
+Config &config() {
+  static auto *instance = new Config();
+  return *instance;
+}
+
+// Below this much hashed input, recomputing is cheaper than an entry
+constexpr size_t min_input_bytes = size_t{32} << 10;
+
+constexpr char magic[8] = {'I', 'P', 'C', 'A', 'C', 'H', 'E', '1'};
+
+// 32 bytes, so the elements that follow are aligned for any pixel type
+struct Header {
+  char magic[8];
+  uint32_t element_size;
+  uint32_t reserved;
+  uint64_t rows;
+  uint64_t columns;
+};
+
+std::filesystem::path entry_path(const std::string &stage, uint64_t key) {
+  return config().dir / std::format("{}-{:016x}.bin", stage, key);
+}
+
+// Deletes the least recently used entries until the directory fits, and
+// recounts total_bytes, which other processes sharing dir may have moved
+void evict() {
+  namespace fs = std::filesystem;
+  std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+  uintmax_t total = 0;
+  std::error_code error;
+  for (const auto &entry : fs::directory_iterator(config().dir, error)) {
+    if (entry.path().extension() != ".bin" || !entry.is_regular_file()) {
+      continue;
+    }
+    total += entry.file_size(error);
+    entries.emplace_back(entry.last_write_time(error), entry.path());
+  }
+  std::sort(entries.begin(), entries.end());
+  for (const auto &[time, path] : entries) {
+    if (total <= config().max_bytes) {
+      break;
+    }
+    uintmax_t size = fs::file_size(path, error);
+    if (fs::remove(path, error)) {
+      total -= size;
+    }
+  }
+  config().total_bytes = total;
+}
+
+} // namespace detail
+
+// Caches into `dir`, created if needed, holding at most max_bytes
+void enable(const std::filesystem::path &dir,
+            size_t max_bytes = size_t{256} << 20) {
+  auto &config = detail::config();
+  std::lock_guard lock(config.mutex);
+  std::filesystem::create_directories(dir);
+  config.dir = dir;
+  config.max_bytes = max_bytes;
+  detail::evict();
+  config.enabled = true;
+}
+
+void disable() { detail::config().enabled = false; }
+
+bool enabled() {
+  return detail::config().enabled.load(std::memory_order_relaxed);
+}
+
+// Read-only mapping of one entry; row(y) points straight into the file
+template <typename T> struct Mapped {
+  void *address = nullptr;
+  size_t length = 0;
+  size_t rows = 0;
+  size_t columns = 0;
+
+  Mapped() = default;
+  Mapped(const Mapped &) = delete;
+  Mapped &operator=(const Mapped &) = delete;
+  Mapped(Mapped &&other) noexcept { *this = std::move(other); }
+  Mapped &operator=(Mapped &&other) noexcept {
+    std::swap(address, other.address);
+    std::swap(length, other.length);
+    rows = other.rows;
+    columns = other.columns;
+    return *this;
+  }
+  ~Mapped() {
+    if (address) {
+      munmap(address, length);
+    }
+  }
+
+  const T *data() const {
+    return reinterpret_cast<const T *>(static_cast<const char *>(address) +
+                                       sizeof(detail::Header));
+  }
+
+  const T *row(size_t y) const { return data() + y * columns; }
+
+  ImageView::ImageView<const T> view() const {
+    return {data(), static_cast<int>(columns), static_cast<int>(rows)};
+  }
+};
+
+// Image-shaped result, either computed into `owned` or mapped from an
+// entry; view() reads whichever holds the pixels
+template <typename T> struct Image {
+  int width = 0;
+  int height = 0;
+  std::vector<T> owned;
+  Mapped<T> mapped;
+
+  const T *data() const {
+    return mapped.address ? mapped.data() : owned.data();
+  }
+
+  size_t size() const { return static_cast<size_t>(width) * height; }
+
+  const T &operator()(int x, int y) const {
+    return data()[static_cast<size_t>(y) * width + x];
+  }
+
+  ImageView::ImageView<const T> view() const {
+    return {data(), width, height};
+  }
+};
+
+// The entry for (stage, key), if present and well formed
+template <typename T>
+std::optional<Mapped<T>> load(const std::string &stage, uint64_t key) {
+  if (!enabled()) {
+    return std::nullopt;
+  }
+  auto path = detail::entry_path(stage, key);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    Trace::count("cache_misses", ++detail::config().misses);
+    return std::nullopt;
+  }
+  struct stat info;
+  Mapped<T> mapped;
+  if (fstat(fd, &info) == 0 &&
+      static_cast<size_t>(info.st_size) >= sizeof(detail::Header)) {
+    mapped.length = info.st_size;
+    mapped.address =
+        mmap(nullptr, mapped.length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped.address == MAP_FAILED) {
+      mapped.address = nullptr;
+    }
+  }
+  close(fd);
+  if (!mapped.address) {
+    return std::nullopt;
+  }
+  detail::Header header;
+  std::memcpy(&header, mapped.address, sizeof(header));
+  if (std::memcmp(header.magic, detail::magic, sizeof(detail::magic)) != 0 ||
+      header.element_size != sizeof(T) ||
+      mapped.length !=
+          sizeof(header) + header.rows * header.columns * sizeof(T)) {
+    return std::nullopt;
+  }
+  mapped.rows = header.rows;
+  mapped.columns = header.columns;
+  std::error_code error;
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), error);
+  Trace::count("cache_hits", ++detail::config().hits);
+  return mapped;
+}
+
+// Writes the entry under a temporary name and renames it into place, so
+// concurrent readers never see a partial file; then trims the directory
+// if the entry took it over the limit.
+// row_at(y) gives row y of `columns` elements.
+template <typename T, typename RowAt>
+void store(const std::string &stage, uint64_t key, size_t rows,
+           size_t columns, RowAt row_at) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if (!enabled()) {
+    return;
+  }
+  auto path = detail::entry_path(stage, key);
+  auto temporary = path;
+  temporary += std::format(
+      ".{}.{}.tmp", getpid(),
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream out(temporary, std::ios::binary);
+    detail::Header header{};
+    std::memcpy(header.magic, detail::magic, sizeof(detail::magic));
+    header.element_size = sizeof(T);
+    header.rows = rows;
+    header.columns = columns;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (size_t y = 0; y < rows; y++) {
+      out.write(reinterpret_cast<const char *>(row_at(y)),
+                sizeof(T) * columns);
+    }
+    if (!out) {
+      std::error_code error;
+      std::filesystem::remove(temporary, error);
+      return;
+    }
+  }
+  auto &config = detail::config();
+  std::lock_guard lock(config.mutex);
+  std::error_code missing, error;
+  uintmax_t replaced = std::filesystem::file_size(path, missing);
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    std::filesystem::remove(temporary, error);
+    return;
+  }
+  config.total_bytes += sizeof(detail::Header) + sizeof(T) * rows * columns;
+  if (!missing) {
+    config.total_bytes -= std::min(replaced, config.total_bytes);
+  }
+  if (config.total_bytes > config.max_bytes) {
+    detail::evict();
+  }
+}
+
+// Nested-vector results: loaded from the cache, or computed and stored.
+// key(hasher) adds the inputs and parameters; it only runs when enabled.
+template <typename T, typename Key, typename Compute>
+std::vector<std::vector<T>> matrix(const std::string &stage, Key key,
+                                   Compute compute) {
+  if (!enabled()) {
+    return compute();
+  }
+  Hasher hasher;
+  key(hasher);
+  if (hasher.bytes < detail::min_input_bytes) {
+    return compute();
+  }
+  uint64_t digest = hasher.digest();
+  if (auto mapped = load<T>(stage, digest)) {
+    std::vector<std::vector<T>> result(mapped->rows);
+    for (size_t y = 0; y < mapped->rows; y++) {
+      result[y].assign(mapped->row(y), mapped->row(y) + mapped->columns);
+    }
+    return result;
+  }
+  auto result = compute();
+  if (!result.empty()) {
+    store<T>(stage, digest, result.size(), result[0].size(),
+             [&](size_t y) { return result[y].data(); });
+  }
+  return result;
+}
+
+// Flat image results, which a warm load maps instead of copying.
+// compute() returns an Image holding its pixels in `owned`.
+template <typename T, typename Key, typename Compute>
+Image<T> image(const std::string &stage, Key key, Compute compute) {
+  if (!enabled()) {
+    return compute();
+  }
+  Hasher hasher;
+  key(hasher);
+  if (hasher.bytes < detail::min_input_bytes) {
+    return compute();
+  }
+  uint64_t digest = hasher.digest();
+  if (auto mapped = load<T>(stage, digest)) {
+    return Image<T>{static_cast<int>(mapped->columns),
+                    static_cast<int>(mapped->rows), {}, std::move(*mapped)};
+  }
+  auto result = compute();
+  store<T>(stage, digest, result.height, result.width,
+           [&](size_t y) { return result.owned.data() + y * result.width; });
+  return result;
+}
+
+} // namespace Cache
+
+#endif
@@ -3,7 +3,9 @@
 
 #include "bmp_image.hxx"
 #include "numeric_array.hxx"
+#include "stencil.hxx"
 #include <algorithm>
+#include <array>
 #include <vector>
 
 namespace Convolution {
@@ -17,10 +19,18 @@ BmpImage::BmpPixel &get_pixel_with_padding(BmpImage::BmpImage &img, int x,
   return img.image.data.data[y * width + x];
 }
 
-BmpImage::BmpImage
-apply_kernel(BmpImage::BmpImage &img_src,
-             const std::vector<std::vector<double>> &kernel) {
-  BmpImage::BmpImage img = img_src;
+using PixelView = ImageView::ImageView<const BmpImage::BmpPixel>;
+
+const BmpImage::BmpPixel &get_pixel_with_padding(PixelView img, int x, int y) {
+  x = std::clamp(x, 0, img.width - 1);
+  y = std::clamp(y, 0, img.height - 1);
+  return img(x, y);
+}
+
+// Any odd sized kernel, one tap at a time
+BmpImage::Image<BmpImage::BmpPixel>
+apply_kernel_generic(PixelView img,
+                     const std::vector<std::vector<double>> &kernel) {
   int kernel_size = kernel.size();
   int kernel_half_size = kernel_size / 2;
 
@@ -30,20 +40,16 @@ apply_kernel(BmpImage::BmpImage &img_src,
   }
 
   // Create a new array to store the convolved image
-  NumericArray::NumericArray<BmpImage::BmpPixel> newData(
-      img.image.data.data.size(),
-      BmpImage::BmpPixel{
-          .red = 0,
-          .green = 0,
-          .blue = 0,
-          .alpha = 255 // Assuming alpha remains 255 for all pixels
-      });
-
-  int width = img.image.size.width;
-  int height = img.image.size.height;
+  // Assuming alpha remains 255 for all pixels
+  BmpImage::Image<BmpImage::BmpPixel> result{
+      {img.width, img.height},
+      NumericArray::NumericArray<BmpImage::BmpPixel>(
+          img.size(), BmpImage::BmpPixel{0, 0, 0, 255})};
+
+  int width = img.width;
 
   // Perform convolution
-  img.image.data.foreach ([&](BmpImage::BmpPixel &pxl, size_t idx) {
+  result.data.foreach ([&](BmpImage::BmpPixel &new_pixel, size_t idx) {
     int x = idx % width;
     int y = idx / width;
 
@@ -63,42 +69,82 @@ apply_kernel(BmpImage::BmpImage &img_src,
     }
 
     // Assign the convolved values to the new pixel array
-    BmpImage::BmpPixel &new_pixel = newData.data[idx];
     new_pixel.red = std::clamp(static_cast<int>(red), 0, 255);
     new_pixel.green = std::clamp(static_cast<int>(green), 0, 255);
     new_pixel.blue = std::clamp(static_cast<int>(blue), 0, 255);
   });
-  img.image.data = newData;
-  return img;
+  return result;
 }
 
-BmpImage::BmpImage apply_mid_value_kernel(BmpImage::BmpImage &img_src,
-                                          size_t kernel_size, int k) {
-  BmpImage::BmpImage img = img_src;
+BmpImage::Image<BmpImage::BmpPixel>
+apply_stencil(PixelView img, const Stencil::Specialized &stencil) {
+  BmpImage::Image<BmpImage::BmpPixel> result{
+      {img.width, img.height},
+      NumericArray::NumericArray<BmpImage::BmpPixel>(
+          img.size(), BmpImage::BmpPixel{0, 0, 0, 255})};
+  int half = stencil.size / 2;
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    std::array<const BmpImage::BmpPixel *, Stencil::max_size> rows;
+    for (int y = start; y < end; y++) {
+      for (int i = 0; i < stencil.size; i++) {
+        rows[i] = img.row(std::clamp(y + i - half, 0, img.height - 1));
+      }
+      stencil.apply_row(rows.data(), img.width,
+                        result.data.data.data() +
+                            static_cast<size_t>(y) * img.width);
+    }
+  });
+  return result;
+}
+
+// Common kernels (box, Gaussian, Sobel, Prewitt, LoG) run as compiled
+// stencils, anything else through the generic loop
+BmpImage::Image<BmpImage::BmpPixel>
+apply_kernel(PixelView img, const std::vector<std::vector<double>> &kernel) {
+  Trace::Scope trace("apply_kernel", img.size());
+  if (auto stencil = Stencil::specialize(kernel)) {
+    return apply_stencil(img, *stencil);
+  }
+  return apply_kernel_generic(img, kernel);
+}
+
+BmpImage::BmpImage
+apply_kernel(const BmpImage::BmpImage &img_src,
+             const std::vector<std::vector<double>> &kernel) {
+  return {img_src.header, apply_kernel(img_src.image.view(), kernel),
+          img_src.palette};
+}
+
+// The input's pixel buffer goes back to BufferPool for the next stage
+BmpImage::BmpImage
+apply_kernel(BmpImage::BmpImage &&img_src,
+             const std::vector<std::vector<double>> &kernel) {
+  auto image = apply_kernel(img_src.image.view(), kernel);
+  return {std::move(img_src.header), std::move(image),
+          std::move(img_src.palette)};
+}
+
+BmpImage::Image<BmpImage::BmpPixel>
+apply_mid_value_kernel(PixelView img, size_t kernel_size, int k) {
+  Trace::Scope trace("apply_mid_value_kernel", img.size());
   if (kernel_size % 2 == 0) {
     throw std::invalid_argument("Kernel size must be odd.");
   }
   int kernel_half_size = kernel_size / 2;
 
-  NumericArray::NumericArray<BmpImage::BmpPixel> newData(
-      img.image.data.data.size(),
-      BmpImage::BmpPixel{
-          .red = 0,
-          .green = 0,
-          .blue = 0,
-          .alpha = 255 // Assuming alpha remains 255 for all pixels
-      });
+  // Assuming alpha remains 255 for all pixels
+  BmpImage::Image<BmpImage::BmpPixel> result{
+      {img.width, img.height},
+      NumericArray::NumericArray<BmpImage::BmpPixel>(
+          img.size(), BmpImage::BmpPixel{0, 0, 0, 255})};
 
-  int width = img.image.size.width;
-  int height = img.image.size.height;
+  int width = img.width;
 
   // Perform convolution
-  img.image.data.foreach ([&](BmpImage::BmpPixel &pxl, size_t idx) {
+  result.data.foreach ([&](BmpImage::BmpPixel &new_pixel, size_t idx) {
     int x = idx % width;
     int y = idx / width;
 
-    double red = 0, green = 0, blue = 0;
-
     std::vector<BmpImage::BmpPixel> window;
     for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
       for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx) {
@@ -110,11 +156,58 @@ BmpImage::BmpImage apply_mid_value_kernel(BmpImage::BmpImage &img_src,
               [](const BmpImage::BmpPixel &lhs, const BmpImage::BmpPixel &rhs) {
                 return lhs.gray() > rhs.gray();
               });
-    auto target_pixel = window[k];
-    newData.data[idx] = target_pixel;
+    new_pixel = window[k];
+  });
+  return result;
+}
+
+BmpImage::BmpImage apply_mid_value_kernel(const BmpImage::BmpImage &img_src,
+                                          size_t kernel_size, int k) {
+  return {img_src.header,
+          apply_mid_value_kernel(img_src.image.view(), kernel_size, k),
+          img_src.palette};
+}
+
+BmpImage::BmpImage apply_mid_value_kernel(BmpImage::BmpImage &&img_src,
+                                          size_t kernel_size, int k) {
+  auto image = apply_mid_value_kernel(img_src.image.view(), kernel_size, k);
+  return {std::move(img_src.header), std::move(image),
+          std::move(img_src.palette)};
+}
+
+// Rank filter on a gray image: the k-th largest value of each window
+BmpImage::GrayImage
+apply_mid_value_kernel(ImageView::ImageView<const uint8_t> img,
+                       size_t kernel_size, int k) {
+  Trace::Scope trace("apply_mid_value_kernel", img.size());
+  if (kernel_size % 2 == 0) {
+    throw std::invalid_argument("Kernel size must be odd.");
+  }
+  int kernel_half_size = kernel_size / 2;
+  int width = img.width;
+  int height = img.height;
+
+  BmpImage::GrayImage result{
+      {width, height}, NumericArray::NumericArray<uint8_t>(img.size(), 0)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    std::vector<uint8_t> window(kernel_size * kernel_size);
+    for (int y = start; y < end; y++) {
+      for (int x = 0; x < width; x++) {
+        int i = 0;
+        for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
+          const uint8_t *row = img.row(std::clamp(y + ky, 0, height - 1));
+          for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx) {
+            window[i++] = row[std::clamp(x + kx, 0, width - 1)];
+          }
+        }
+        std::nth_element(window.begin(), window.begin() + k, window.end(),
+                         std::greater<uint8_t>());
+        dst[y * width + x] = window[k];
+      }
+    }
   });
-  img.image.data = newData;
-  return img;
+  return result;
 }
 
 } // namespace Convolution
@@ -0,0 +1,608 @@
+#ifndef IMAGE_PROCESSING_EDGE_HXX
+#define IMAGE_PROCESSING_EDGE_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Edge operators with small integer weights (Sobel, Prewitt, LoG) on gray
+// images. Responses are accumulated in 16-bit lanes and kept signed, so both
+// halves of each gradient survive. Borders are clamped like apply_kernel.
+// The built-in kernels are compiled with their weights as constants (see
+// RowKernel); rows are processed 8 pixels at a time with SSE2 or NEON, and
+// 16 at a time on x86 CPUs that report AVX2 at run time.
+namespace Edge {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+template <int Size> struct IntegerKernel {
+  static_assert(Size % 2 == 1, "Kernel size must be odd.");
+  std::array<std::array<int, Size>, Size> weights;
+
+  constexpr IntegerKernel transposed() const {
+    IntegerKernel result{};
+    for (int y = 0; y < Size; y++) {
+      for (int x = 0; x < Size; x++) {
+        result.weights[y][x] = weights[x][y];
+      }
+    }
+    return result;
+  }
+};
+
+// x derivatives; the y kernels are their transposes
+constexpr IntegerKernel<3> sobel{{{{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}}}};
+constexpr IntegerKernel<3> prewitt{{{{-1, 0, 1}, {-1, 0, 1}, {-1, 0, 1}}}};
+constexpr IntegerKernel<5> laplacian_of_gaussian{{{{0, 0, -1, 0, 0},
+                                                   {0, -1, -2, -1, 0},
+                                                   {-1, -2, 16, -2, -1},
+                                                   {0, -1, -2, -1, 0},
+                                                   {0, 0, -1, 0, 0}}}};
+
+using SignedImage = BmpImage::Image<int16_t>;
+
+struct Gradient {
+  SignedImage x;
+  SignedImage y;
+};
+
+enum class Norm { L1, L2 };
+
+// Gradient directions quantized to four sectors
+enum Direction : uint8_t { Horizontal, Diagonal, Vertical, AntiDiagonal };
+
+struct EdgeMap {
+  BmpImage::Image<uint16_t> magnitude;
+  BmpImage::GrayImage direction;
+};
+
+namespace detail {
+
+struct Tap {
+  int row; // index into the window, 0 is the top row
+  int dx;
+  int16_t weight;
+};
+
+template <int Size>
+std::vector<Tap> taps_of(const IntegerKernel<Size> &kernel) {
+  std::vector<Tap> taps;
+  int total = 0;
+  for (int y = 0; y < Size; y++) {
+    for (int x = 0; x < Size; x++) {
+      int weight = kernel.weights[y][x];
+      total += std::abs(weight);
+      if (weight != 0) {
+        taps.push_back({y, x - Size / 2, static_cast<int16_t>(weight)});
+      }
+    }
+  }
+  if (total * 255 > INT16_MAX) {
+    throw std::invalid_argument(
+        "Kernel weights are too large for 16-bit accumulation.");
+  }
+  return taps;
+}
+
+// The Size input rows around an output row, widened to int16 with `half`
+// clamped pixels on both sides. Rows are kept in a ring, so moving down one
+// row widens only the new one.
+template <int Size> struct RowWindow {
+  static constexpr int half = Size / 2;
+  GrayView img;
+  std::vector<int16_t> buffer;
+  std::array<int, Size> loaded;
+  std::array<const int16_t *, Size> rows;
+
+  explicit RowWindow(GrayView img)
+      : img(img), buffer(Size * (img.width + 2 * half)) {
+    loaded.fill(-1);
+  }
+
+  void move_to(int y) {
+    int padded = img.width + 2 * half;
+    for (int ky = 0; ky < Size; ky++) {
+      int source = std::clamp(y + ky - half, 0, img.height - 1);
+      int slot = source % Size;
+      int16_t *row = buffer.data() + slot * padded;
+      if (loaded[slot] != source) {
+        const uint8_t *src = img.row(source);
+        for (int x = -half; x < img.width + half; x++) {
+          row[x + half] = src[std::clamp(x, 0, img.width - 1)];
+        }
+        loaded[slot] = source;
+      }
+      rows[ky] = row + half;
+    }
+  }
+};
+
+// 8 and 16 lanes as GCC/Clang vector extensions. 16-byte vectors compile to
+// SSE2 on x86 and NEON on ARM; 32-byte ones are only used inside functions
+// compiled for AVX2.
+typedef int16_t Lanes8 __attribute__((vector_size(16)));
+typedef int16_t Lanes16 __attribute__((vector_size(32)));
+typedef uint16_t UnsignedLanes8 __attribute__((vector_size(16)));
+typedef uint16_t UnsignedLanes16 __attribute__((vector_size(32)));
+
+// Checked once. The AVX2 code is compiled with a target attribute, so the
+// build needs no -mavx2 and other CPUs keep the 16-byte path.
+bool has_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+// Adds tap I of Kernel to the `lanes` outputs at x. The weight is a
+// constant, so zero taps generate no code and e.g. -1 becomes a subtraction.
+template <typename Vector, int Size, IntegerKernel<Size> Kernel, size_t I>
+[[gnu::always_inline]] inline void tap(const int16_t *const *rows, int x,
+                                       Vector &sum) {
+  constexpr int16_t weight = Kernel.weights[I / Size][I % Size];
+  if constexpr (weight != 0) {
+    constexpr int dx = static_cast<int>(I % Size) - Size / 2;
+    Vector v;
+    std::memcpy(&v, rows[I / Size] + x + dx, sizeof(v));
+    sum += v * weight;
+  }
+}
+
+// Outputs from x on, a whole Vector at a time; returns where it stopped.
+// Vector may be a plain int16_t for the tail.
+template <typename Vector, int Size, IntegerKernel<Size> Kernel, size_t... I>
+[[gnu::always_inline]] inline int convolve_span(const int16_t *const *rows,
+                                                int16_t *out, int width, int x,
+                                                std::index_sequence<I...>) {
+  constexpr int lanes = sizeof(Vector) / sizeof(int16_t);
+  for (; x + lanes <= width; x += lanes) {
+    Vector sum{};
+    (tap<Vector, Size, Kernel, I>(rows, x, sum), ...);
+    std::memcpy(out + x, &sum, sizeof(sum));
+  }
+  return x;
+}
+
+// |gx| + |gy| from x on. The derivatives are within +-INT16_MAX (see
+// taps_of), so the sum always fits in 16 unsigned bits.
+template <typename Unsigned>
+[[gnu::always_inline]] inline int l1_magnitude_span(const int16_t *gx,
+                                                    const int16_t *gy,
+                                                    uint16_t *out, int width,
+                                                    int x) {
+  constexpr int lanes = sizeof(Unsigned) / sizeof(uint16_t);
+  for (; x + lanes <= width; x += lanes) {
+    Unsigned a, b;
+    std::memcpy(&a, gx + x, sizeof(a));
+    std::memcpy(&b, gy + x, sizeof(b));
+    Unsigned sign_a = -(a >> 15), sign_b = -(b >> 15);
+    Unsigned sum = ((a ^ sign_a) - sign_a) + ((b ^ sign_b) - sign_b);
+    std::memcpy(out + x, &sum, sizeof(sum));
+  }
+  return x;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <int Size, IntegerKernel<Size> Kernel>
+[[gnu::target("avx2")]] int convolve_span_avx2(const int16_t *const *rows,
+                                               int16_t *out, int width) {
+  return convolve_span<Lanes16, Size, Kernel>(
+      rows, out, width, 0, std::make_index_sequence<Size * Size>());
+}
+
+[[gnu::target("avx2")]] int l1_magnitude_span_avx2(const int16_t *gx,
+                                                   const int16_t *gy,
+                                                   uint16_t *out, int width) {
+  return l1_magnitude_span<UnsignedLanes16>(gx, gy, out, width, 0);
+}
+#endif
+
+// One output row of Kernel: out[x] = sum of weight * rows[ky][x + kx - half]
+template <int Size, IntegerKernel<Size> Kernel>
+void convolve_row(const int16_t *const *rows, int16_t *out, int width) {
+  constexpr auto taps = std::make_index_sequence<Size * Size>();
+  int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  if (has_avx2()) {
+    x = convolve_span_avx2<Size, Kernel>(rows, out, width);
+  }
+#endif
+  x = convolve_span<Lanes8, Size, Kernel>(rows, out, width, x, taps);
+  convolve_span<int16_t, Size, Kernel>(rows, out, width, x, taps);
+}
+
+// Any other kernel, with the taps looped over at run time
+void convolve_row(const int16_t *const *rows, const std::vector<Tap> &taps,
+                  int16_t *out, int width) {
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    Lanes8 sum{};
+    for (auto &tap : taps) {
+      Lanes8 v;
+      std::memcpy(&v, rows[tap.row] + x + tap.dx, sizeof(v));
+      sum += v * tap.weight;
+    }
+    std::memcpy(out + x, &sum, sizeof(sum));
+  }
+  for (; x < width; x++) {
+    int sum = 0;
+    for (auto &tap : taps) {
+      sum += tap.weight * rows[tap.row][x + tap.dx];
+    }
+    out[x] = static_cast<int16_t>(sum);
+  }
+}
+
+void l1_magnitude_row(const int16_t *gx, const int16_t *gy, uint16_t *out,
+                      int width) {
+  int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  if (has_avx2()) {
+    x = l1_magnitude_span_avx2(gx, gy, out, width);
+  }
+#endif
+  x = l1_magnitude_span<UnsignedLanes8>(gx, gy, out, width, x);
+  l1_magnitude_span<uint16_t>(gx, gy, out, width, x);
+}
+
+using RowFunction = void (*)(const int16_t *const *rows, int16_t *out,
+                             int width);
+
+// A kernel ready to run on a RowWindow: the compiled version when it is one
+// of the built-in kernels, the tap loop otherwise
+struct RowKernel {
+  RowFunction compiled = nullptr;
+  std::vector<Tap> taps;
+
+  void operator()(const int16_t *const *rows, int16_t *out, int width) const {
+    if (compiled) {
+      compiled(rows, out, width);
+    } else {
+      convolve_row(rows, taps, out, width);
+    }
+  }
+};
+
+template <int Size, IntegerKernel<Size>... Kernels>
+RowFunction find_compiled(const IntegerKernel<Size> &kernel) {
+  RowFunction found = nullptr;
+  ((kernel.weights == Kernels.weights &&
+    (found = &convolve_row<Size, Kernels>, true)) ||
+   ...);
+  return found;
+}
+
+template <int Size> RowKernel row_kernel(const IntegerKernel<Size> &kernel) {
+  RowKernel result{nullptr, taps_of(kernel)};
+  if constexpr (Size == 3) {
+    result.compiled = find_compiled<3, sobel, sobel.transposed(), prewitt,
+                                    prewitt.transposed()>(kernel);
+  } else if constexpr (Size == 5) {
+    result.compiled = find_compiled<5, laplacian_of_gaussian>(kernel);
+  }
+  return result;
+}
+
+// tan(22.5) and tan(67.5) in 1/256 steps
+constexpr int tan_22_5 = 106;
+constexpr int tan_67_5 = 618;
+
+// Branch free so the compiler can vectorize the row loop
+void quantize_direction_row(const int16_t *gx, const int16_t *gy,
+                            uint8_t *out, int width) {
+  for (int x = 0; x < width; x++) {
+    int ax = std::abs(gx[x]);
+    int ay = std::abs(gy[x]) * 256;
+    uint8_t diagonal = (gx[x] ^ gy[x]) >= 0 ? Diagonal : AntiDiagonal;
+    out[x] = ay <= ax * tan_22_5   ? Horizontal
+             : ay >= ax * tan_67_5 ? Vertical
+                                   : diagonal;
+  }
+}
+
+// Calls emit(y, rows) with output row y of every kernel; bands of rows run
+// in parallel
+template <int Size, typename Emit>
+void for_each_row(GrayView img, const std::vector<RowKernel> &kernels,
+                  Emit emit) {
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    RowWindow<Size> window(img);
+    std::vector<std::vector<int16_t>> out(kernels.size(),
+                                          std::vector<int16_t>(img.width));
+    for (int y = start; y < end; y++) {
+      window.move_to(y);
+      for (size_t k = 0; k < kernels.size(); k++) {
+        kernels[k](window.rows.data(), out[k].data(), img.width);
+      }
+      emit(y, out);
+    }
+  });
+}
+
+} // namespace detail
+
+// Signed response of one kernel
+template <int Size>
+SignedImage convolve(GrayView img, const IntegerKernel<Size> &kernel) {
+  Trace::Scope trace("integer_convolve", img.size());
+  SignedImage result{{img.width, img.height},
+                     NumericArray::NumericArray<int16_t>(img.size(), 0)};
+  detail::for_each_row<Size>(
+      img, {detail::row_kernel(kernel)}, [&](int y, const auto &rows) {
+        size_t offset = static_cast<size_t>(y) * img.width;
+        std::copy(rows[0].begin(), rows[0].end(),
+                  result.data.data.begin() + offset);
+      });
+  return result;
+}
+
+// Signed x and y derivatives; the y kernel is the transposed x kernel
+template <int Size>
+Gradient gradient(GrayView img, const IntegerKernel<Size> &kernel_x) {
+  Trace::Scope trace("gradient", img.size());
+  Gradient result{
+      {{img.width, img.height},
+       NumericArray::NumericArray<int16_t>(img.size(), 0)},
+      {{img.width, img.height},
+       NumericArray::NumericArray<int16_t>(img.size(), 0)}};
+  detail::for_each_row<Size>(
+      img,
+      {detail::row_kernel(kernel_x), detail::row_kernel(kernel_x.transposed())},
+      [&](int y, const auto &rows) {
+        size_t offset = static_cast<size_t>(y) * img.width;
+        std::copy(rows[0].begin(), rows[0].end(),
+                  result.x.data.data.begin() + offset);
+        std::copy(rows[1].begin(), rows[1].end(),
+                  result.y.data.data.begin() + offset);
+      });
+  return result;
+}
+
+// Gradient magnitude and quantized direction in one pass, without storing
+// the derivatives
+template <int Size>
+EdgeMap edge_map(GrayView img, const IntegerKernel<Size> &kernel_x,
+                 Norm norm = Norm::L1) {
+  Trace::Scope trace("edge_map", img.size());
+  EdgeMap result{{{img.width, img.height},
+                  NumericArray::NumericArray<uint16_t>(img.size(), 0)},
+                 {{img.width, img.height},
+                  NumericArray::NumericArray<uint8_t>(img.size(), 0)}};
+  detail::for_each_row<Size>(
+      img,
+      {detail::row_kernel(kernel_x), detail::row_kernel(kernel_x.transposed())},
+      [&](int y, const auto &rows) {
+        size_t offset = static_cast<size_t>(y) * img.width;
+        const int16_t *gx = rows[0].data();
+        const int16_t *gy = rows[1].data();
+        uint16_t *magnitude = result.magnitude.data.data.data() + offset;
+        uint8_t *direction = result.direction.data.data.data() + offset;
+        if (norm == Norm::L1) {
+          detail::l1_magnitude_row(gx, gy, magnitude, img.width);
+        } else {
+          for (int x = 0; x < img.width; x++) {
+            magnitude[x] = static_cast<uint16_t>(
+                std::lround(std::sqrt(static_cast<float>(gx[x] * gx[x] +
+                                                         gy[x] * gy[x]))));
+          }
+        }
+        detail::quantize_direction_row(gx, gy, direction, img.width);
+      });
+  return result;
+}
+
+// Clamps a magnitude image to 0..255 for display or thresholding
+BmpImage::GrayImage saturate(const BmpImage::Image<uint16_t> &image) {
+  BmpImage::GrayImage result{
+      image.size,
+      NumericArray::NumericArray<uint8_t>(image.data.data.size(), 0)};
+  const uint16_t *src = image.data.data.data();
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(
+      image.data.data.size(), [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+          dst[i] = static_cast<uint8_t>(std::min<uint16_t>(src[i], 255));
+        }
+      });
+  return result;
+}
+
+struct CannyParam {
+  // Hysteresis thresholds on the gradient magnitude. A negative high is
+  // chosen so that auto_ratio of the pixels fall below it; a negative low
+  // becomes 0.4 * high.
+  int low = -1;
+  int high = -1;
+  double auto_ratio = 0.7;
+  bool smooth = true; // 5x5 binomial blur (sigma about 1) first
+  Norm norm = Norm::L1;
+  int tile_rows = 64;
+};
+
+namespace detail {
+
+constexpr int magnitude_bins = 2048;
+
+// Rows [first, last) of `img` blurred with the 5x5 binomial kernel
+void smooth_rows(GrayView img, int first, int last, uint8_t *out) {
+  int width = img.width;
+  std::vector<uint16_t> column(width + 4);
+  for (int y = first; y < last; y++) {
+    std::array<const uint8_t *, 5> rows;
+    for (int i = 0; i < 5; i++) {
+      rows[i] = img.row(std::clamp(y + i - 2, 0, img.height - 1));
+    }
+    for (int x = 0; x < width; x++) {
+      column[x + 2] = rows[0][x] + 4 * (rows[1][x] + rows[3][x]) +
+                      6 * rows[2][x] + rows[4][x];
+    }
+    column[0] = column[1] = column[2];
+    column[width + 3] = column[width + 2] = column[width + 1];
+    uint8_t *row = out + static_cast<size_t>(y - first) * width;
+    for (int x = 0; x < width; x++) {
+      const uint16_t *c = column.data() + x;
+      row[x] = (c[0] + 4 * (c[1] + c[3]) + 6 * c[2] + c[4] + 128) >> 8;
+    }
+  }
+}
+
+// Non-maximum suppressed magnitude of rows [y0, y1). The band recomputes
+// the rows around it that its neighbors also compute (two for the blur,
+// one for the gradient and one for the suppression), so bands are
+// independent. `histogram` counts the magnitudes before suppression.
+void suppress_band(GrayView img, int y0, int y1, const CannyParam &param,
+                   uint16_t *out, std::vector<int64_t> &histogram) {
+  int width = img.width;
+  int height = img.height;
+  int g0 = std::max(0, y0 - 1), g1 = std::min(height, y1 + 1);
+  int s0 = std::max(0, g0 - 1), s1 = std::min(height, g1 + 1);
+
+  GrayView source = img;
+  int source_first = 0;
+  BufferPool::Scratch<uint8_t> smoothed;
+  if (param.smooth) {
+    smoothed.resize(static_cast<size_t>(s1 - s0) * width);
+    smooth_rows(img, s0, s1, smoothed.data());
+    source = GrayView(smoothed.data(), width, s1 - s0);
+    source_first = s0;
+  }
+
+  size_t rows = g1 - g0;
+  BufferPool::Scratch<uint16_t> magnitude(rows * width);
+  BufferPool::Scratch<uint8_t> direction(rows * width);
+  std::vector<int16_t> gx(width), gy(width);
+  RowWindow<3> window(source);
+  for (int y = g0; y < g1; y++) {
+    window.move_to(y - source_first);
+    convolve_row<3, sobel>(window.rows.data(), gx.data(), width);
+    convolve_row<3, sobel.transposed()>(window.rows.data(), gy.data(), width);
+    size_t offset = static_cast<size_t>(y - g0) * width;
+    if (param.norm == Norm::L1) {
+      l1_magnitude_row(gx.data(), gy.data(), magnitude.data() + offset, width);
+    } else {
+      for (int x = 0; x < width; x++) {
+        magnitude[offset + x] = static_cast<uint16_t>(std::lround(
+            std::sqrt(static_cast<float>(gx[x] * gx[x] + gy[x] * gy[x]))));
+      }
+    }
+    quantize_direction_row(gx.data(), gy.data(), direction.data() + offset,
+                           width);
+    if (y >= y0 && y < y1) {
+      for (int x = 0; x < width; x++) {
+        histogram[std::min<int>(magnitude[offset + x], magnitude_bins - 1)]++;
+      }
+    }
+  }
+
+  auto at = [&](int x, int y) -> int {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+      return 0;
+    }
+    return magnitude[static_cast<size_t>(y - g0) * width + x];
+  };
+  // Neighbor offsets along the gradient, indexed by Direction
+  constexpr int step_x[] = {1, 1, 0, 1};
+  constexpr int step_y[] = {0, 1, 1, -1};
+  for (int y = y0; y < y1; y++) {
+    size_t offset = static_cast<size_t>(y - g0) * width;
+    uint16_t *row = out + static_cast<size_t>(y) * width;
+    for (int x = 0; x < width; x++) {
+      int m = magnitude[offset + x];
+      int dx = step_x[direction[offset + x]];
+      int dy = step_y[direction[offset + x]];
+      row[x] = m > at(x - dx, y - dy) && m >= at(x + dx, y + dy) ? m : 0;
+    }
+  }
+}
+
+} // namespace detail
+
+// Canny edges (255) on a gray image. Blur, gradient and non-maximum
+// suppression run fused over bands of rows in parallel; hysteresis then
+// grows the strong edges through the weak ones with a stack.
+BmpImage::GrayImage canny(GrayView img, CannyParam param = {}) {
+  Trace::Scope trace("canny", img.size());
+  int width = img.width;
+  int height = img.height;
+  if (param.tile_rows <= 0) {
+    throw std::invalid_argument("Tile rows must be positive.");
+  }
+  NumericArray::NumericArray<uint16_t> suppressed(img.size(), 0);
+  std::vector<int64_t> histogram(detail::magnitude_bins, 0);
+  std::mutex mutex;
+  int tiles = (height + param.tile_rows - 1) / param.tile_rows;
+  NumericArray::parallel_for(tiles, [&](size_t start, size_t end) {
+    std::vector<int64_t> local(detail::magnitude_bins, 0);
+    for (size_t tile = start; tile < end; tile++) {
+      int y0 = tile * param.tile_rows;
+      int y1 = std::min(height, y0 + param.tile_rows);
+      detail::suppress_band(img, y0, y1, param, suppressed.data.data(),
+                            local);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < detail::magnitude_bins; i++) {
+      histogram[i] += local[i];
+    }
+  });
+
+  int high = param.high;
+  if (high < 0) {
+    int64_t target = static_cast<int64_t>(param.auto_ratio * img.size());
+    int64_t below = 0;
+    high = detail::magnitude_bins - 1;
+    for (int i = 0; i < detail::magnitude_bins; i++) {
+      below += histogram[i];
+      if (below >= target) {
+        high = i + 1;
+        break;
+      }
+    }
+  }
+  int low = param.low < 0 ? static_cast<int>(0.4 * high) : param.low;
+  low = std::max(low, 1);
+
+  BmpImage::GrayImage result{
+      {width, height}, NumericArray::NumericArray<uint8_t>(img.size(), 0)};
+  const uint16_t *magnitude = suppressed.data.data();
+  uint8_t *edges = result.data.data.data();
+  std::vector<int> stack;
+  for (size_t i = 0; i < img.size(); i++) {
+    if (magnitude[i] < high || edges[i]) {
+      continue;
+    }
+    edges[i] = 255;
+    stack.push_back(i);
+    while (!stack.empty()) {
+      int p = stack.back();
+      stack.pop_back();
+      int px = p % width, py = p / width;
+      for (int ny = std::max(0, py - 1); ny <= std::min(height - 1, py + 1);
+           ny++) {
+        for (int nx = std::max(0, px - 1); nx <= std::min(width - 1, px + 1);
+             nx++) {
+          int q = ny * width + nx;
+          if (!edges[q] && magnitude[q] >= low) {
+            edges[q] = 255;
+            stack.push_back(q);
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+} // namespace Edge
+
+#endif
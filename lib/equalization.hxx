@@ -0,0 +1,258 @@
+#ifndef IMAGE_PROCESSING_EQUALIZATION_HXX
+#define IMAGE_PROCESSING_EQUALIZATION_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Contrast-limited adaptive histogram equalization (CLAHE) on gray images.
+// Each region's histogram is clipped at clip_limit times its mean bin count
+// and the excess spread over all bins before it is turned into a mapping, so
+// flat regions are not stretched into noise.
+namespace Equalization {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+struct ClaheParam {
+  int tiles_x = 8;
+  int tiles_y = 8;
+  // Multiple of the mean bin count; 0 turns clipping off
+  double clip_limit = 2.0;
+};
+
+namespace detail {
+
+int clip_count(double clip_limit, int64_t pixels) {
+  if (clip_limit <= 0) {
+    return std::numeric_limits<int>::max();
+  }
+  return std::max<int64_t>(1, clip_limit * pixels / 256);
+}
+
+// Clips `histogram` in place and spreads the excess: evenly, then the
+// remainder one count per bin at a regular step
+void clip_histogram(std::array<int, 256> &histogram, int clip) {
+  int64_t excess = 0;
+  for (auto &count : histogram) {
+    if (count > clip) {
+      excess += count - clip;
+      count = clip;
+    }
+  }
+  int batch = excess / 256;
+  int residual = excess - batch * 256;
+  for (auto &count : histogram) {
+    count += batch;
+  }
+  if (residual > 0) {
+    int step = std::max(256 / residual, 1);
+    for (int i = 0; i < 256 && residual > 0; i += step, residual--) {
+      histogram[i]++;
+    }
+  }
+}
+
+// First pixel of each of `tiles` near-equal spans of `size`, and the end
+std::vector<int> tile_bounds(int size, int tiles) {
+  std::vector<int> bounds(tiles + 1);
+  for (int i = 0; i <= tiles; i++) {
+    bounds[i] = static_cast<int64_t>(size) * i / tiles;
+  }
+  return bounds;
+}
+
+// For each coordinate: the tile whose center is at or before it, the next
+// one, and the weight of the next one (fixed point, 1 << 8 = 1)
+struct Neighbors {
+  std::vector<int> first;
+  std::vector<int> second;
+  std::vector<int> weight;
+};
+
+Neighbors tile_neighbors(int size, int tiles) {
+  Neighbors neighbors{std::vector<int>(size), std::vector<int>(size),
+                      std::vector<int>(size)};
+  double tile_size = static_cast<double>(size) / tiles;
+  for (int i = 0; i < size; i++) {
+    double position = (i + 0.5) / tile_size - 0.5;
+    int first = std::clamp(static_cast<int>(std::floor(position)), 0,
+                           tiles - 1);
+    double fraction = std::clamp(position - first, 0.0, 1.0);
+    neighbors.first[i] = first;
+    neighbors.second[i] = std::min(first + 1, tiles - 1);
+    neighbors.weight[i] = static_cast<int>(std::lround(fraction * 256));
+  }
+  return neighbors;
+}
+
+} // namespace detail
+
+// Tiled CLAHE: one clipped mapping per tile, built in parallel; every pixel
+// then blends the mappings of the four nearest tile centers in one pass
+BmpImage::GrayImage clahe(GrayView img, ClaheParam param = {}) {
+  Trace::Scope trace("clahe", img.size());
+  int width = img.width;
+  int height = img.height;
+  if (param.tiles_x <= 0 || param.tiles_y <= 0) {
+    throw std::invalid_argument("Tile counts must be positive.");
+  }
+  int tiles_x = std::min(param.tiles_x, width);
+  int tiles_y = std::min(param.tiles_y, height);
+  auto bounds_x = detail::tile_bounds(width, tiles_x);
+  auto bounds_y = detail::tile_bounds(height, tiles_y);
+
+  // luts[ty * tiles_x + tx][value]
+  std::vector<std::array<uint8_t, 256>> luts(tiles_x * tiles_y);
+  NumericArray::parallel_for(luts.size(), [&](size_t start, size_t end) {
+    for (size_t tile = start; tile < end; tile++) {
+      int tx = tile % tiles_x, ty = tile / tiles_x;
+      std::array<int, 256> histogram{};
+      for (int y = bounds_y[ty]; y < bounds_y[ty + 1]; y++) {
+        const uint8_t *row = img.row(y);
+        for (int x = bounds_x[tx]; x < bounds_x[tx + 1]; x++) {
+          histogram[row[x]]++;
+        }
+      }
+      int64_t pixels = static_cast<int64_t>(bounds_x[tx + 1] - bounds_x[tx]) *
+                       (bounds_y[ty + 1] - bounds_y[ty]);
+      detail::clip_histogram(histogram,
+                             detail::clip_count(param.clip_limit, pixels));
+      int64_t cumulative = 0;
+      for (int i = 0; i < 256; i++) {
+        cumulative += histogram[i];
+        luts[tile][i] = static_cast<uint8_t>(
+            std::min<int64_t>((cumulative * 255 + pixels / 2) / pixels, 255));
+      }
+    }
+  });
+
+  auto columns = detail::tile_neighbors(width, tiles_x);
+  auto rows = detail::tile_neighbors(height, tiles_y);
+  BmpImage::GrayImage result{
+      {width, height}, NumericArray::NumericArray<uint8_t>(img.size(), 0)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *row = img.row(y);
+      uint8_t *out = dst + static_cast<size_t>(y) * width;
+      const auto *top = &luts[rows.first[y] * tiles_x];
+      const auto *bottom = &luts[rows.second[y] * tiles_x];
+      int wy = rows.weight[y];
+      for (int x = 0; x < width; x++) {
+        int v = row[x];
+        int left = columns.first[x], right = columns.second[x];
+        int wx = columns.weight[x];
+        int upper = top[left][v] * (256 - wx) + top[right][v] * wx;
+        int lower = bottom[left][v] * (256 - wx) + bottom[right][v] * wx;
+        out[x] = (upper * (256 - wy) + lower * wy + (1 << 15)) >> 16;
+      }
+    }
+  });
+  return result;
+}
+
+// CLAHE with a window centered on every pixel (clipped to the image). The
+// window histogram is kept up to date instead of recounted: each column
+// has a histogram of its rows in the window, updated by one pixel per row
+// step, and moving one pixel right adds one column histogram and removes
+// another. The per-pixel cost is a fixed 256-bin pass for any window size.
+BmpImage::GrayImage clahe_sliding(GrayView img, int window = 63,
+                                  double clip_limit = 2.0) {
+  Trace::Scope trace("clahe_sliding", img.size());
+  if (window <= 0 || window % 2 == 0) {
+    throw std::invalid_argument("Window size must be odd.");
+  }
+  int width = img.width;
+  int height = img.height;
+  int half = window / 2;
+  BmpImage::GrayImage result{
+      {width, height}, NumericArray::NumericArray<uint8_t>(img.size(), 0)};
+  uint8_t *dst = result.data.data.data();
+
+  // Bands of rows run in parallel, each with its own column histograms
+  constexpr int band_rows = 64;
+  int bands = (height + band_rows - 1) / band_rows;
+  NumericArray::parallel_for(bands, [&](size_t start, size_t end) {
+    BufferPool::Scratch<std::array<uint16_t, 256>> columns(width);
+    std::array<uint32_t, 256> histogram;
+    for (size_t band = start; band < end; band++) {
+      int y0 = band * band_rows;
+      int y1 = std::min(y0 + band_rows, height);
+      for (auto &column : columns) {
+        column.fill(0);
+      }
+      for (int y = std::max(y0 - half, 0); y < std::min(y0 + half, height);
+           y++) {
+        const uint8_t *row = img.row(y);
+        for (int x = 0; x < width; x++) {
+          columns[x][row[x]]++;
+        }
+      }
+      for (int y = y0; y < y1; y++) {
+        // Columns now cover rows [y - half, y + half]
+        if (y + half < height) {
+          const uint8_t *row = img.row(y + half);
+          for (int x = 0; x < width; x++) {
+            columns[x][row[x]]++;
+          }
+        }
+        if (y > y0 && y - half - 1 >= 0) {
+          const uint8_t *row = img.row(y - half - 1);
+          for (int x = 0; x < width; x++) {
+            columns[x][row[x]]--;
+          }
+        }
+        int rows = std::min(y + half + 1, height) - std::max(y - half, 0);
+
+        histogram.fill(0);
+        for (int x = 0; x < std::min(half, width); x++) {
+          for (int i = 0; i < 256; i++) {
+            histogram[i] += columns[x][i];
+          }
+        }
+        const uint8_t *row = img.row(y);
+        uint8_t *out = dst + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; x++) {
+          if (x + half < width) {
+            for (int i = 0; i < 256; i++) {
+              histogram[i] += columns[x + half][i];
+            }
+          }
+          if (x - half - 1 >= 0) {
+            for (int i = 0; i < 256; i++) {
+              histogram[i] -= columns[x - half - 1][i];
+            }
+          }
+          int64_t pixels = static_cast<int64_t>(std::min(x + half + 1, width) -
+                                                std::max(x - half, 0)) *
+                           rows;
+          uint32_t clip = detail::clip_count(clip_limit, pixels);
+          // Clipped count up to the pixel's value, and the total excess,
+          // spread evenly over the bins
+          int v = row[x];
+          uint32_t below = 0, excess = 0;
+          for (int i = 0; i < 256; i++) {
+            uint32_t count = std::min(histogram[i], clip);
+            excess += histogram[i] - count;
+            below += i <= v ? count : 0;
+          }
+          int64_t cumulative = below + static_cast<int64_t>(excess) * (v + 1) /
+                                           256;
+          out[x] = static_cast<uint8_t>(
+              std::min<int64_t>((cumulative * 255 + pixels / 2) / pixels, 255));
+        }
+      }
+    }
+  });
+  return result;
+}
+
+} // namespace Equalization
+
+#endif
@@ -2,6 +2,7 @@
 #define IMAGE_PROCESSING_FREQUENCY_HXX
 
 #include "bmp_image.hxx"
+#include "cache.hxx"
 #include "plot.hxx"
 #include <algorithm>
 #include <cmath>
@@ -67,6 +68,7 @@ void fft_1d(ComplexVector &vec, bool inverse = false) {
 void fft_2d(ComplexMatrix &mat, bool inverse = false) {
   int n = mat.size();
   int m = mat[0].size();
+  Trace::Scope trace("fft_2d", static_cast<size_t>(n) * m);
 
   // Transform rows
   for (int i = 0; i < n; ++i) {
@@ -97,18 +99,42 @@ void fft_2d(ComplexMatrix &mat, bool inverse = false) {
   }
 }
 
+namespace detail {
+
+// Forward spectra are cached by input content
+template <typename RowAt>
+ComplexMatrix forward(int n, int m, RowAt row_at) {
+  return Cache::matrix<Complex>(
+      "fft",
+      [&](Cache::Hasher &key) {
+        key.add(n).add(m);
+        for (int i = 0; i < n; ++i) {
+          key.add(row_at(i), sizeof(double) * m);
+        }
+      },
+      [&]() {
+        ComplexMatrix result(n, std::vector<Complex>(m));
+        for (int i = 0; i < n; ++i) {
+          const double *row = row_at(i);
+          for (int j = 0; j < m; ++j) {
+            result[i][j] = {row[j], 0};
+          }
+        }
+        fft_2d(result);
+        return result;
+      });
+}
+
+} // namespace detail
+
 ComplexMatrix fft(const RealMatrix &matrix) {
-  int n = matrix.size();
-  int m = matrix[0].size();
+  return detail::forward(matrix.size(), matrix[0].size(),
+                         [&](int i) { return matrix[i].data(); });
+}
 
-  ComplexMatrix result(n, std::vector<Complex>(m));
-  for (int i = 0; i < n; ++i) {
-    for (int j = 0; j < m; ++j) {
-      result[i][j] = {matrix[i][j], 0};
-    }
-  }
-  fft_2d(result);
-  return result;
+ComplexMatrix fft(ImageView::ImageView<const double> view) {
+  return detail::forward(view.height, view.width,
+                         [&](int i) { return view.row(i); });
 }
 
 RealMatrix ifft(const ComplexMatrix &matrix) {
@@ -197,6 +223,16 @@ void pad(RealMatrix &matrix) {
   matrix = padded;
 }
 
+// Copies a view straight into a zero-padded power-of-two matrix
+RealMatrix pad(ImageView::ImageView<const double> view) {
+  RealMatrix padded(next_power_of_two(view.height),
+                    std::vector<double>(next_power_of_two(view.width), 0));
+  for (int i = 0; i < view.height; i++) {
+    std::copy(view.row(i), view.row(i) + view.width, padded[i].begin());
+  }
+  return padded;
+}
+
 } // namespace Frequency
 
 #endif
\ No newline at end of file
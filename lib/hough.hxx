@@ -2,9 +2,12 @@
 #define IMAGE_PROCESSING_HOUGH_HXX
 
 #include "bmp_image.hxx"
+#include "cache.hxx"
 #include "plot.hxx"
+#include "pyramid.hxx"
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
 namespace Hough {
@@ -17,52 +20,235 @@ struct HoughLineParam {
   double rho_max = -1;    // 默认自动计算
 };
 
-RealMatrix hough_linear_transform(const RealMatrix &matrix,
-                                  HoughLineParam &param, bool rect_mode = false,
-                                  double rect_tolerant = 0.05) {
-  auto &[theta_steps, rho_steps, rho_max] = param;
+namespace detail {
 
-  if (rho_max == -1) { // 自动计算 rho_max
-    rho_max = std::sqrt(matrix.size() * matrix.size() +
-                        matrix[0].size() * matrix[0].size());
+// The theta indices that vote, with their cosines and sines. In rect mode
+// only angles within rect_tolerant of a multiple of pi / 2 vote.
+struct Angles {
+  std::vector<int> index;
+  std::vector<double> cos;
+  std::vector<double> sin;
+};
+
+Angles angles(int theta_steps, bool rect_mode, double rect_tolerant) {
+  Angles result;
+  for (int t_i = 0; t_i < theta_steps; ++t_i) {
+    double theta = t_i * 2 * M_PI / theta_steps;
+    if (rect_mode && std::abs(theta) > rect_tolerant &&
+        std::abs(theta - M_PI) > rect_tolerant &&
+        std::abs(theta + M_PI) > rect_tolerant &&
+        std::abs(theta - M_PI_2) > rect_tolerant &&
+        std::abs(theta + M_PI_2) > rect_tolerant &&
+        std::abs(theta - M_PI_2 * 3) > rect_tolerant &&
+        std::abs(theta + M_PI_2 * 3) > rect_tolerant) {
+      continue;
+    }
+    result.index.push_back(t_i);
+    result.cos.push_back(std::cos(theta));
+    result.sin.push_back(std::sin(theta));
   }
+  return result;
+}
 
-  RealMatrix result(theta_steps, std::vector<double>(rho_steps, 0));
-  for (int y = 0; y < matrix.size(); ++y) {
-    for (int x = 0; x < matrix[0].size(); ++x) {
-      if (matrix[y][x] > 1e-5) {
-        for (int t_i = 0; t_i < theta_steps; ++t_i) {
-          if (rect_mode) {
-            double theta = t_i * 2 * M_PI / theta_steps;
-            if (abs(theta) > rect_tolerant &&
-                abs(theta - M_PI) > rect_tolerant &&
-                abs(theta + M_PI) > rect_tolerant &&
-                abs(theta - M_PI_2) > rect_tolerant &&
-                abs(theta + M_PI_2) > rect_tolerant &&
-                abs(theta - M_PI_2 * 3) > rect_tolerant &&
-                abs(theta + M_PI_2 * 3) > rect_tolerant) {
-              continue;
-            }
-          }
-          double theta = t_i * 2 * M_PI / theta_steps;
-          double rho = x * std::cos(theta) + y * std::sin(theta);
+// Votes every pixel above zero into `result` for the given angles, if
+// accept(t_i, r_i). Pixel (x, y) stands for the full-resolution point
+// ((x + 0.5) * scale - 0.5, (y + 0.5) * scale - 0.5), so coarse pyramid
+// levels vote in full-resolution rho.
+template <typename RowAt, typename Accept>
+void vote(RealMatrix &result, int height, int width, RowAt row_at,
+          const Angles &angles, int rho_steps, double rho_max, int scale,
+          Accept accept) {
+  for (int y = 0; y < height; ++y) {
+    const auto *row = row_at(y);
+    double fy = (y + 0.5) * scale - 0.5;
+    for (int x = 0; x < width; ++x) {
+      if (row[x] > 1e-5) {
+        double fx = (x + 0.5) * scale - 0.5;
+        for (size_t a = 0; a < angles.index.size(); ++a) {
+          double rho = fx * angles.cos[a] + fy * angles.sin[a];
           int r_i =
               static_cast<int>((rho + rho_max) * rho_steps / (2 * rho_max));
-          if (r_i >= 0 && r_i < rho_steps) {
-            result[t_i][r_i] += matrix[y][x];
+          int t_i = angles.index[a];
+          if (r_i >= 0 && r_i < rho_steps && accept(t_i, r_i)) {
+            result[t_i][r_i] += row[x];
           }
         }
       }
     }
   }
+}
+
+} // namespace detail
+
+// Votes every pixel above zero into (theta, rho) space; `row_at(y)` returns a
+// pointer to row y so both nested matrices and strided views can be voted
+template <typename RowAt>
+RealMatrix hough_vote(int height, int width, RowAt row_at,
+                      HoughLineParam &param, bool rect_mode,
+                      double rect_tolerant) {
+  Trace::Scope trace("hough_linear_transform", height * width);
+  auto &[theta_steps, rho_steps, rho_max] = param;
+
+  if (rho_max == -1) { // 自动计算 rho_max
+    rho_max = std::sqrt(height * height + width * width);
+  }
+
+  return Cache::matrix<double>(
+      "hough",
+      [&](Cache::Hasher &key) {
+        key.add(width).add(height);
+        for (int y = 0; y < height; ++y) {
+          key.add(row_at(y), sizeof(double) * width);
+        }
+        key.add(theta_steps).add(rho_steps).add(rho_max);
+        key.add(rect_mode).add(rect_tolerant);
+      },
+      [&]() {
+        RealMatrix result(theta_steps, std::vector<double>(rho_steps, 0));
+        BufferPool::count_allocation(sizeof(double) * theta_steps *
+                                     rho_steps);
+        detail::vote(result, height, width, row_at,
+                     detail::angles(theta_steps, rect_mode, rect_tolerant),
+                     rho_steps, rho_max, 1, [](int, int) { return true; });
+        return result;
+      });
+}
+
+RealMatrix hough_linear_transform(const RealMatrix &matrix,
+                                  HoughLineParam &param, bool rect_mode = false,
+                                  double rect_tolerant = 0.05) {
+  return hough_vote(
+      matrix.size(), matrix[0].size(),
+      [&](int y) { return matrix[y].data(); }, param, rect_mode,
+      rect_tolerant);
+}
+
+RealMatrix hough_linear_transform(ImageView::ImageView<const double> view,
+                                  HoughLineParam &param, bool rect_mode = false,
+                                  double rect_tolerant = 0.05) {
+  return hough_vote(
+      view.height, view.width, [&](int y) { return view.row(y); }, param,
+      rect_mode, rect_tolerant);
+}
+
+struct CoarseToFineParam {
+  int level = 2; // pyramid level voted first, clamped to the pyramid
+  // Coarse cells above candidate_ratio times the coarse maximum are refined
+  double candidate_ratio = 0.1;
+  int window = 1; // cells around each candidate, in theta and rho
+};
+
+namespace detail {
+
+RealMatrix coarse_to_fine(Pyramid::Pyramid &pyramid,
+                          const HoughLineParam &param,
+                          CoarseToFineParam coarse, bool rect_mode,
+                          double rect_tolerant) {
+  auto full = pyramid.view(0);
+  auto [theta_steps, rho_steps, rho_max] = param;
+  int level = std::clamp(coarse.level, 0, pyramid.levels - 1);
+  int factor = Pyramid::Pyramid::scale(level);
+  int coarse_rho = std::max(rho_steps / factor, 1);
+  auto angles = detail::angles(theta_steps, rect_mode, rect_tolerant);
+
+  RealMatrix votes(theta_steps, std::vector<double>(coarse_rho, 0));
+  BufferPool::count_allocation(sizeof(double) * theta_steps * coarse_rho);
+  auto small = pyramid.view(level);
+  detail::vote(
+      votes, small.height, small.width, [&](int y) { return small.row(y); },
+      angles, coarse_rho, rho_max, factor, [](int, int) { return true; });
+
+  // A coarse pixel's votes land up to (factor - 1) / sqrt(2) away in rho
+  // from those of the pixels it covers
+  double bin_width = 2 * rho_max / coarse_rho;
+  int rho_window =
+      coarse.window + static_cast<int>(std::ceil((factor - 1) / M_SQRT2 /
+                                                 bin_width));
+  double peak = 0;
+  for (const auto &row : votes) {
+    peak = std::max(peak, *std::max_element(row.begin(), row.end()));
+  }
+  std::vector<std::vector<char>> near(theta_steps,
+                                      std::vector<char>(coarse_rho, 0));
+  for (int t = 0; t < theta_steps; ++t) {
+    for (int r = 0; r < coarse_rho; ++r) {
+      if (peak <= 0 || votes[t][r] <= coarse.candidate_ratio * peak) {
+        continue;
+      }
+      for (int dt = -coarse.window; dt <= coarse.window; ++dt) {
+        int nt = ((t + dt) % theta_steps + theta_steps) % theta_steps;
+        for (int nr = std::max(r - rho_window, 0);
+             nr <= std::min(r + rho_window, coarse_rho - 1); ++nr) {
+          near[nt][nr] = 1;
+        }
+      }
+    }
+  }
+
+  // Only angles with a candidate vote at full resolution
+  detail::Angles refined;
+  for (size_t a = 0; a < angles.index.size(); ++a) {
+    const auto &row = near[angles.index[a]];
+    if (std::find(row.begin(), row.end(), 1) != row.end()) {
+      refined.index.push_back(angles.index[a]);
+      refined.cos.push_back(angles.cos[a]);
+      refined.sin.push_back(angles.sin[a]);
+    }
+  }
+  std::vector<int> rho_bin(rho_steps);
+  for (int r_i = 0; r_i < rho_steps; ++r_i) {
+    rho_bin[r_i] = static_cast<int64_t>(r_i) * coarse_rho / rho_steps;
+  }
+  RealMatrix result(theta_steps, std::vector<double>(rho_steps, 0));
+  BufferPool::count_allocation(sizeof(double) * theta_steps * rho_steps);
+  detail::vote(result, full.height, full.width,
+               [&](int y) { return full.row(y); }, refined, rho_steps,
+               rho_max, 1, [&](int t_i, int r_i) {
+                 return near[t_i][rho_bin[r_i]] != 0;
+               });
   return result;
 }
 
+} // namespace detail
+
+// Coarse-to-fine voting over a pyramid of an edge image. The coarse level
+// votes at every angle but into rho bins 2^level times wider; level 0 then
+// votes only into the full-resolution cells near coarse candidates. Inside
+// those windows the votes equal hough_linear_transform's and elsewhere the
+// accumulator is 0, so peaks well above the candidate ratio come out the
+// same at a fraction of the cost.
+RealMatrix hough_linear_transform(Pyramid::Pyramid &pyramid,
+                                  HoughLineParam &param,
+                                  CoarseToFineParam coarse = {},
+                                  bool rect_mode = false,
+                                  double rect_tolerant = 0.05) {
+  auto full = pyramid.view(0);
+  Trace::Scope trace("hough_coarse_to_fine", full.size());
+  auto &[theta_steps, rho_steps, rho_max] = param;
+  if (rho_max == -1) {
+    rho_max = std::sqrt(full.height * full.height + full.width * full.width);
+  }
+  // Levels past the top of the pyramid compute the same as the top one
+  int level = std::clamp(coarse.level, 0, pyramid.levels - 1);
+  return Cache::matrix<double>(
+      "hough_coarse_to_fine",
+      [&](Cache::Hasher &key) {
+        key.add(full).add(theta_steps).add(rho_steps).add(rho_max);
+        key.add(pyramid.method).add(level).add(coarse.candidate_ratio);
+        key.add(coarse.window).add(rect_mode).add(rect_tolerant);
+      },
+      [&]() {
+        return detail::coarse_to_fine(pyramid, param, coarse, rect_mode,
+                                      rect_tolerant);
+      });
+}
+
 // 提取直线：从霍夫空间中找到阈值以上的直线
 std::vector<std::tuple<double, double>> get_lines(const RealMatrix &matrix,
                                                   HoughLineParam &param,
                                                   double threshold = -1,
                                                   double auto_ratio = 0.5) {
+  Trace::Scope trace("get_lines", matrix.size() * matrix[0].size());
   auto &[theta_steps, rho_steps, rho_max] = param;
 
   // 自动计算阈值
@@ -157,6 +343,7 @@ std::vector<std::tuple<double, double>>
 get_lines_bfs(const RealMatrix &matrix, HoughLineParam &param, int spread = 1,
               double threshold = -1, double auto_ratio = 0.5,
               bool rect_mode = false, double rect_tolerant = 0.05) {
+  Trace::Scope trace("get_lines_bfs", matrix.size() * matrix[0].size());
   auto &[theta_steps, rho_steps, rho_max] = param;
 
   // Automatically calculate threshold if it's not provided
@@ -182,9 +369,10 @@ get_lines_bfs(const RealMatrix &matrix, HoughLineParam &param, int spread = 1,
       double this_th = threshold;
       if (rect_mode) {
         double theta = t_i * 2 * M_PI / theta_steps;
-        if (abs(theta) < rect_tolerant || abs(theta - M_PI) < rect_tolerant ||
-            abs(theta + M_PI) < rect_tolerant ||
-            abs(theta - 2 * M_PI) < rect_tolerant) {
+        if (std::abs(theta) < rect_tolerant ||
+            std::abs(theta - M_PI) < rect_tolerant ||
+            std::abs(theta + M_PI) < rect_tolerant ||
+            std::abs(theta - 2 * M_PI) < rect_tolerant) {
           this_th /= 2;
         }
       }
@@ -0,0 +1,83 @@
+#ifndef IMAGE_PROCESSING_IMAGE_VIEW_HXX
+#define IMAGE_PROCESSING_IMAGE_VIEW_HXX
+
+#include <cstddef>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+
+namespace ImageView {
+
+// Non-owning 2D window over pixels. `stride` is the distance in elements
+// between the starts of two consecutive rows, so a sub view shares the
+// parent's buffer without copying.
+template <typename T> struct ImageView {
+  T *data = nullptr;
+  int width = 0;
+  int height = 0;
+  size_t stride = 0;
+
+  ImageView() = default;
+
+  ImageView(T *data, int width, int height)
+      : data(data), width(width), height(height), stride(width) {}
+
+  ImageView(T *data, int width, int height, size_t stride)
+      : data(data), width(width), height(height), stride(stride) {}
+
+  operator ImageView<const T>() const
+    requires(!std::is_const_v<T>)
+  {
+    return {data, width, height, stride};
+  }
+
+  T *row(int y) const { return data + y * stride; }
+
+  T &operator()(int x, int y) const { return data[y * stride + x]; }
+
+  size_t size() const { return static_cast<size_t>(width) * height; }
+
+  bool contiguous() const { return stride == width || height <= 1; }
+
+  // Region of interest starting at (x, y), sharing this view's pixels
+  ImageView sub_view(int x, int y, int w, int h) const {
+    if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > width ||
+        y + h > height) {
+      throw std::out_of_range(std::format(
+          "Sub view ({}, {}, {}x{}) exceeds {}x{} view", x, y, w, h, width,
+          height));
+    }
+    return {data + y * stride + x, w, h, stride};
+  }
+
+  struct RowIterator {
+    T *pointer;
+    int width;
+    size_t stride;
+
+    std::span<T> operator*() const { return {pointer, (size_t)width}; }
+    RowIterator &operator++() {
+      pointer += stride;
+      return *this;
+    }
+    bool operator!=(const RowIterator &other) const {
+      return pointer != other.pointer;
+    }
+  };
+
+  struct Rows {
+    const ImageView &view;
+    RowIterator begin() const { return {view.data, view.width, view.stride}; }
+    RowIterator end() const {
+      return {view.data + view.height * view.stride, view.width, view.stride};
+    }
+  };
+
+  // Iterate rows as spans: `for (auto row : view.rows())`
+  Rows rows() const { return {*this}; }
+};
+
+} // namespace ImageView
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef IMAGE_PROCESSING_INDEXED_IMAGE_HXX
+#define IMAGE_PROCESSING_INDEXED_IMAGE_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// 8-bit images kept as palette indices. Pointwise operations rewrite the
+// (at most 256) palette entries instead of touching every pixel; real colors
+// are only materialized by expand() when a spatial operation needs them.
+namespace IndexedImage {
+
+struct IndexedImage {
+  BmpImage::BmpHeader header;
+  BmpImage::ImageSize size;
+  NumericArray::NumericArray<uint8_t> indices;
+  BmpImage::ColorPalette palette;
+
+  BmpImage::BmpImage expand() const {
+    BmpImage::BmpImage image{
+        .header = header,
+        .image = {size, NumericArray::NumericArray<BmpImage::BmpPixel>(
+                            indices.data.size(), BmpImage::BmpPixel{})},
+        .palette = palette};
+    const uint8_t *src = indices.data.data();
+    BmpImage::BmpPixel *dst = image.image.data.data.data();
+    NumericArray::parallel_for(
+        indices.data.size(), [&](size_t start, size_t end) {
+          for (size_t i = start; i < end; i++) {
+            dst[i] = palette.data[src[i]];
+          }
+        });
+    return image;
+  }
+
+  // Applies a pointwise function to every color in O(palette size)
+  void
+  map_palette(std::function<BmpImage::BmpPixel(BmpImage::BmpPixel)> func) {
+    for (auto &color : palette.data) {
+      color = func(color);
+    }
+  }
+
+  std::vector<int64_t> index_histogram() const {
+    std::vector<int64_t> counter(256, 0);
+    for (auto index : indices.data) {
+      counter[index]++;
+    }
+    return counter;
+  }
+
+  // The used colors, merged and sorted like discover_palette(), and the new
+  // index of every old one. Mapped palettes can repeat a color (e.g. after
+  // thresholding), which is fine in memory but not in a written file. Of
+  // equal colors, the one met first in the pixels is kept, as discovery
+  // would. First uses are found chunk by chunk in parallel, and a chunk
+  // stops as soon as it has met every palette entry.
+  std::pair<BmpImage::ColorPalette, std::array<uint8_t, 256>>
+  canonical_palette() const {
+    constexpr size_t unused = SIZE_MAX;
+    std::array<size_t, 256> first;
+    first.fill(unused);
+    std::mutex mutex;
+    NumericArray::parallel_for(
+        indices.data.size(), [&](size_t start, size_t end) {
+          std::array<size_t, 256> local;
+          local.fill(unused);
+          size_t seen = 0;
+          for (size_t i = start; i < end && seen < palette.data.size(); i++) {
+            uint8_t index = indices.data[i];
+            if (index < palette.data.size() && local[index] == unused) {
+              local[index] = i;
+              seen++;
+            }
+          }
+          std::lock_guard lock(mutex);
+          for (int i = 0; i < 256; i++) {
+            first[i] = std::min(first[i], local[i]);
+          }
+        });
+    std::vector<int> used;
+    for (int i = 0; i < palette.data.size(); i++) {
+      if (first[i] != unused) {
+        used.push_back(i);
+      }
+    }
+    auto key = [&](int i) {
+      return BmpImage::PaletteIndex::key(palette.data[i]);
+    };
+    std::sort(used.begin(), used.end(), [&](int lhs, int rhs) {
+      return std::pair(key(lhs), first[lhs]) < std::pair(key(rhs), first[rhs]);
+    });
+    used.erase(
+        std::unique(used.begin(), used.end(),
+                    [&](int lhs, int rhs) { return key(lhs) == key(rhs); }),
+        used.end());
+    BmpImage::ColorPalette canonical;
+    for (int i : used) {
+      canonical.data.push_back(palette.data[i]);
+    }
+    std::array<uint8_t, 256> remap{};
+    for (int i = 0; i < palette.data.size(); i++) {
+      remap[i] = std::lower_bound(used.begin(), used.end(), key(i),
+                                  [&](int j, uint32_t value) {
+                                    return key(j) < value;
+                                  }) -
+                 used.begin();
+    }
+    return {canonical, remap};
+  }
+};
+
+// Indexes an image with at most 256 distinct colors
+IndexedImage to_indexed(const BmpImage::BmpImage &image) {
+  auto palette = BmpImage::discover_palette(image.image.data.data);
+  BmpImage::PaletteIndex index(palette);
+
+  IndexedImage indexed{
+      image.header, image.image.size,
+      NumericArray::NumericArray<uint8_t>(image.image.data.data.size(), 0),
+      palette};
+  const BmpImage::BmpPixel *src = image.image.data.data.data();
+  uint8_t *dst = indexed.indices.data.data();
+  NumericArray::parallel_for(
+      indexed.indices.data.size(), [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+          dst[i] = index(src[i]);
+        }
+      });
+  return indexed;
+}
+
+// Reads 8-bit files straight into indices; other depths are indexed after
+// decoding and must have at most 256 colors
+IndexedImage read_indexed_bmp(std::ifstream &file) {
+  Trace::Scope trace("read_indexed_bmp");
+  BmpImage::BmpHeader header;
+  auto start = file.tellg();
+  BmpImage::read_header(file, header);
+  if (header.fileHeader.fileType != 0x4D42) {
+    throw std::runtime_error("Not a BMP file");
+  }
+  if (header.infoHeader.bitsPerPixel != 8) {
+    file.seekg(start);
+    return to_indexed(BmpImage::read_bmp(file));
+  }
+  auto palette = BmpImage::read_palette(file, header);
+  int width = header.infoHeader.width;
+  int height = header.infoHeader.height;
+  size_t row_bytes = (static_cast<size_t>(width) + 3) & ~size_t{3};
+
+  IndexedImage indexed{header,
+                       {width, height},
+                       NumericArray::NumericArray<uint8_t>(
+                           static_cast<size_t>(width) * height, 0),
+                       palette};
+  std::vector<char> row(row_bytes);
+  for (int y = 0; y < height; y++) {
+    file.read(row.data(), row_bytes);
+    std::copy(row.begin(), row.begin() + width,
+              indexed.indices.data.begin() + static_cast<size_t>(y) * width);
+  }
+  trace.items = indexed.indices.data.size();
+  return indexed;
+}
+
+// Writes the canonical palette, so the file matches the one the expanded
+// image would give; indices are remapped while rows are copied out
+void write_bmp(std::ofstream &file, IndexedImage &image) {
+  Trace::Scope trace("write_indexed_bmp", image.indices.data.size());
+  auto [palette, remap] = image.canonical_palette();
+  auto &header = image.header;
+  int palette_size = palette.data.size() * 4;
+  header.infoHeader.bitsPerPixel = 8;
+  header.infoHeader.width = image.size.width;
+  header.infoHeader.height = image.size.height;
+  header.infoHeader.totalColors = palette.data.size();
+  header.fileHeader.pixelDataOffset =
+      14 + header.infoHeader.headerSize + palette_size;
+  header.fileHeader.fileSize = header.fileHeader.pixelDataOffset +
+                               image.indices.data.size();
+  BmpImage::write_header(file, header);
+  BmpImage::write_palette(file, palette.data);
+  const uint8_t *indices = image.indices.data.data();
+  BmpImage::write_rows(file, image.size.width, image.size.height, 1,
+                       [&](int y, uint8_t *row) {
+                         const uint8_t *src =
+                             indices + static_cast<size_t>(y) *
+                                           image.size.width;
+                         for (int x = 0; x < image.size.width; x++) {
+                           row[x] = remap[src[x]];
+                         }
+                       });
+}
+
+IndexedImage invert(IndexedImage image) {
+  image.map_palette([](BmpImage::BmpPixel pixel) {
+    return BmpImage::BmpPixel{static_cast<uint8_t>(255 - pixel.red),
+                              static_cast<uint8_t>(255 - pixel.green),
+                              static_cast<uint8_t>(255 - pixel.blue),
+                              pixel.alpha};
+  });
+  return image;
+}
+
+// Replaces every channel with the one picked by `channel`, e.g. &BmpPixel::red
+IndexedImage select_channel(IndexedImage image,
+                            uint8_t BmpImage::BmpPixel::*channel) {
+  image.map_palette([channel](BmpImage::BmpPixel pixel) {
+    auto value = pixel.*channel;
+    return BmpImage::BmpPixel{value, value, value, pixel.alpha};
+  });
+  return image;
+}
+
+// Global equalization; the histogram comes from one pass over the indices
+IndexedImage gray_balanced_image(IndexedImage image) {
+  auto counter = image.index_histogram();
+  std::vector<int64_t> gray_counter(256, 0);
+  for (int i = 0; i < image.palette.data.size(); i++) {
+    gray_counter[image.palette.data[i].gray()] += counter[i];
+  }
+  double total_pixels = image.indices.data.size();
+  std::vector<double> cdf(256, 0);
+  cdf[0] = gray_counter[0] / total_pixels;
+  for (int i = 1; i < 256; i++) {
+    cdf[i] = cdf[i - 1] + gray_counter[i] / total_pixels;
+  }
+  image.map_palette([&](BmpImage::BmpPixel pixel) {
+    auto value = static_cast<uint8_t>(cdf[pixel.gray()] * 255);
+    return BmpImage::BmpPixel{value, value, value, pixel.alpha};
+  });
+  return image;
+}
+
+} // namespace IndexedImage
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef IMAGE_PROCESSING_INTEGRAL_IMAGE_HXX
+#define IMAGE_PROCESSING_INTEGRAL_IMAGE_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Summed-area tables of a gray image and of its squares. Any box sum is
+// then four lookups, so box means and variances cost O(1) whatever the box
+// size. Sums are 64-bit, exact for any image that fits in memory.
+namespace IntegralImage {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+// sum[(y * (width + 1)) + x] holds the sum over [0, x) x [0, y); row and
+// column 0 are zero. The tables come from BufferPool like pixel buffers.
+struct IntegralImage {
+  int width = 0;
+  int height = 0;
+  NumericArray::NumericArray<int64_t> sum;
+  NumericArray::NumericArray<int64_t> squared;
+
+  size_t index(int x, int y) const {
+    return static_cast<size_t>(y) * (width + 1) + x;
+  }
+
+  int64_t box(const std::vector<int64_t> &table, int l, int t, int r,
+              int b) const {
+    return table[index(r, b)] - table[index(l, b)] - table[index(r, t)] +
+           table[index(l, t)];
+  }
+
+  // The box [l, r) x [t, b), which must lie inside the image
+  int64_t box_sum(int l, int t, int r, int b) const {
+    return box(sum.data, l, t, r, b);
+  }
+
+  int64_t box_squared_sum(int l, int t, int r, int b) const {
+    return box(squared.data, l, t, r, b);
+  }
+
+  double box_mean(int l, int t, int r, int b) const {
+    return static_cast<double>(box_sum(l, t, r, b)) /
+           (static_cast<int64_t>(r - l) * (b - t));
+  }
+
+  // Population variance, E[x^2] - E[x]^2
+  double box_variance(int l, int t, int r, int b) const {
+    double count = static_cast<double>(static_cast<int64_t>(r - l) * (b - t));
+    double mean = box_sum(l, t, r, b) / count;
+    return box_squared_sum(l, t, r, b) / count - mean * mean;
+  }
+};
+
+// Rows are prefix-summed in parallel, then the rows are accumulated down
+// the columns in parallel strips
+IntegralImage integral_image(GrayView img) {
+  Trace::Scope trace("integral_image", img.size());
+  int width = img.width;
+  int height = img.height;
+  size_t size = static_cast<size_t>(width + 1) * (height + 1);
+  IntegralImage result{width, height,
+                       NumericArray::NumericArray<int64_t>(size, 0),
+                       NumericArray::NumericArray<int64_t>(size, 0)};
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *row = img.row(y);
+      int64_t *sum = result.sum.data.data() + result.index(1, y + 1);
+      int64_t *squared = result.squared.data.data() + result.index(1, y + 1);
+      int64_t running = 0, running_squared = 0;
+      for (int x = 0; x < width; x++) {
+        running += row[x];
+        running_squared += row[x] * row[x];
+        sum[x] = running;
+        squared[x] = running_squared;
+      }
+    }
+  });
+  constexpr int strip = 256;
+  int strips = (width + strip - 1) / strip;
+  NumericArray::parallel_for(strips, [&](size_t start, size_t end) {
+    for (size_t s = start; s < end; s++) {
+      int x0 = 1 + s * strip;
+      int x1 = std::min(x0 + strip, width + 1);
+      for (int y = 2; y <= height; y++) {
+        int64_t *sum = result.sum.data.data() + result.index(0, y);
+        int64_t *squared = result.squared.data.data() + result.index(0, y);
+        const int64_t *sum_above = sum - (width + 1);
+        const int64_t *squared_above = squared - (width + 1);
+        for (int x = x0; x < x1; x++) {
+          sum[x] += sum_above[x];
+          squared[x] += squared_above[x];
+        }
+      }
+    }
+  });
+  return result;
+}
+
+// Mean of the size x size window around each pixel, clipped to the image
+BmpImage::GrayImage box_mean(const IntegralImage &integral, int size) {
+  if (size <= 0 || size % 2 == 0) {
+    throw std::invalid_argument("Window size must be odd.");
+  }
+  int half = size / 2;
+  int width = integral.width;
+  int height = integral.height;
+  BmpImage::GrayImage result{
+      {width, height},
+      NumericArray::NumericArray<uint8_t>(
+          static_cast<size_t>(width) * height, 0)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      int t = std::max(y - half, 0), b = std::min(y + half + 1, height);
+      for (int x = 0; x < width; x++) {
+        int l = std::max(x - half, 0), r = std::min(x + half + 1, width);
+        int64_t count = static_cast<int64_t>(r - l) * (b - t);
+        dst[static_cast<size_t>(y) * width + x] = static_cast<uint8_t>(
+            (integral.box_sum(l, t, r, b) + count / 2) / count);
+      }
+    }
+  });
+  return result;
+}
+
+BmpImage::GrayImage box_mean(GrayView img, int size) {
+  Trace::Scope trace("box_mean", img.size());
+  return box_mean(integral_image(img), size);
+}
+
+} // namespace IntegralImage
+
+#endif
@@ -52,6 +52,7 @@ linear_transform(BmpImage::BmpImage image, Linalg::Matrix<double> matrix,
                      .blue = 0,
                      .alpha = 1,
                  }) {
+  Trace::Scope trace("linear_transform", image.image.data.data.size());
   auto result_image = image;
   auto inverse_matrix = matrix.pinv();
   auto pixels = image.image.data.interpret(image.image.size.height,
@@ -0,0 +1,418 @@
+#ifndef IMAGE_PROCESSING_MORPHOLOGY_HXX
+#define IMAGE_PROCESSING_MORPHOLOGY_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Erosion, dilation and the operators built from them, for rectangular
+// structuring elements centered on the pixel. The rectangle is separable, so
+// a row pass is followed by a column pass, each using the van Herk/Gil-Werman
+// running min/max: three comparisons per pixel whatever the element size.
+// Pixels outside the image are ignored (they never win the min or max).
+// Binary images are packed 64 pixels to a word, so the column pass handles a
+// whole word per operation and the row pass shifts words.
+namespace Morphology {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+// Structuring element; both sides must be odd
+struct Rect {
+  int width = 3;
+  int height = 3;
+};
+
+// Binary image, bit x % 64 of word x / 64 of each row. Bits past the width
+// are kept zero.
+struct BitImage {
+  int width = 0;
+  int height = 0;
+  int words = 0; // per row
+  NumericArray::NumericArray<uint64_t> bits;
+
+  BitImage() = default;
+
+  BitImage(int width, int height)
+      : width(width), height(height), words((width + 63) / 64),
+        bits(static_cast<size_t>(words) * height, 0) {}
+
+  uint64_t *row(int y) {
+    return bits.data.data() + static_cast<size_t>(y) * words;
+  }
+
+  const uint64_t *row(int y) const {
+    return bits.data.data() + static_cast<size_t>(y) * words;
+  }
+
+  bool get(int x, int y) const { return row(y)[x / 64] >> (x % 64) & 1; }
+
+  void set(int x, int y, bool value) {
+    uint64_t bit = uint64_t{1} << (x % 64);
+    row(y)[x / 64] = value ? row(y)[x / 64] | bit : row(y)[x / 64] & ~bit;
+  }
+};
+
+namespace detail {
+
+// Each operator carries the value that never changes its result, used for
+// pixels outside the image
+template <typename T> struct Min {
+  static constexpr T fill = std::numeric_limits<T>::max();
+  T operator()(T a, T b) const { return std::min(a, b); }
+};
+
+template <typename T> struct Max {
+  static constexpr T fill = std::numeric_limits<T>::lowest();
+  T operator()(T a, T b) const { return std::max(a, b); }
+};
+
+struct And {
+  static constexpr uint64_t fill = ~uint64_t{0};
+  uint64_t operator()(uint64_t a, uint64_t b) const { return a & b; }
+};
+
+struct Or {
+  static constexpr uint64_t fill = 0;
+  uint64_t operator()(uint64_t a, uint64_t b) const { return a | b; }
+};
+
+void check(Rect rect) {
+  if (rect.width <= 0 || rect.height <= 0 || rect.width % 2 == 0 ||
+      rect.height % 2 == 0) {
+    throw std::invalid_argument("Structuring element sides must be odd.");
+  }
+}
+
+// dst[x] = op of src[x - k / 2 .. x + k / 2]. Over the input padded by k / 2
+// on both sides, g holds running results from the start of each block of k
+// and h from its end; any window then spans one block boundary and is
+// op(h[start], g[end]).
+template <typename T, typename Op>
+void window_line(const T *src, int n, int k, Op op, T *dst,
+                 std::vector<T> &g, std::vector<T> &h) {
+  int half = k / 2;
+  int length = n + k - 1;
+  g.resize(length);
+  h.resize(length);
+  auto padded = [&](int j) {
+    int x = j - half;
+    return x >= 0 && x < n ? src[x] : Op::fill;
+  };
+  for (int j = 0; j < length; j++) {
+    g[j] = j % k == 0 ? padded(j) : op(g[j - 1], padded(j));
+  }
+  for (int j = length - 1; j >= 0; j--) {
+    h[j] = j % k == k - 1 || j == length - 1 ? padded(j)
+                                             : op(h[j + 1], padded(j));
+  }
+  for (int x = 0; x < n; x++) {
+    dst[x] = op(h[x], g[x + k - 1]);
+  }
+}
+
+// The same along columns: row y of dst is op of src rows y - k / 2 ..
+// y + k / 2, for `columns` adjacent columns at once so the inner loops run
+// along rows
+template <typename T, typename Op>
+void window_rows(const T *src, size_t src_stride, T *dst, size_t dst_stride,
+                 int columns, int rows, int k, Op op) {
+  int half = k / 2;
+  int length = rows + k - 1;
+  BufferPool::Scratch<T> g(static_cast<size_t>(length) * columns);
+  BufferPool::Scratch<T> h(static_cast<size_t>(length) * columns);
+  std::vector<T> fill(columns, Op::fill);
+  auto padded = [&](int j) {
+    int y = j - half;
+    return y >= 0 && y < rows ? src + y * src_stride : fill.data();
+  };
+  for (int j = 0; j < length; j++) {
+    const T *in = padded(j);
+    T *out = g.data() + static_cast<size_t>(j) * columns;
+    if (j % k == 0) {
+      std::copy(in, in + columns, out);
+    } else {
+      const T *previous = out - columns;
+      for (int c = 0; c < columns; c++) {
+        out[c] = op(previous[c], in[c]);
+      }
+    }
+  }
+  for (int j = length - 1; j >= 0; j--) {
+    const T *in = padded(j);
+    T *out = h.data() + static_cast<size_t>(j) * columns;
+    if (j % k == k - 1 || j == length - 1) {
+      std::copy(in, in + columns, out);
+    } else {
+      const T *next = out + columns;
+      for (int c = 0; c < columns; c++) {
+        out[c] = op(next[c], in[c]);
+      }
+    }
+  }
+  for (int y = 0; y < rows; y++) {
+    const T *start = h.data() + static_cast<size_t>(y) * columns;
+    const T *end = g.data() + static_cast<size_t>(y + k - 1) * columns;
+    T *out = dst + y * dst_stride;
+    for (int c = 0; c < columns; c++) {
+      out[c] = op(start[c], end[c]);
+    }
+  }
+}
+
+// Column strip width of the column pass, in elements
+constexpr int strip_columns = 256;
+
+template <typename T, typename Op>
+void window_columns(const T *src, T *dst, int columns, int rows, int k,
+                    Op op) {
+  int strips = (columns + strip_columns - 1) / strip_columns;
+  NumericArray::parallel_for(strips, [&](size_t start, size_t end) {
+    for (size_t strip = start; strip < end; strip++) {
+      int x = strip * strip_columns;
+      window_rows(src + x, columns, dst + x, columns,
+                  std::min(strip_columns, columns - x), rows, k, op);
+    }
+  });
+}
+
+template <typename T, typename Op>
+BmpImage::Image<T> filter(ImageView::ImageView<const T> img, Rect rect,
+                          Op op) {
+  check(rect);
+  int width = img.width;
+  int height = img.height;
+  BmpImage::Image<T> rows{{width, height},
+                          NumericArray::NumericArray<T>(img.size(), 0)};
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    std::vector<T> g, h;
+    for (int y = start; y < end; y++) {
+      window_line(img.row(y), width, rect.width, op,
+                  rows.data.data.data() + static_cast<size_t>(y) * width, g,
+                  h);
+    }
+  });
+  BmpImage::Image<T> result{{width, height},
+                            NumericArray::NumericArray<T>(img.size(), 0)};
+  window_columns(rows.data.data.data(), result.data.data.data(), width, height,
+                 rect.height, op);
+  return result;
+}
+
+// dst bit x = src bit x + offset for x < dst_width, and Op::fill's bit where
+// x + offset falls outside [0, src_width)
+template <typename Op>
+void shift_bits(const uint64_t *src, int src_width, int offset, Op,
+                uint64_t *dst, int dst_width) {
+  int src_words = (src_width + 63) / 64;
+  int dst_words = (dst_width + 63) / 64;
+  auto word = [&](int j) {
+    if (j < 0 || j >= src_words) {
+      return Op::fill;
+    }
+    uint64_t bits = src[j];
+    int valid = src_width - j * 64;
+    if (valid < 64) {
+      uint64_t mask = (uint64_t{1} << valid) - 1;
+      bits = (bits & mask) | (Op::fill & ~mask);
+    }
+    return bits;
+  };
+  int q = offset >= 0 ? offset / 64 : -((-offset + 63) / 64);
+  int r = offset - q * 64;
+  for (int i = 0; i < dst_words; i++) {
+    dst[i] = r == 0 ? word(i + q)
+                    : word(i + q) >> r | word(i + q + 1) << (64 - r);
+  }
+  if (dst_width % 64) {
+    dst[dst_words - 1] &= (uint64_t{1} << (dst_width % 64)) - 1;
+  }
+}
+
+// Row pass on packed bits. Over the row padded by k / 2, span[x] = op of
+// bits x .. x + span - 1 doubles its span per shift, so a row costs
+// O(log k) word operations per 64 pixels.
+template <typename Op>
+void window_bits(const uint64_t *src, int width, int k, Op op, uint64_t *dst,
+                 std::vector<uint64_t> &span, std::vector<uint64_t> &shifted) {
+  int padded_width = width + k - 1;
+  int words = (padded_width + 63) / 64;
+  span.resize(words);
+  shifted.resize(words);
+  shift_bits(src, width, -(k / 2), op, span.data(), padded_width);
+  int covered = 1;
+  auto extend = [&](int by) {
+    shift_bits(span.data(), padded_width, by, op, shifted.data(),
+               padded_width);
+    for (int i = 0; i < words; i++) {
+      span[i] = op(span[i], shifted[i]);
+    }
+  };
+  for (; covered * 2 <= k; covered *= 2) {
+    extend(covered);
+  }
+  if (covered < k) {
+    // Two overlapping spans of `covered` bits make one of k bits
+    extend(k - covered);
+  }
+  shift_bits(span.data(), padded_width, 0, op, dst, width);
+}
+
+template <typename Op>
+BitImage filter(const BitImage &img, Rect rect, Op op) {
+  check(rect);
+  BitImage rows(img.width, img.height);
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    std::vector<uint64_t> span, shifted;
+    for (int y = start; y < end; y++) {
+      window_bits(img.row(y), img.width, rect.width, op, rows.row(y), span,
+                  shifted);
+    }
+  });
+  BitImage result(img.width, img.height);
+  window_columns(rows.bits.data.data(), result.bits.data.data(), img.words,
+                 img.height, rect.height, op);
+  return result;
+}
+
+} // namespace detail
+
+BmpImage::GrayImage erode(GrayView img, Rect rect) {
+  Trace::Scope trace("erode", img.size());
+  return detail::filter(img, rect, detail::Min<uint8_t>());
+}
+
+BmpImage::GrayImage dilate(GrayView img, Rect rect) {
+  Trace::Scope trace("dilate", img.size());
+  return detail::filter(img, rect, detail::Max<uint8_t>());
+}
+
+// Float images, such as distance maps
+BmpImage::Image<float> erode(ImageView::ImageView<const float> img,
+                             Rect rect) {
+  Trace::Scope trace("erode", img.size());
+  return detail::filter(img, rect, detail::Min<float>());
+}
+
+BmpImage::Image<float> dilate(ImageView::ImageView<const float> img,
+                              Rect rect) {
+  Trace::Scope trace("dilate", img.size());
+  return detail::filter(img, rect, detail::Max<float>());
+}
+
+BmpImage::GrayImage open(GrayView img, Rect rect) {
+  return dilate(erode(img, rect).view(), rect);
+}
+
+BmpImage::GrayImage close(GrayView img, Rect rect) {
+  return erode(dilate(img, rect).view(), rect);
+}
+
+// Bright details smaller than the element: img - open(img)
+BmpImage::GrayImage top_hat(GrayView img, Rect rect) {
+  auto result = open(img, rect);
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *src = img.row(y);
+      uint8_t *row = dst + static_cast<size_t>(y) * img.width;
+      for (int x = 0; x < img.width; x++) {
+        row[x] = src[x] - row[x];
+      }
+    }
+  });
+  return result;
+}
+
+// Dark details smaller than the element: close(img) - img
+BmpImage::GrayImage black_hat(GrayView img, Rect rect) {
+  auto result = close(img, rect);
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *src = img.row(y);
+      uint8_t *row = dst + static_cast<size_t>(y) * img.width;
+      for (int x = 0; x < img.width; x++) {
+        row[x] = row[x] - src[x];
+      }
+    }
+  });
+  return result;
+}
+
+// Nonzero pixels become set bits
+BitImage pack(GrayView img) {
+  BitImage result(img.width, img.height);
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *src = img.row(y);
+      uint64_t *row = result.row(y);
+      for (int x = 0; x < img.width; x++) {
+        row[x / 64] |= static_cast<uint64_t>(src[x] != 0) << (x % 64);
+      }
+    }
+  });
+  return result;
+}
+
+// Set bits become 255, the rest 0
+BmpImage::GrayImage unpack(const BitImage &img) {
+  BmpImage::GrayImage result{
+      {img.width, img.height},
+      NumericArray::NumericArray<uint8_t>(
+          static_cast<size_t>(img.width) * img.height, 0)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint64_t *row = img.row(y);
+      for (int x = 0; x < img.width; x++) {
+        dst[static_cast<size_t>(y) * img.width + x] =
+            (row[x / 64] >> (x % 64) & 1) * 255;
+      }
+    }
+  });
+  return result;
+}
+
+BitImage erode(const BitImage &img, Rect rect) {
+  Trace::Scope trace("erode", static_cast<size_t>(img.width) * img.height);
+  return detail::filter(img, rect, detail::And());
+}
+
+BitImage dilate(const BitImage &img, Rect rect) {
+  Trace::Scope trace("dilate", static_cast<size_t>(img.width) * img.height);
+  return detail::filter(img, rect, detail::Or());
+}
+
+BitImage open(const BitImage &img, Rect rect) {
+  return dilate(erode(img, rect), rect);
+}
+
+BitImage close(const BitImage &img, Rect rect) {
+  return erode(dilate(img, rect), rect);
+}
+
+BitImage top_hat(const BitImage &img, Rect rect) {
+  auto result = open(img, rect);
+  auto &bits = result.bits.data;
+  for (size_t i = 0; i < bits.size(); i++) {
+    bits[i] = img.bits.data[i] & ~bits[i];
+  }
+  return result;
+}
+
+BitImage black_hat(const BitImage &img, Rect rect) {
+  auto result = close(img, rect);
+  auto &bits = result.bits.data;
+  for (size_t i = 0; i < bits.size(); i++) {
+    bits[i] &= ~img.bits.data[i];
+  }
+  return result;
+}
+
+} // namespace Morphology
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef IMAGE_PROCESSING_NUMERIC_ARRAY_HXX
 #define IMAGE_PROCESSING_NUMERIC_ARRAY_HXX
 
+#include "buffer_pool.hxx"
+#include "image_view.hxx"
+#include "trace.hxx"
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <functional>
 #include <future>
@@ -11,45 +16,61 @@
 namespace NumericArray {
 template <typename T> struct NumericArray;
 
-template <typename T, typename U, typename V>
-NumericArray<T>
-binary_operation(const NumericArray<U> &a, const NumericArray<V> &b,
-                 std::function<T(U, V)> func,
-                 int workers = std::thread::hardware_concurrency()) {
-  int data_size = a.data.size();
-  if (data_size != b.data.size()) {
-    throw std::runtime_error("Channels must have the same size");
-  }
-  if (data_size == 0)
-    return NumericArray<T>();
+std::atomic<int> worker_override = 0;
 
-  int chunk_size = data_size / workers;
-  std::vector<std::future<std::vector<T>>> futures;
+// Worker count for calls that do not pass one: the hardware concurrency
+// unless set_default_workers() picked another; 0 restores the default
+int default_workers() {
+  int workers = worker_override;
+  return workers > 0 ? workers
+                     : std::max(1u, std::thread::hardware_concurrency());
+}
 
+void set_default_workers(int workers) { worker_override = workers; }
+
+// Splits [0, size) into contiguous chunks and runs func(start, end) on each
+void parallel_for(size_t size, std::function<void(size_t, size_t)> func,
+                  int workers = default_workers()) {
+  if (size == 0)
+    return;
+  workers = std::clamp<int>(workers, 1, size);
+  size_t chunk_size = size / workers;
+  Trace::Loop loop(size, workers);
+  std::vector<std::future<void>> futures;
   for (int i = 0; i < workers; ++i) {
-    int start_index = i * chunk_size;
-    int end_index = (i == workers - 1) ? data_size : start_index + chunk_size;
-
-    // Each thread processes a chunk of the data
-    futures.emplace_back(
-        std::async(std::launch::async, [&, start_index, end_index]() {
-          std::vector<T> result(end_index - start_index);
-          for (int j = start_index; j < end_index; ++j) {
-            result[j - start_index] = func(a.data[j], b.data[j]);
-          }
-          return result;
+    size_t start_index = i * chunk_size;
+    size_t end_index = (i == workers - 1) ? size : start_index + chunk_size;
+    futures.emplace_back(std::async(
+        std::launch::async, [&func, &loop, i, start_index, end_index]() {
+          auto worker = loop.worker(i, end_index - start_index);
+          func(start_index, end_index);
         }));
   }
-
-  // Collect and combine the results from all threads
-  std::vector<T> result;
-  result.reserve(data_size);
   for (auto &future : futures) {
-    auto result_chunk = future.get();
-    result.insert(result.end(), result_chunk.begin(), result_chunk.end());
+    future.get();
   }
+}
 
-  return NumericArray<T>{result};
+template <typename T, typename U, typename V>
+NumericArray<T>
+binary_operation(const NumericArray<U> &a, const NumericArray<V> &b,
+                 std::function<T(U, V)> func, int workers = default_workers()) {
+  size_t data_size = a.data.size();
+  if (data_size != b.data.size()) {
+    throw std::runtime_error("Channels must have the same size");
+  }
+  NumericArray<T> result;
+  result.data = BufferPool::acquire<T>(data_size);
+  result.data.resize(data_size);
+  parallel_for(
+      data_size,
+      [&](size_t start, size_t end) {
+        for (size_t j = start; j < end; ++j) {
+          result.data[j] = func(a.data[j], b.data[j]);
+        }
+      },
+      workers);
+  return result;
 }
 
 template <typename T> struct NumericArray {
@@ -59,11 +80,42 @@ template <typename T> struct NumericArray {
 
   explicit NumericArray(std::vector<T> data) : data(std::move(data)) {}
 
-  explicit NumericArray(int size, T value) : data(size, value) {}
+  explicit NumericArray(int size, T value)
+      : data(BufferPool::acquire<T>(size)) {
+    data.assign(size, value);
+  }
+
+  // Large buffers come from and go back to BufferPool
+  NumericArray(const NumericArray &other)
+      : data(BufferPool::acquire<T>(other.data.size())) {
+    data.assign(other.data.begin(), other.data.end());
+  }
+
+  NumericArray(NumericArray &&other) noexcept = default;
+
+  NumericArray &operator=(const NumericArray &other) {
+    if (this != &other) {
+      if (data.capacity() < other.data.size()) {
+        BufferPool::release(std::move(data));
+        data = BufferPool::acquire<T>(other.data.size());
+      }
+      data.assign(other.data.begin(), other.data.end());
+    }
+    return *this;
+  }
+
+  NumericArray &operator=(NumericArray &&other) noexcept {
+    if (this != &other) {
+      BufferPool::release(std::move(data));
+      data = std::move(other.data);
+    }
+    return *this;
+  }
+
+  ~NumericArray() { BufferPool::release(std::move(data)); }
 
   std::vector<std::vector<T>>
-  interpret(int height, int width,
-            int workers = std::thread::hardware_concurrency()) {
+  interpret(int height, int width, int workers = default_workers()) {
     if (data.size() != height * width) {
       throw std::runtime_error("Data size does not match the expected size");
     }
@@ -76,6 +128,14 @@ template <typename T> struct NumericArray {
     return result;
   }
 
+  // Same shape as interpret, but shares the buffer instead of copying it
+  ImageView::ImageView<T> view(int height, int width) {
+    if (data.size() != height * width) {
+      throw std::runtime_error("Data size does not match the expected size");
+    }
+    return {data.data(), width, height};
+  }
+
   void foreach_sync(std::function<void(T &, size_t)> func) {
     for (int i = 0; i < data.size(); i++) {
       func(data[i], i);
@@ -89,109 +149,61 @@ template <typename T> struct NumericArray {
   }
 
   void foreach (std::function<void(T &, size_t)> func,
-                int workers = std::thread::hardware_concurrency()) {
-    int data_size = data.size();
-    int chunk_size = data_size / workers;
-    std::vector<std::future<void>> futures;
-    for (int i = 0; i < workers; ++i) {
-      int start_index = i * chunk_size;
-      int end_index = (i == workers - 1) ? data_size : start_index + chunk_size;
-      futures.emplace_back(std::async(
-          std::launch::async, [this, func, start_index, end_index]() {
-            for (int j = start_index; j < end_index; ++j) {
-              func(data[j], j);
-            }
-          }));
-    }
-    for (auto &future : futures) {
-      future.get();
-    }
+                int workers = default_workers()) {
+    parallel_for(
+        data.size(),
+        [&](size_t start, size_t end) {
+          for (size_t j = start; j < end; ++j) {
+            func(data[j], j);
+          }
+        },
+        workers);
   }
 
   template <typename U>
   NumericArray<U> map(std::function<U(T &, size_t)> func,
-                      int workers = std::thread::hardware_concurrency()) {
-    int data_size = data.size();
-    if (data_size == 0)
-      return NumericArray<U>();
-
-    int chunk_size = data_size / workers;
-    std::vector<std::future<std::vector<U>>> futures;
-
-    for (int i = 0; i < workers; ++i) {
-      int start_index = i * chunk_size;
-      int end_index = (i == workers - 1) ? data_size : start_index + chunk_size;
-      futures.emplace_back(std::async(
-          std::launch::async, [this, func, start_index, end_index]() {
-            std::vector<U> result;
-            result.reserve(end_index - start_index);
-            for (int j = start_index; j < end_index; ++j) {
-              result.push_back(func(data[j], j));
-            }
-            return result;
-          }));
-    }
-
-    std::vector<U> result;
-    for (auto &future : futures) {
-      auto result_chunk = future.get();
-      result.insert(result.end(), result_chunk.begin(), result_chunk.end());
-    }
-
-    return NumericArray<U>{result};
+                      int workers = default_workers()) {
+    NumericArray<U> result;
+    result.data = BufferPool::acquire<U>(data.size());
+    result.data.resize(data.size());
+    parallel_for(
+        data.size(),
+        [&](size_t start, size_t end) {
+          for (size_t j = start; j < end; ++j) {
+            result.data[j] = func(data[j], j);
+          }
+        },
+        workers);
+    return result;
   }
 
   void foreach (std::function<void(T &)> func,
-                int workers = std::thread::hardware_concurrency()) {
-    int data_size = data.size();
-    int chunk_size = data_size / workers;
-    std::vector<std::future<void>> futures;
-    for (int i = 0; i < workers; ++i) {
-      int start_index = i * chunk_size;
-      int end_index = (i == workers - 1) ? data_size : start_index + chunk_size;
-      futures.emplace_back(std::async(
-          std::launch::async, [this, func, start_index, end_index]() {
-            for (int j = start_index; j < end_index; ++j) {
-              func(data[j]);
-            }
-          }));
-    }
-    for (auto &future : futures) {
-      future.get();
-    }
+                int workers = default_workers()) {
+    parallel_for(
+        data.size(),
+        [&](size_t start, size_t end) {
+          for (size_t j = start; j < end; ++j) {
+            func(data[j]);
+          }
+        },
+        workers);
   }
 
   template <typename U>
   NumericArray<U> map(std::function<U(T)> func,
-                      int workers = std::thread::hardware_concurrency()) {
-    int data_size = data.size();
-    if (data_size == 0)
-      return NumericArray<U>();
-
-    int chunk_size = data_size / workers;
-    std::vector<std::future<std::vector<U>>> futures;
-
-    for (int i = 0; i < workers; ++i) {
-      int start_index = i * chunk_size;
-      int end_index = (i == workers - 1) ? data_size : start_index + chunk_size;
-      futures.emplace_back(std::async(
-          std::launch::async, [this, func, start_index, end_index]() {
-            std::vector<U> result;
-            result.reserve(end_index - start_index);
-            for (int j = start_index; j < end_index; ++j) {
-              result.push_back(func(data[j]));
-            }
-            return result;
-          }));
-    }
-
-    std::vector<U> result;
-    for (auto &future : futures) {
-      auto result_chunk = future.get();
-      result.insert(result.end(), result_chunk.begin(), result_chunk.end());
-    }
-
-    return NumericArray<U>{result};
+                      int workers = default_workers()) {
+    NumericArray<U> result;
+    result.data = BufferPool::acquire<U>(data.size());
+    result.data.resize(data.size());
+    parallel_for(
+        data.size(),
+        [&](size_t start, size_t end) {
+          for (size_t j = start; j < end; ++j) {
+            result.data[j] = func(data[j]);
+          }
+        },
+        workers);
+    return result;
   }
 
   NumericArray<T> operator+(NumericArray<T> other) {
@@ -0,0 +1,318 @@
+#ifndef IMAGE_PROCESSING_PIPELINE_HXX
+#define IMAGE_PROCESSING_PIPELINE_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include "segmentation.hxx"
+#include "stencil.hxx"
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Lazy image pipelines. Operations are recorded first and run later:
+// - consecutive pointwise stages are fused into one function, applied to
+//   each row right after the preceding stencil stores it instead of in its
+//   own pass;
+// - row tiles go through every stencil in turn while they are still in
+//   cache;
+// - only images marked with output() are materialized.
+// Global stages such as Otsu need their whole input, so they split the graph
+// into segments.
+namespace Pipeline {
+
+using Pixel = BmpImage::BmpPixel;
+using PointwiseFunction = std::function<Pixel(Pixel)>;
+
+// Rows [first_row, first_row + rows) of one level of a tile. Reads are
+// clamped to the image like Convolution::get_pixel_with_padding.
+struct TileRows {
+  const Pixel *data;
+  int first_row;
+  int width;
+  int height;
+
+  const Pixel &at(int x, int y) const {
+    x = std::clamp(x, 0, width - 1);
+    y = std::clamp(y, 0, height - 1);
+    return data[static_cast<size_t>(y - first_row) * width + x];
+  }
+};
+
+enum class StageKind { Pointwise, Stencil, Global, Output };
+
+struct Stage {
+  StageKind kind;
+  std::string name;
+  PointwiseFunction pointwise;
+  // Stencil: writes output row y reading input rows within +-halo
+  int halo = 0;
+  std::function<void(const TileRows &, int, Pixel *)> stencil;
+  // Global: turns the whole materialized input into a pointwise function
+  std::function<PointwiseFunction(const BmpImage::Image<Pixel> &)> global;
+};
+
+using Outputs = std::map<std::string, BmpImage::Image<Pixel>>;
+
+struct Pipeline {
+  std::vector<Stage> stages;
+  int tile_rows = 32;
+
+  Pipeline &map(PointwiseFunction func) {
+    stages.push_back({StageKind::Pointwise, "map", std::move(func)});
+    return *this;
+  }
+
+  Pipeline &convolve(std::vector<std::vector<double>> kernel) {
+    int size = kernel.size();
+    if (size % 2 == 0) {
+      throw std::invalid_argument("Kernel size must be odd.");
+    }
+    int half = size / 2;
+    Stage stage{StageKind::Stencil, "convolve"};
+    stage.halo = half;
+    if (auto specialized = Stencil::specialize(kernel)) {
+      stage.stencil = [specialized = *specialized,
+                       half](const TileRows &in, int y, Pixel *out) {
+        std::array<const Pixel *, Stencil::max_size> rows;
+        for (int i = 0; i < specialized.size; i++) {
+          rows[i] = &in.at(0, y + i - half);
+        }
+        specialized.apply_row(rows.data(), in.width, out);
+      };
+      stages.push_back(std::move(stage));
+      return *this;
+    }
+    stage.stencil = [kernel, half](const TileRows &in, int y, Pixel *out) {
+      for (int x = 0; x < in.width; x++) {
+        double red = 0, green = 0, blue = 0;
+        for (int ky = -half; ky <= half; ++ky) {
+          for (int kx = -half; kx <= half; ++kx) {
+            const Pixel &neighbor = in.at(x + kx, y + ky);
+            double weight = kernel[ky + half][kx + half];
+            red += neighbor.red * weight;
+            green += neighbor.green * weight;
+            blue += neighbor.blue * weight;
+          }
+        }
+        auto clamp = [](double value) {
+          return static_cast<uint8_t>(
+              std::clamp(static_cast<int>(value), 0, 255));
+        };
+        out[x] = {clamp(red), clamp(green), clamp(blue), 255};
+      }
+    };
+    stages.push_back(std::move(stage));
+    return *this;
+  }
+
+  // Same selection as Convolution::apply_mid_value_kernel
+  Pipeline &median(int kernel_size, int k) {
+    if (kernel_size % 2 == 0) {
+      throw std::invalid_argument("Kernel size must be odd.");
+    }
+    int half = kernel_size / 2;
+    Stage stage{StageKind::Stencil, "median"};
+    stage.halo = half;
+    stage.stencil = [half, k](const TileRows &in, int y, Pixel *out) {
+      std::vector<Pixel> window;
+      for (int x = 0; x < in.width; x++) {
+        window.clear();
+        for (int ky = -half; ky <= half; ++ky) {
+          for (int kx = -half; kx <= half; ++kx) {
+            window.push_back(in.at(x + kx, y + ky));
+          }
+        }
+        std::sort(window.begin(), window.end(),
+                  [](const Pixel &lhs, const Pixel &rhs) {
+                    return lhs.gray() > rhs.gray();
+                  });
+        out[x] = window[k];
+      }
+    };
+    stages.push_back(std::move(stage));
+    return *this;
+  }
+
+  Pipeline &threshold(int threshold, Pixel left_color = {0, 0, 0, 255},
+                      Pixel right_color = {255, 255, 255, 255}) {
+    return map([=](Pixel pixel) {
+      return pixel.gray() < threshold ? left_color : right_color;
+    });
+  }
+
+  Pipeline &threshold_by_otsu(Pixel left_color = {0, 0, 0, 255},
+                              Pixel right_color = {255, 255, 255, 255}) {
+    Stage stage{StageKind::Global, "otsu"};
+    stage.global = [=](const BmpImage::Image<Pixel> &image) {
+      int threshold =
+          Segmentation::SegmentationByThreshold::auto_find_threshold_by_otsu(
+              image.view());
+      return PointwiseFunction([=](Pixel pixel) {
+        return pixel.gray() < threshold ? left_color : right_color;
+      });
+    };
+    stages.push_back(std::move(stage));
+    return *this;
+  }
+
+  // Materializes the image at this point of the graph under `name`
+  Pipeline &output(std::string name) {
+    stages.push_back({StageKind::Output, std::move(name)});
+    return *this;
+  }
+
+  Outputs run(const BmpImage::Image<Pixel> &input) const;
+};
+
+namespace detail {
+
+// Fused pointwise function, optionally followed by an output snapshot
+struct Step {
+  PointwiseFunction func;
+  std::string output;
+};
+
+// One stencil (none for the segment input) and the steps applied to the
+// rows it stores
+struct Level {
+  const Stage *stencil = nullptr;
+  std::vector<Step> steps;
+};
+
+PointwiseFunction compose(PointwiseFunction first, PointwiseFunction second) {
+  if (!first) {
+    return second;
+  }
+  return [first, second](Pixel pixel) { return second(first(pixel)); };
+}
+
+// Runs one segment (no global stages) over `input` tile by tile
+BmpImage::Image<Pixel> run_segment(const BmpImage::Image<Pixel> &input,
+                                   const std::vector<Level> &levels,
+                                   int tile_rows, Outputs &outputs) {
+  int width = input.size.width;
+  int height = input.size.height;
+  size_t size = input.data.data.size();
+  for (auto &level : levels) {
+    for (auto &step : level.steps) {
+      if (!step.output.empty()) {
+        outputs[step.output] = {input.size,
+                                NumericArray::NumericArray<Pixel>(
+                                    size, Pixel{0, 0, 0, 255})};
+      }
+    }
+  }
+  BmpImage::Image<Pixel> result{
+      input.size, NumericArray::NumericArray<Pixel>(size, Pixel{0, 0, 0, 255})};
+
+  int tiles = (height + tile_rows - 1) / tile_rows;
+  NumericArray::parallel_for(tiles, [&](size_t start, size_t end) {
+    std::vector<BufferPool::Scratch<Pixel>> buffers(levels.size());
+    for (size_t tile = start; tile < end; tile++) {
+      int y0 = tile * tile_rows;
+      int y1 = std::min(height, y0 + tile_rows);
+
+      // Rows each level must produce so the last level covers [y0, y1)
+      std::vector<std::pair<int, int>> ranges(levels.size());
+      int first = y0, last = y1;
+      for (int i = levels.size() - 1; i >= 0; i--) {
+        ranges[i] = {first, last};
+        if (i > 0) {
+          first = std::max(0, first - levels[i].stencil->halo);
+          last = std::min(height, last + levels[i].stencil->halo);
+        }
+      }
+
+      for (size_t i = 0; i < levels.size(); i++) {
+        auto [row_first, row_last] = ranges[i];
+        auto &buffer = buffers[i];
+        buffer.resize(static_cast<size_t>(row_last - row_first) * width);
+        for (int y = row_first; y < row_last; y++) {
+          Pixel *row =
+              buffer.data() + static_cast<size_t>(y - row_first) * width;
+          if (i == 0) {
+            std::copy_n(input.data.data.data() + static_cast<size_t>(y) * width,
+                        width, row);
+          } else {
+            TileRows previous{buffers[i - 1].data(), ranges[i - 1].first,
+                              width, height};
+            levels[i].stencil->stencil(previous, y, row);
+          }
+          for (auto &step : levels[i].steps) {
+            if (step.func) {
+              for (int x = 0; x < width; x++) {
+                row[x] = step.func(row[x]);
+              }
+            }
+            if (!step.output.empty() && y >= y0 && y < y1) {
+              std::copy_n(row, width,
+                          outputs.at(step.output).data.data.data() +
+                              static_cast<size_t>(y) * width);
+            }
+          }
+        }
+      }
+      std::copy_n(buffers.back().data() +
+                      static_cast<size_t>(y0 - ranges.back().first) * width,
+                  static_cast<size_t>(y1 - y0) * width,
+                  result.data.data.data() + static_cast<size_t>(y0) * width);
+    }
+  });
+  return result;
+}
+
+} // namespace detail
+
+Outputs Pipeline::run(const BmpImage::Image<Pixel> &input) const {
+  Trace::Scope trace("pipeline", input.data.data.size());
+  Outputs outputs;
+  BmpImage::Image<Pixel> current = input;
+  std::vector<detail::Level> levels(1);
+
+  auto flush = [&]() {
+    if (levels.size() > 1 || !levels[0].steps.empty()) {
+      current = detail::run_segment(current, levels, tile_rows, outputs);
+    }
+    levels.assign(1, {});
+  };
+  auto add_pointwise = [&](PointwiseFunction func) {
+    auto &steps = levels.back().steps;
+    if (steps.empty() || !steps.back().output.empty()) {
+      steps.push_back({std::move(func)});
+    } else {
+      steps.back().func = detail::compose(steps.back().func, std::move(func));
+    }
+  };
+
+  for (auto &stage : stages) {
+    switch (stage.kind) {
+    case StageKind::Pointwise:
+      add_pointwise(stage.pointwise);
+      break;
+    case StageKind::Stencil:
+      levels.push_back({&stage});
+      break;
+    case StageKind::Output:
+      if (levels.back().steps.empty() ||
+          !levels.back().steps.back().output.empty()) {
+        levels.back().steps.push_back({});
+      }
+      levels.back().steps.back().output = stage.name;
+      break;
+    case StageKind::Global:
+      flush();
+      add_pointwise(stage.global(current));
+      break;
+    }
+  }
+  flush();
+  return outputs;
+}
+
+} // namespace Pipeline
+
+#endif
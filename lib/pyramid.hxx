@@ -0,0 +1,147 @@
+#ifndef IMAGE_PROCESSING_PYRAMID_HXX
+#define IMAGE_PROCESSING_PYRAMID_HXX
+
+#include "bmp_image.hxx"
+#include "numeric_array.hxx"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// Gray image pyramids for coarse-to-fine processing. Level 0 is the image
+// itself and each level halves the one below it, rounding up, so pixel
+// (x, y) of level k covers full-resolution pixels [x, x + 1) * 2^k. Levels
+// are built on first use, each in one parallel pass over its rows, and kept
+// for later calls.
+namespace Pyramid {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+enum class Reduce {
+  // 5-tap binomial (1 4 6 4 1) / 16 in both directions, then every second
+  // pixel (Burt and Adelson)
+  Gaussian,
+  // Mean of each 2x2 block
+  Area,
+};
+
+// Rectangle of full-resolution pixels, in ImageView::sub_view order
+struct Region {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+};
+
+namespace detail {
+
+// Borders are clamped like apply_kernel
+BmpImage::GrayImage reduce(GrayView src, Reduce method) {
+  int width = (src.width + 1) / 2;
+  int height = (src.height + 1) / 2;
+  BmpImage::GrayImage result{
+      {width, height},
+      NumericArray::NumericArray<uint8_t>(static_cast<size_t>(width) * height,
+                                          0)};
+  uint8_t *dst = result.data.data.data();
+  int last_x = src.width - 1, last_y = src.height - 1;
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    std::vector<int> column(src.width);
+    for (int y = start; y < end; y++) {
+      uint8_t *out = dst + static_cast<size_t>(y) * width;
+      if (method == Reduce::Area) {
+        const uint8_t *top = src.row(2 * y);
+        const uint8_t *bottom = src.row(std::min(2 * y + 1, last_y));
+        for (int x = 0; x < width; x++) {
+          int right = std::min(2 * x + 1, last_x);
+          out[x] =
+              (top[2 * x] + top[right] + bottom[2 * x] + bottom[right] + 2) /
+              4;
+        }
+        continue;
+      }
+      constexpr std::array<int, 5> weights{1, 4, 6, 4, 1};
+      std::fill(column.begin(), column.end(), 0);
+      for (int i = 0; i < 5; i++) {
+        const uint8_t *row = src.row(std::clamp(2 * y + i - 2, 0, last_y));
+        for (int x = 0; x < src.width; x++) {
+          column[x] += weights[i] * row[x];
+        }
+      }
+      for (int x = 0; x < width; x++) {
+        int sum = 0;
+        for (int i = 0; i < 5; i++) {
+          sum += weights[i] * column[std::clamp(2 * x + i - 2, 0, last_x)];
+        }
+        out[x] = (sum + 128) / 256;
+      }
+    }
+  });
+  return result;
+}
+
+} // namespace detail
+
+struct Pyramid {
+  Reduce method;
+  int levels = 1;
+  std::mutex mutex;
+  // A deque, so references to built levels survive later appends
+  std::deque<BmpImage::GrayImage> built;
+
+  // Levels stop once a side would drop below min_side, and after max_levels
+  Pyramid(BmpImage::GrayImage base, Reduce method = Reduce::Gaussian,
+          int max_levels = 16, int min_side = 8)
+      : method(method) {
+    if (base.size.width <= 0 || base.size.height <= 0) {
+      throw std::invalid_argument("Pyramid base must not be empty.");
+    }
+    int width = base.size.width, height = base.size.height;
+    while (levels < max_levels && (width + 1) / 2 >= min_side &&
+           (height + 1) / 2 >= min_side) {
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+      levels++;
+    }
+    built.push_back(std::move(base));
+  }
+
+  Pyramid(const Pyramid &) = delete;
+  Pyramid &operator=(const Pyramid &) = delete;
+
+  // Full-resolution pixels per pixel of level k, along each axis
+  static int scale(int k) { return 1 << k; }
+
+  // Builds the missing levels up to k. Safe to call from several threads;
+  // the reference stays valid for the pyramid's lifetime.
+  const BmpImage::GrayImage &level(int k) {
+    if (k < 0 || k >= levels) {
+      throw std::out_of_range("Pyramid level out of range.");
+    }
+    std::lock_guard lock(mutex);
+    while (built.size() <= k) {
+      Trace::Scope trace("pyramid_level", built.back().data.data.size());
+      built.push_back(detail::reduce(built.back().view(), method));
+    }
+    return built[k];
+  }
+
+  GrayView view(int k) { return level(k).view(); }
+
+  // A region of level k in full-resolution pixels, clipped to level 0
+  Region to_full(int k, Region region) const {
+    const auto &base = built.front().size;
+    int s = scale(k);
+    int x = std::min(region.x * s, base.width);
+    int y = std::min(region.y * s, base.height);
+    return {x, y, std::min((region.x + region.width) * s, base.width) - x,
+            std::min((region.y + region.height) * s, base.height) - y};
+  }
+};
+
+} // namespace Pyramid
+
+#endif
@@ -2,12 +2,23 @@
 #define IMAGE_PROCESSING_SEGMENTATION_HXX
 
 #include "bmp_image.hxx"
+#include "cache.hxx"
+#include "indexed_image.hxx"
+#include "integral_image.hxx"
+#include "morphology.hxx"
+#include "pyramid.hxx"
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string>
+#include <stdexcept>
 #include <tuple>
 #include <unordered_set>
 #include <vector>
@@ -16,45 +27,133 @@ namespace Segmentation {
 
 namespace SegmentationByThreshold {
 
-BmpImage::BmpImage
-segment_by_threshold(BmpImage::BmpImage &img_src, int threshold,
+using PixelView = ImageView::ImageView<const BmpImage::BmpPixel>;
+
+BmpImage::Image<BmpImage::BmpPixel>
+segment_by_threshold(PixelView img, int threshold,
                      BmpImage::BmpPixel left_color = {0, 0, 0, 255},
                      BmpImage::BmpPixel right_color = {255, 255, 255, 255}) {
-  auto img = img_src;
-  img.image.data.foreach ([&](BmpImage::BmpPixel &pxl, size_t idx) {
-    if (pxl.gray() < threshold) {
+  Trace::Scope trace("segment_by_threshold", img.size());
+  BmpImage::Image<BmpImage::BmpPixel> result{
+      {img.width, img.height},
+      NumericArray::NumericArray<BmpImage::BmpPixel>(img.size(), left_color)};
+  result.data.foreach ([&](BmpImage::BmpPixel &pxl, size_t idx) {
+    if (img(idx % img.width, idx / img.width).gray() < threshold) {
       pxl = left_color;
     } else {
       pxl = right_color;
     }
   });
+  return result;
+}
+
+BmpImage::BmpImage
+segment_by_threshold(const BmpImage::BmpImage &img_src, int threshold,
+                     BmpImage::BmpPixel left_color = {0, 0, 0, 255},
+                     BmpImage::BmpPixel right_color = {255, 255, 255, 255}) {
+  return {img_src.header,
+          segment_by_threshold(img_src.image.view(), threshold, left_color,
+                               right_color),
+          img_src.palette};
+}
+
+// Thresholds in place, reusing the input's pixel buffer
+BmpImage::BmpImage
+segment_by_threshold(BmpImage::BmpImage &&img_src, int threshold,
+                     BmpImage::BmpPixel left_color = {0, 0, 0, 255},
+                     BmpImage::BmpPixel right_color = {255, 255, 255, 255}) {
+  img_src.image.data.foreach ([&](BmpImage::BmpPixel &pxl) {
+    pxl = pxl.gray() < threshold ? left_color : right_color;
+  });
+  return std::move(img_src);
+}
+
+// Indexed images are thresholded by rewriting their palette
+IndexedImage::IndexedImage
+segment_by_threshold(IndexedImage::IndexedImage img, int threshold,
+                     BmpImage::BmpPixel left_color = {0, 0, 0, 255},
+                     BmpImage::BmpPixel right_color = {255, 255, 255, 255}) {
+  img.map_palette([&](BmpImage::BmpPixel pixel) {
+    return pixel.gray() < threshold ? left_color : right_color;
+  });
   return img;
 }
 
-int auto_find_threshold_by_iteration(BmpImage::BmpImage &img_src,
-                                     int max_iterations = 1000,
-                                     double eps = 2) {
-  auto img = img_src;
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+BmpImage::GrayImage segment_by_threshold(GrayView img, int threshold,
+                                         uint8_t left_value = 0,
+                                         uint8_t right_value = 255) {
+  Trace::Scope trace("segment_by_threshold", img.size());
+  BmpImage::GrayImage result{
+      {img.width, img.height},
+      NumericArray::NumericArray<uint8_t>(img.size(), left_value)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    for (size_t y = start; y < end; y++) {
+      const uint8_t *row = img.row(y);
+      uint8_t *out = dst + y * img.width;
+      for (int x = 0; x < img.width; x++) {
+        out[x] = row[x] < threshold ? left_value : right_value;
+      }
+    }
+  });
+  return result;
+}
+
+// 256-bin luminance histogram, counted per worker and merged
+template <typename T, typename Gray>
+std::vector<int64_t> gray_histogram(ImageView::ImageView<const T> img,
+                                    Gray gray) {
+  std::vector<int64_t> histogram(256, 0);
+  std::mutex mutex;
+  NumericArray::parallel_for(img.height, [&](size_t start, size_t end) {
+    std::vector<int64_t> local(256, 0);
+    for (size_t y = start; y < end; y++) {
+      const T *row = img.row(y);
+      for (int x = 0; x < img.width; x++) {
+        local[gray(row[x])]++;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < 256; i++) {
+      histogram[i] += local[i];
+    }
+  });
+  return histogram;
+}
+
+std::vector<int64_t> gray_histogram(PixelView img) {
+  return gray_histogram(img,
+                        [](const BmpImage::BmpPixel &p) { return p.gray(); });
+}
+
+std::vector<int64_t> gray_histogram(GrayView img) {
+  return gray_histogram(img, [](uint8_t v) { return v; });
+}
+
+int threshold_by_iteration(const std::vector<int64_t> &histogram,
+                           int max_iterations = 1000, double eps = 2) {
   int threshold = 128; // Initial threshold
   double left_mean = 0;
   double right_mean = 0;
-  int left_count = 0;
-  int right_count = 0;
+  int64_t left_count = 0;
+  int64_t right_count = 0;
   int iterations = 0;
   while (iterations < max_iterations) {
     left_mean = 0;
     right_mean = 0;
     left_count = 0;
     right_count = 0;
-    img.image.data.foreach_sync([&](BmpImage::BmpPixel &pxl, size_t idx) {
-      if (pxl.gray() < threshold) {
-        left_mean += pxl.gray();
-        left_count++;
+    for (int g = 0; g < 256; g++) {
+      if (g < threshold) {
+        left_mean += static_cast<double>(g) * histogram[g];
+        left_count += histogram[g];
       } else {
-        right_mean += pxl.gray();
-        right_count++;
+        right_mean += static_cast<double>(g) * histogram[g];
+        right_count += histogram[g];
       }
-    });
+    }
     if (left_count == 0 || right_count == 0) {
       break;
     }
@@ -72,31 +171,30 @@ int auto_find_threshold_by_iteration(BmpImage::BmpImage &img_src,
   return threshold;
 }
 
-int auto_find_threshold_by_otsu(BmpImage::BmpImage &img_src) {
-  auto img = img_src;
+int threshold_by_otsu(const std::vector<int64_t> &histogram) {
   int threshold = 0;
   double max_variance = 0;
   for (int i = 0; i <= 256; i++) {
-    int left_count = 0;
-    int right_count = 0;
-    int left_sum = 0;
-    int right_sum = 0;
-    img.image.data.foreach_sync([&](BmpImage::BmpPixel &pxl, size_t idx) {
-      if (pxl.gray() < i) {
-        left_sum += pxl.gray();
-        left_count++;
+    int64_t left_count = 0;
+    int64_t right_count = 0;
+    int64_t left_sum = 0;
+    int64_t right_sum = 0;
+    for (int g = 0; g < 256; g++) {
+      if (g < i) {
+        left_sum += g * histogram[g];
+        left_count += histogram[g];
       } else {
-        right_sum += pxl.gray();
-        right_count++;
+        right_sum += g * histogram[g];
+        right_count += histogram[g];
       }
-    });
+    }
     if (left_count == 0 || right_count == 0) {
       continue;
     }
     double left_mean = static_cast<double>(left_sum) / left_count;
     double right_mean = static_cast<double>(right_sum) / right_count;
-    double variance = left_count * right_count * (left_mean - right_mean) *
-                      (left_mean - right_mean);
+    double variance = static_cast<double>(left_count) * right_count *
+                      (left_mean - right_mean) * (left_mean - right_mean);
     if (variance > max_variance) {
       max_variance = variance;
       threshold = i;
@@ -104,6 +202,111 @@ int auto_find_threshold_by_otsu(BmpImage::BmpImage &img_src) {
   }
   return threshold;
 }
+
+int auto_find_threshold_by_iteration(PixelView img, int max_iterations = 1000,
+                                     double eps = 2) {
+  Trace::Scope trace("auto_find_threshold_by_iteration", img.size());
+  return threshold_by_iteration(gray_histogram(img), max_iterations, eps);
+}
+
+int auto_find_threshold_by_iteration(GrayView img, int max_iterations = 1000,
+                                     double eps = 2) {
+  Trace::Scope trace("auto_find_threshold_by_iteration", img.size());
+  return threshold_by_iteration(gray_histogram(img), max_iterations, eps);
+}
+
+int auto_find_threshold_by_iteration(const BmpImage::BmpImage &img_src,
+                                     int max_iterations = 1000,
+                                     double eps = 2) {
+  return auto_find_threshold_by_iteration(img_src.image.view(),
+                                          max_iterations, eps);
+}
+
+int auto_find_threshold_by_otsu(PixelView img) {
+  Trace::Scope trace("auto_find_threshold_by_otsu", img.size());
+  return threshold_by_otsu(gray_histogram(img));
+}
+
+int auto_find_threshold_by_otsu(GrayView img) {
+  Trace::Scope trace("auto_find_threshold_by_otsu", img.size());
+  return threshold_by_otsu(gray_histogram(img));
+}
+
+int auto_find_threshold_by_otsu(const BmpImage::BmpImage &img_src) {
+  return auto_find_threshold_by_otsu(img_src.image.view());
+}
+
+// Local thresholds over the size x size window around each pixel, clipped
+// to the image. threshold(mean, deviation) gives the level of one pixel;
+// the window statistics come from an integral image, so any window size
+// costs the same.
+template <typename Threshold>
+BmpImage::GrayImage segment_by_local_threshold(GrayView img, int size,
+                                               Threshold threshold,
+                                               uint8_t left_value = 0,
+                                               uint8_t right_value = 255) {
+  if (size <= 0 || size % 2 == 0) {
+    throw std::invalid_argument("Window size must be odd.");
+  }
+  auto integral = IntegralImage::integral_image(img);
+  int half = size / 2;
+  int width = img.width;
+  int height = img.height;
+  BmpImage::GrayImage result{
+      {width, height}, NumericArray::NumericArray<uint8_t>(img.size(), 0)};
+  uint8_t *dst = result.data.data.data();
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const uint8_t *row = img.row(y);
+      uint8_t *out = dst + static_cast<size_t>(y) * width;
+      int t = std::max(y - half, 0), b = std::min(y + half + 1, height);
+      for (int x = 0; x < width; x++) {
+        int l = std::max(x - half, 0), r = std::min(x + half + 1, width);
+        double mean = integral.box_mean(l, t, r, b);
+        double deviation =
+            std::sqrt(std::max(integral.box_variance(l, t, r, b), 0.0));
+        out[x] = row[x] < threshold(mean, deviation) ? left_value : right_value;
+      }
+    }
+  });
+  return result;
+}
+
+// Niblack: mean + k * deviation
+BmpImage::GrayImage segment_by_niblack(GrayView img, int size, double k = -0.2,
+                                       uint8_t left_value = 0,
+                                       uint8_t right_value = 255) {
+  Trace::Scope trace("segment_by_niblack", img.size());
+  return segment_by_local_threshold(
+      img, size,
+      [k](double mean, double deviation) { return mean + k * deviation; },
+      left_value, right_value);
+}
+
+// Sauvola: mean * (1 + k * (deviation / range - 1)); darkens less than
+// Niblack on flat background
+BmpImage::GrayImage segment_by_sauvola(GrayView img, int size, double k = 0.5,
+                                       double range = 128,
+                                       uint8_t left_value = 0,
+                                       uint8_t right_value = 255) {
+  Trace::Scope trace("segment_by_sauvola", img.size());
+  return segment_by_local_threshold(
+      img, size,
+      [k, range](double mean, double deviation) {
+        return mean * (1 + k * (deviation / range - 1));
+      },
+      left_value, right_value);
+}
+
+// Bradley: pixels more than t below the window mean are dark
+BmpImage::GrayImage segment_by_bradley(GrayView img, int size, double t = 0.15,
+                                       uint8_t left_value = 0,
+                                       uint8_t right_value = 255) {
+  Trace::Scope trace("segment_by_bradley", img.size());
+  return segment_by_local_threshold(
+      img, size, [t](double mean, double) { return mean * (1 - t); },
+      left_value, right_value);
+}
 } // namespace SegmentationByThreshold
 
 namespace SegmentationByGrowth {
@@ -116,7 +319,7 @@ grow_region(BmpImage::BmpImage &img_src, const std::set<Point> &seeds,
                                const std::set<Point> &)>
                 validate,
             bool eight_direction = true) {
-  auto img = img_src;
+  Trace::Scope trace("grow_region", img_src.image.data.data.size());
   std::set<Point> region = seeds;
 
   bool last_round_any_points_grown = true;
@@ -139,8 +342,8 @@ grow_region(BmpImage::BmpImage &img_src, const std::set<Point> &seeds,
         int nx = px + std::get<0>(directions[i]);
         int ny = py + std::get<1>(directions[i]);
 
-        if (nx >= 0 && nx < img.image.size.width && ny >= 0 &&
-            ny < img.image.size.height) {
+        if (nx >= 0 && nx < img_src.image.size.width && ny >= 0 &&
+            ny < img_src.image.size.height) {
           next_try_points.insert({nx, ny});
         }
       }
@@ -152,7 +355,7 @@ grow_region(BmpImage::BmpImage &img_src, const std::set<Point> &seeds,
                         std::inserter(next_points, next_points.begin()));
 
     for (const auto &point : next_points) {
-      if (validate(point, img, region)) {
+      if (validate(point, img_src, region)) {
         region.insert(point);
         last_round_any_points_grown = true;
       }
@@ -282,13 +485,14 @@ grow_region(BmpImage::BmpImage &img_src, const std::set<Point> &seeds,
 // }
 
 std::vector<std::set<Point>>
-split_region(BmpImage::BmpImage &img_src,
+split_region(ImageView::ImageView<const BmpImage::BmpPixel> img_src,
              BmpImage::BmpPixel bg_color = {0, 0, 0, 255},
              BmpImage::BmpPixel fg_color = {255, 255, 255, 255},
              double color_tolerance = 8.0) {
+  Trace::Scope trace("split_region", img_src.size());
 
-  int width = img_src.image.size.width;
-  int height = img_src.image.size.height;
+  int width = img_src.width;
+  int height = img_src.height;
 
   std::vector<std::vector<int>> labels(height, std::vector<int>(width, 0));
   std::map<int, int> parent;
@@ -313,7 +517,7 @@ split_region(BmpImage::BmpImage &img_src,
 
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
-      BmpImage::BmpPixel &pixel = img_src.image[y * width + x];
+      const BmpImage::BmpPixel &pixel = img_src(x, y);
       if (pixel.diff(bg_color) < color_tolerance) {
         continue;
       }
@@ -377,6 +581,15 @@ split_region(BmpImage::BmpImage &img_src,
   return result;
 }
 
+std::vector<std::set<Point>>
+split_region(BmpImage::BmpImage &img_src,
+             BmpImage::BmpPixel bg_color = {0, 0, 0, 255},
+             BmpImage::BmpPixel fg_color = {255, 255, 255, 255},
+             double color_tolerance = 8.0) {
+  return split_region(img_src.image.view(), bg_color, fg_color,
+                      color_tolerance);
+}
+
 std::vector<std::set<Point>>
 get_borders(BmpImage::BmpImage &img_src,
             BmpImage::BmpPixel bg_color = {0, 0, 0, 255},
@@ -413,8 +626,431 @@ get_borders(BmpImage::BmpImage &img_src,
 
   return borders;
 }
+
+// One label per pixel: 0 for background, regions numbered from 1 in the
+// order their first pixel appears in row-major order
+using LabelImage = BmpImage::Image<int32_t>;
+
+// Labels as label_regions returns them: mapped straight from the cache
+// entry on a warm run, so they are read through view()
+using RegionLabels = Cache::Image<int32_t>;
+
+namespace detail {
+
+// Two-pass connected components: provisional labels from the neighbors
+// already visited, merged in a flat union-find, then made consecutive
+template <typename Foreground>
+LabelImage label_regions(int width, int height, Foreground foreground,
+                         bool eight_direction) {
+  LabelImage labels{{width, height},
+                    NumericArray::NumericArray<int32_t>(
+                        static_cast<size_t>(width) * height, 0)};
+  int32_t *label = labels.data.data.data();
+  std::vector<int32_t> parent{0};
+  auto find = [&](int32_t l) {
+    while (parent[l] != l) {
+      parent[l] = parent[parent[l]];
+      l = parent[l];
+    }
+    return l;
+  };
+  auto unite = [&](int32_t a, int32_t b) {
+    a = find(a);
+    b = find(b);
+    parent[std::max(a, b)] = std::min(a, b);
+  };
+
+  for (int y = 0; y < height; y++) {
+    int32_t *row = label + static_cast<size_t>(y) * width;
+    const int32_t *above = y > 0 ? row - width : nullptr;
+    for (int x = 0; x < width; x++) {
+      if (!foreground(x, y)) {
+        continue;
+      }
+      int32_t current = 0;
+      auto visit = [&](int32_t neighbor) {
+        if (neighbor == 0) {
+          return;
+        }
+        if (current == 0) {
+          current = neighbor;
+        } else if (neighbor != current) {
+          unite(current, neighbor);
+        }
+      };
+      if (x > 0) {
+        visit(row[x - 1]);
+      }
+      if (above) {
+        visit(above[x]);
+        if (eight_direction && x > 0) {
+          visit(above[x - 1]);
+        }
+        if (eight_direction && x + 1 < width) {
+          visit(above[x + 1]);
+        }
+      }
+      if (current == 0) {
+        current = parent.size();
+        parent.push_back(current);
+      }
+      row[x] = current;
+    }
+  }
+
+  // Roots are the smallest label of their set, so numbering them in order
+  // keeps the first-pixel order
+  std::vector<int32_t> number(parent.size(), 0);
+  int32_t count = 0;
+  for (int32_t l = 1; l < parent.size(); l++) {
+    int32_t root = find(l);
+    number[l] = root == l ? ++count : number[root];
+  }
+  for (auto &l : labels.data.data) {
+    l = number[l];
+  }
+  return labels;
+}
+
+// Label images are cached by input content and parameters
+template <typename Key, typename Compute>
+RegionLabels cached_labels(const std::string &stage, Key key,
+                           Compute compute) {
+  return Cache::image<int32_t>(stage, key, [&]() {
+    auto labels = compute();
+    return RegionLabels{labels.size.width, labels.size.height,
+                        std::move(labels.data.data), {}};
+  });
+}
+
+} // namespace detail
+
+// Regions of the pixels that differ from bg_color, as a label image
+RegionLabels
+label_regions(ImageView::ImageView<const BmpImage::BmpPixel> img,
+              BmpImage::BmpPixel bg_color = {0, 0, 0, 255},
+              double color_tolerance = 8.0, bool eight_direction = true) {
+  Trace::Scope trace("label_regions", img.size());
+  return detail::cached_labels(
+      "label_regions",
+      [&](Cache::Hasher &key) {
+        key.add(img).add(bg_color).add(color_tolerance).add(eight_direction);
+      },
+      [&]() {
+        return detail::label_regions(
+            img.width, img.height,
+            [&](int x, int y) {
+              return !(img(x, y).diff(bg_color) < color_tolerance);
+            },
+            eight_direction);
+      });
+}
+
+// Regions of the nonzero pixels of a mask
+RegionLabels label_regions(ImageView::ImageView<const uint8_t> mask,
+                           bool eight_direction = true) {
+  Trace::Scope trace("label_regions", mask.size());
+  return detail::cached_labels(
+      "label_regions_mask",
+      [&](Cache::Hasher &key) { key.add(mask).add(eight_direction); },
+      [&]() {
+        return detail::label_regions(
+            mask.width, mask.height,
+            [&](int x, int y) { return mask(x, y) != 0; }, eight_direction);
+      });
+}
+
 } // namespace SegmentationByGrowth
 
+// Separating touching regions: the distance from each region pixel to the
+// background peaks once per blob, and flooding from those peaks splits the
+// region where the blobs meet.
+namespace SegmentationByWatershed {
+
+using LabelImage = SegmentationByGrowth::LabelImage;
+
+namespace detail {
+
+// Felzenszwalb and Huttenlocher, "Distance Transforms of Sampled Functions"
+// (2012): d[q] = min over p of f[p] + (q - p)^2, from the lower envelope of
+// the parabolas rooted at each p. The scratch buffers are resized to n + 1
+// entries. An empty line, from a zero-height view, has nothing to do.
+void squared_distance_line(const double *f, double *d, int n,
+                           std::vector<int> &hull,
+                           std::vector<double> &bounds,
+                           std::vector<double> &g) {
+  if (n == 0) {
+    return;
+  }
+  hull.resize(n + 1);
+  bounds.resize(n + 1);
+  g.resize(n + 1);
+  for (int q = 0; q < n; q++) {
+    g[q] = f[q] + static_cast<double>(q) * q;
+  }
+  int k = 0;
+  hull[0] = 0;
+  bounds[0] = -std::numeric_limits<double>::infinity();
+  bounds[1] = std::numeric_limits<double>::infinity();
+  for (int q = 1; q < n; q++) {
+    // Where the parabola of q overtakes the one on top of the hull
+    double s;
+    while (true) {
+      int p = hull[k];
+      s = (g[q] - g[p]) / (2.0 * (q - p));
+      if (s > bounds[k]) {
+        break;
+      }
+      k--;
+    }
+    k++;
+    hull[k] = q;
+    bounds[k] = s;
+    bounds[k + 1] = std::numeric_limits<double>::infinity();
+  }
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    while (bounds[k + 1] < q) {
+      k++;
+    }
+    double offset = q - hull[k];
+    d[q] = offset * offset + f[hull[k]];
+  }
+}
+
+// Stands in for infinity in the input: finite, so the envelope arithmetic
+// stays defined, and larger than any squared distance
+constexpr double far = 1e20;
+
+// Columns handled together by one worker, gathered into contiguous lines
+constexpr int column_block = 16;
+
+} // namespace detail
+
+// Euclidean distance from every labeled pixel to the nearest background
+// (label 0) pixel; background pixels get 0. Exact, in O(N): a 1-D transform
+// runs along every row in parallel, then along every column.
+// Without any background every distance is infinite.
+BmpImage::Image<float>
+distance_transform(ImageView::ImageView<const int32_t> labels) {
+  int width = labels.width;
+  int height = labels.height;
+  Trace::Scope trace("distance_transform",
+                     static_cast<size_t>(width) * height);
+  BmpImage::Image<float> result{
+      {width, height},
+      NumericArray::NumericArray<float>(static_cast<size_t>(width) * height,
+                                        0)};
+  float *dst = result.data.data.data();
+
+  // Along a row the input is 0 or infinite, so the 1-D transform is the
+  // distance to the nearest background pixel on either side. It is stored
+  // unsquared, which a float holds exactly.
+  NumericArray::parallel_for(height, [&](size_t start, size_t end) {
+    for (int y = start; y < end; y++) {
+      const int32_t *row = labels.row(y);
+      float *out = dst + static_cast<size_t>(y) * width;
+      float distance = std::numeric_limits<float>::infinity();
+      for (int x = 0; x < width; x++) {
+        distance = row[x] == 0 ? 0 : distance + 1;
+        out[x] = distance;
+      }
+      distance = std::numeric_limits<float>::infinity();
+      for (int x = width - 1; x >= 0; x--) {
+        distance = row[x] == 0 ? 0 : distance + 1;
+        out[x] = std::min(out[x], distance);
+      }
+    }
+  });
+
+  int blocks = (width + detail::column_block - 1) / detail::column_block;
+  NumericArray::parallel_for(blocks, [&](size_t start, size_t end) {
+    BufferPool::Scratch<double> lines(
+        static_cast<size_t>(detail::column_block) * height);
+    BufferPool::Scratch<double> squared(lines.size());
+    std::vector<int> hull;
+    std::vector<double> bounds, g;
+    for (size_t block = start; block < end; block++) {
+      int x0 = block * detail::column_block;
+      int columns = std::min(detail::column_block, width - x0);
+      for (int y = 0; y < height; y++) {
+        const float *row = dst + static_cast<size_t>(y) * width + x0;
+        for (int c = 0; c < columns; c++) {
+          double distance = row[c];
+          lines[static_cast<size_t>(c) * height + y] =
+              std::isinf(row[c]) ? detail::far : distance * distance;
+        }
+      }
+      for (int c = 0; c < columns; c++) {
+        size_t offset = static_cast<size_t>(c) * height;
+        detail::squared_distance_line(lines.data() + offset,
+                                      squared.data() + offset, height, hull,
+                                      bounds, g);
+      }
+      for (int y = 0; y < height; y++) {
+        float *row = dst + static_cast<size_t>(y) * width + x0;
+        for (int c = 0; c < columns; c++) {
+          double value = squared[static_cast<size_t>(c) * height + y];
+          row[c] = value >= detail::far
+                       ? std::numeric_limits<float>::infinity()
+                       : static_cast<float>(std::sqrt(value));
+        }
+      }
+    }
+  });
+  return result;
+}
+
+// Marker-controlled watershed (Meyer flooding). Pixels with a positive
+// marker seed their label; the rest are flooded from the seeds, lowest
+// elevation first, each taking the label of the neighbor that reached it.
+// Flooding stays inside the region of `regions` it starts in; pixels whose
+// region is 0 are never flooded and stay 0. The priority queue is 256 FIFO
+// buckets, one per elevation, so a push or pop is O(1) and equal
+// elevations flood in breadth-first order.
+LabelImage watershed(ImageView::ImageView<const uint8_t> elevation,
+                     ImageView::ImageView<const int32_t> markers,
+                     ImageView::ImageView<const int32_t> regions,
+                     bool eight_direction = false) {
+  Trace::Scope trace("watershed", elevation.size());
+  int width = elevation.width;
+  int height = elevation.height;
+  if (markers.width != width || markers.height != height ||
+      regions.width != width || regions.height != height) {
+    throw std::invalid_argument("Image sizes do not match.");
+  }
+  LabelImage result{{width, height},
+                    NumericArray::NumericArray<int32_t>(
+                        static_cast<size_t>(width) * height, 0)};
+  int32_t *label = result.data.data.data();
+
+  std::array<std::vector<int32_t>, 256> buckets;
+  std::array<size_t, 256> heads{};
+  int level = 0;
+  auto push = [&](int32_t index, int x, int y) {
+    buckets[std::max<int>(elevation(x, y), level)].push_back(index);
+  };
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      size_t index = static_cast<size_t>(y) * width + x;
+      if (markers(x, y) > 0 && regions(x, y) != 0) {
+        label[index] = markers(x, y);
+        push(index, x, y);
+      }
+    }
+  }
+
+  const int offsets[8][2] = {{1, 0},   {-1, 0}, {0, 1},  {0, -1},
+                             {1, 1},   {-1, 1}, {1, -1}, {-1, -1}};
+  int directions = eight_direction ? 8 : 4;
+  for (; level < 256; level++) {
+    auto &bucket = buckets[level];
+    // Pushes during the loop land in this bucket or later ones
+    while (heads[level] < bucket.size()) {
+      int32_t index = bucket[heads[level]++];
+      int x = index % width, y = index / width;
+      int32_t region = regions(x, y);
+      for (int i = 0; i < directions; i++) {
+        int nx = x + offsets[i][0], ny = y + offsets[i][1];
+        if (nx < 0 || nx >= width || ny < 0 || ny >= height) {
+          continue;
+        }
+        size_t neighbor = static_cast<size_t>(ny) * width + nx;
+        if (label[neighbor] == 0 && regions(nx, ny) == region) {
+          label[neighbor] = label[index];
+          push(neighbor, nx, ny);
+        }
+      }
+    }
+    std::vector<int32_t>().swap(bucket);
+  }
+  return result;
+}
+
+// Floods every labeled pixel
+LabelImage watershed(ImageView::ImageView<const uint8_t> elevation,
+                     ImageView::ImageView<const int32_t> markers,
+                     bool eight_direction = false) {
+  LabelImage everywhere{{elevation.width, elevation.height},
+                        NumericArray::NumericArray<int32_t>(
+                            elevation.size(), 1)};
+  return watershed(elevation, markers, everywhere.view(), eight_direction);
+}
+
+// Splits each region of `regions` into its blobs. Peaks of the distance
+// transform, at least min_distance from the background and the highest
+// within a footprint x footprint window, become the markers, and the
+// regions are flooded from them over the inverted distance scaled to 0-255.
+// Labels are renumbered like label_regions.
+LabelImage separate_regions(ImageView::ImageView<const int32_t> regions,
+                            int footprint = 7, double min_distance = 2.0) {
+  int width = regions.width;
+  int height = regions.height;
+  Trace::Scope trace("separate_regions",
+                     static_cast<size_t>(width) * height);
+  auto distance = distance_transform(regions);
+  auto dilated =
+      Morphology::dilate(distance.view(), {footprint, footprint});
+  BmpImage::GrayImage peaks{
+      {width, height}, NumericArray::NumericArray<uint8_t>(
+                           static_cast<size_t>(width) * height, 0)};
+  for (size_t i = 0; i < peaks.data.data.size(); i++) {
+    float d = distance.data.data[i];
+    peaks.data.data[i] =
+        d >= min_distance && d == dilated.data.data[i] ? 255 : 0;
+  }
+  auto markers = SegmentationByGrowth::label_regions(peaks.view());
+
+  float peak = 0;
+  for (float d : distance.data.data) {
+    if (std::isfinite(d)) {
+      peak = std::max(peak, d);
+    }
+  }
+  BmpImage::GrayImage height_map{
+      {width, height}, NumericArray::NumericArray<uint8_t>(
+                           static_cast<size_t>(width) * height, 0)};
+  double scale = peak > 0 ? 255 / peak : 0;
+  for (size_t i = 0; i < distance.data.data.size(); i++) {
+    height_map.data.data[i] = 255 - static_cast<uint8_t>(std::lround(
+                                        std::min<double>(
+                                            distance.data.data[i] * scale,
+                                            255)));
+  }
+  auto flooded = watershed(height_map.view(), markers.view(), regions, true);
+
+  // Regions without a peak (thinner than min_distance) stay whole
+  auto count_labels = [](ImageView::ImageView<const int32_t> labels) {
+    int32_t count = 0;
+    for (auto row : labels.rows()) {
+      for (int32_t l : row) {
+        count = std::max(count, l);
+      }
+    }
+    return count;
+  };
+  std::vector<int32_t> marker_number(count_labels(markers.view()) + 1, 0);
+  std::vector<int32_t> region_number(count_labels(regions) + 1, 0);
+  int32_t count = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int32_t &l = flooded.data.data[static_cast<size_t>(y) * width + x];
+      int32_t region = regions(x, y);
+      if (region == 0) {
+        continue;
+      }
+      int32_t &number = l != 0 ? marker_number[l] : region_number[region];
+      if (number == 0) {
+        number = ++count;
+      }
+      l = number;
+    }
+  }
+  return flooded;
+}
+
+} // namespace SegmentationByWatershed
+
 namespace SegmentationByQuadTree {
 struct Box {
   int l;
@@ -444,8 +1080,8 @@ using HomogeneousFunction =
     std::function<bool(const BmpImage::BmpImage &, const std::vector<Box> &)>;
 
 std::shared_ptr<QuadTreeNode>
-build_quad_tree(const BmpImage::BmpImage &img_src,
-                HomogeneousFunction homogenous_function, Box box) {
+build_quad_tree_node(const BmpImage::BmpImage &img_src,
+                     const HomogeneousFunction &homogenous_function, Box box) {
   auto node = std::make_shared<QuadTreeNode>();
   node->box = box;
   node->is_leaf = false;
@@ -455,18 +1091,25 @@ build_quad_tree(const BmpImage::BmpImage &img_src,
   } else {
     auto mid_x = (box.l + box.r) / 2;
     auto mid_y = (box.t + box.b) / 2;
-    node->children[0] = build_quad_tree(img_src, homogenous_function,
-                                        {box.l, mid_x, box.t, mid_y});
-    node->children[1] = build_quad_tree(img_src, homogenous_function,
-                                        {mid_x, box.r, box.t, mid_y});
-    node->children[2] = build_quad_tree(img_src, homogenous_function,
-                                        {box.l, mid_x, mid_y, box.b});
-    node->children[3] = build_quad_tree(img_src, homogenous_function,
-                                        {mid_x, box.r, mid_y, box.b});
+    node->children[0] = build_quad_tree_node(img_src, homogenous_function,
+                                             {box.l, mid_x, box.t, mid_y});
+    node->children[1] = build_quad_tree_node(img_src, homogenous_function,
+                                             {mid_x, box.r, box.t, mid_y});
+    node->children[2] = build_quad_tree_node(img_src, homogenous_function,
+                                             {box.l, mid_x, mid_y, box.b});
+    node->children[3] = build_quad_tree_node(img_src, homogenous_function,
+                                             {mid_x, box.r, mid_y, box.b});
     return node;
   }
 }
 
+std::shared_ptr<QuadTreeNode>
+build_quad_tree(const BmpImage::BmpImage &img_src,
+                HomogeneousFunction homogenous_function, Box box) {
+  Trace::Scope trace("build_quad_tree", img_src.image.data.data.size());
+  return build_quad_tree_node(img_src, homogenous_function, box);
+}
+
 std::vector<Box> get_leaf_boxes(std::shared_ptr<QuadTreeNode> node) {
   std::vector<Box> boxes;
   if (node->is_leaf) {
@@ -480,6 +1123,114 @@ std::vector<Box> get_leaf_boxes(std::shared_ptr<QuadTreeNode> node) {
   return boxes;
 }
 } // namespace SegmentationByQuadTree
+
+// Coarse-to-fine segmentation: candidate regions are found on a coarse
+// pyramid level, and full-resolution work runs only inside them
+namespace SegmentationByPyramid {
+
+using GrayView = ImageView::ImageView<const uint8_t>;
+
+// Bounding boxes of the connected pixels at or above `threshold` on the
+// given level, grown by `margin` pixels of that level and scaled to full
+// resolution. Overlapping boxes are merged, so no pixel is in two regions.
+std::vector<Pyramid::Region> candidate_regions(Pyramid::Pyramid &pyramid,
+                                               int level, int threshold,
+                                               int margin = 1) {
+  auto coarse = pyramid.view(level);
+  Trace::Scope trace("candidate_regions", coarse.size());
+  BmpImage::GrayImage mask{
+      {coarse.width, coarse.height},
+      NumericArray::NumericArray<uint8_t>(coarse.size(), 0)};
+  for (int y = 0; y < coarse.height; y++) {
+    for (int x = 0; x < coarse.width; x++) {
+      mask.data.data[y * coarse.width + x] = coarse(x, y) >= threshold;
+    }
+  }
+  auto labels = SegmentationByGrowth::label_regions(mask.view());
+
+  // [l, t, r, b) per label
+  std::vector<std::array<int, 4>> boxes;
+  for (int y = 0; y < coarse.height; y++) {
+    for (int x = 0; x < coarse.width; x++) {
+      int label = labels(x, y);
+      if (label == 0) {
+        continue;
+      }
+      if (label > boxes.size()) {
+        boxes.push_back({x, y, x + 1, y + 1});
+      }
+      auto &box = boxes[label - 1];
+      box = {std::min(box[0], x), std::min(box[1], y),
+             std::max(box[2], x + 1), std::max(box[3], y + 1)};
+    }
+  }
+  for (auto &box : boxes) {
+    box = {std::max(box[0] - margin, 0), std::max(box[1] - margin, 0),
+           std::min(box[2] + margin, coarse.width),
+           std::min(box[3] + margin, coarse.height)};
+  }
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < boxes.size() && !merged; i++) {
+      for (size_t j = i + 1; j < boxes.size(); j++) {
+        auto &a = boxes[i];
+        auto &b = boxes[j];
+        if (a[0] < b[2] && b[0] < a[2] && a[1] < b[3] && b[1] < a[3]) {
+          a = {std::min(a[0], b[0]), std::min(a[1], b[1]),
+               std::max(a[2], b[2]), std::max(a[3], b[3])};
+          boxes.erase(boxes.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+
+  std::vector<Pyramid::Region> regions;
+  for (const auto &[l, t, r, b] : boxes) {
+    regions.push_back(pyramid.to_full(level, {l, t, r - l, b - t}));
+  }
+  return regions;
+}
+
+// Otsu's threshold over the pixels of `regions` only, applied inside them;
+// everything outside becomes left_value
+BmpImage::GrayImage segment_by_otsu(GrayView img,
+                                    const std::vector<Pyramid::Region> &regions,
+                                    uint8_t left_value = 0,
+                                    uint8_t right_value = 255) {
+  Trace::Scope trace("segment_by_otsu_in_regions", img.size());
+  std::vector<int64_t> histogram(256, 0);
+  for (const auto &region : regions) {
+    auto roi = img.sub_view(region.x, region.y, region.width, region.height);
+    auto counts = SegmentationByThreshold::gray_histogram(roi);
+    for (int i = 0; i < 256; i++) {
+      histogram[i] += counts[i];
+    }
+  }
+  int threshold = SegmentationByThreshold::threshold_by_otsu(histogram);
+  BmpImage::GrayImage result{
+      {img.width, img.height},
+      NumericArray::NumericArray<uint8_t>(img.size(), left_value)};
+  for (const auto &region : regions) {
+    auto roi = img.sub_view(region.x, region.y, region.width, region.height);
+    auto out = result.view().sub_view(region.x, region.y, region.width,
+                                      region.height);
+    NumericArray::parallel_for(roi.height, [&](size_t start, size_t end) {
+      for (int y = start; y < end; y++) {
+        const uint8_t *row = roi.row(y);
+        uint8_t *dst = out.row(y);
+        for (int x = 0; x < roi.width; x++) {
+          dst[x] = row[x] < threshold ? left_value : right_value;
+        }
+      }
+    });
+  }
+  return result;
+}
+
+} // namespace SegmentationByPyramid
 } // namespace Segmentation
 
 #endif
\ No newline at end of file
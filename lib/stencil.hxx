@@ -0,0 +1,184 @@
+#ifndef IMAGE_PROCESSING_STENCIL_HXX
+#define IMAGE_PROCESSING_STENCIL_HXX
+
+#include "bmp_image.hxx"
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Convolution kernels fixed at compile time. Stencil<K, Divisor, W...> has
+// the weights W / Divisor, so its tap loop is fully unrolled and zero
+// weights generate no code. Each tap computes the same double products in
+// the same order as the generic loop in apply_kernel, so the output is
+// identical. specialize() maps a runtime kernel to one of the common
+// stencils below.
+namespace Stencil {
+
+using Pixel = BmpImage::BmpPixel;
+
+// Writes one output row; rows[i] is input row y + i - K / 2, clamped to the
+// image
+using RowFunction = void (*)(const Pixel *const *rows, int width, Pixel *out);
+
+template <int K, int Divisor, int... Weights> struct Stencil {
+  static_assert(K % 2 == 1, "Kernel size must be odd.");
+  static_assert(sizeof...(Weights) == K * K, "Expected K * K weights.");
+  static constexpr int size = K;
+  static constexpr int half = K / 2;
+  static constexpr std::array<int, K * K> weights{Weights...};
+
+  static constexpr double weight(int i) {
+    return static_cast<double>(weights[i]) / Divisor;
+  }
+
+  static bool matches(const std::vector<std::vector<double>> &kernel) {
+    if (kernel.size() != K) {
+      return false;
+    }
+    for (int y = 0; y < K; y++) {
+      if (kernel[y].size() != K) {
+        return false;
+      }
+      for (int x = 0; x < K; x++) {
+        if (kernel[y][x] != weight(y * K + x)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  template <bool Clamp, size_t I>
+  static void tap(const Pixel *const *rows, int x, int width, double &red,
+                  double &green, double &blue) {
+    if constexpr (weights[I] != 0) {
+      constexpr double w = weight(I);
+      constexpr int dx = static_cast<int>(I % K) - half;
+      int column = Clamp ? std::clamp(x + dx, 0, width - 1) : x + dx;
+      const Pixel &neighbor = rows[I / K][column];
+      red += neighbor.red * w;
+      green += neighbor.green * w;
+      blue += neighbor.blue * w;
+    }
+  }
+
+  template <bool Clamp, size_t... I>
+  static Pixel pixel(const Pixel *const *rows, int x, int width,
+                     std::index_sequence<I...>) {
+    double red = 0, green = 0, blue = 0;
+    (tap<Clamp, I>(rows, x, width, red, green, blue), ...);
+    auto clamp = [](double value) {
+      return static_cast<uint8_t>(std::clamp(static_cast<int>(value), 0, 255));
+    };
+    return {clamp(red), clamp(green), clamp(blue), 255};
+  }
+
+  static void apply_row(const Pixel *const *rows, int width, Pixel *out) {
+    constexpr auto taps = std::make_index_sequence<K * K>();
+    int x = 0;
+    for (; x < std::min(half, width); x++) {
+      out[x] = pixel<true>(rows, x, width, taps);
+    }
+    for (; x < width - half; x++) {
+      out[x] = pixel<false>(rows, x, width, taps);
+    }
+    for (; x < width; x++) {
+      out[x] = pixel<true>(rows, x, width, taps);
+    }
+  }
+};
+
+// clang-format off
+using Box3 = Stencil<3, 9,
+    1, 1, 1,
+    1, 1, 1,
+    1, 1, 1>;
+using Box5 = Stencil<5, 25,
+    1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1>;
+using Gaussian3 = Stencil<3, 16,
+    1, 2, 1,
+    2, 4, 2,
+    1, 2, 1>;
+using Gaussian5 = Stencil<5, 256,
+    1,  4,  6,  4, 1,
+    4, 16, 24, 16, 4,
+    6, 24, 36, 24, 6,
+    4, 16, 24, 16, 4,
+    1,  4,  6,  4, 1>;
+// Sobel and Prewitt, named by the direction of increasing intensity that
+// gives a positive response
+using SobelRight = Stencil<3, 1,
+    -1, 0, 1,
+    -2, 0, 2,
+    -1, 0, 1>;
+using SobelLeft = Stencil<3, 1,
+    1, 0, -1,
+    2, 0, -2,
+    1, 0, -1>;
+using SobelDown = Stencil<3, 1,
+    -1, -2, -1,
+     0,  0,  0,
+     1,  2,  1>;
+using SobelUp = Stencil<3, 1,
+     1,  2,  1,
+     0,  0,  0,
+    -1, -2, -1>;
+using PrewittRight = Stencil<3, 1,
+    -1, 0, 1,
+    -1, 0, 1,
+    -1, 0, 1>;
+using PrewittLeft = Stencil<3, 1,
+    1, 0, -1,
+    1, 0, -1,
+    1, 0, -1>;
+using PrewittDown = Stencil<3, 1,
+    -1, -1, -1,
+     0,  0,  0,
+     1,  1,  1>;
+using PrewittUp = Stencil<3, 1,
+     1,  1,  1,
+     0,  0,  0,
+    -1, -1, -1>;
+using LaplacianOfGaussian = Stencil<5, 1,
+     0,  0, -1,  0,  0,
+     0, -1, -2, -1,  0,
+    -1, -2, 16, -2, -1,
+     0, -1, -2, -1,  0,
+     0,  0, -1,  0,  0>;
+// clang-format on
+
+// Largest K among the stencils specialize() can return
+constexpr int max_size = 5;
+
+struct Specialized {
+  int size;
+  RowFunction apply_row;
+};
+
+template <typename... Stencils>
+std::optional<Specialized>
+find_stencil(const std::vector<std::vector<double>> &kernel) {
+  std::optional<Specialized> found;
+  ((Stencils::matches(kernel) &&
+    (found = Specialized{Stencils::size, &Stencils::apply_row}, true)) ||
+   ...);
+  return found;
+}
+
+// The compiled stencil for `kernel`, if it is one of the common ones
+std::optional<Specialized>
+specialize(const std::vector<std::vector<double>> &kernel) {
+  return find_stencil<Box3, Box5, Gaussian3, Gaussian5, SobelRight, SobelLeft,
+                      SobelDown, SobelUp, PrewittRight, PrewittLeft,
+                      PrewittDown, PrewittUp, LaplacianOfGaussian>(kernel);
+}
+
+} // namespace Stencil
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef IMAGE_PROCESSING_TRACE_HXX
+#define IMAGE_PROCESSING_TRACE_HXX
+
+#include "buffer_pool.hxx"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Stage tracing. Library entry points open a Scope, and the NumericArray
+// parallel loops record one event per loop and per worker chunk. Nothing is
+// recorded until enable() is called; a disabled Scope costs one relaxed
+// atomic load. Events carry the label of the thread that opened them
+// (set_label, propagated to loop workers), so concurrent jobs can each take
+// their own events and write them as a Chrome trace or a summary table.
+namespace Trace {
+
+enum class Kind { Stage, Loop, Worker, Counter };
+
+struct Event {
+  Kind kind;
+  const char *name;
+  const char *parent; // enclosing stage, for loops and workers
+  std::string label;
+  int thread;
+  int64_t start_us;
+  int64_t duration_us;
+  size_t items = 0;    // pixels, or loop iterations
+  size_t bytes = 0;    // pooled bytes allocated while open (process wide)
+  int workers = 0;     // Loop: number of workers, Worker: worker index
+  int64_t busy_us = 0; // Loop: summed worker time
+  double value = 0;    // Counter
+};
+
+namespace detail {
+
+std::atomic<bool> enabled{false};
+
+struct Collector {
+  std::mutex mutex;
+  std::vector<Event> events;
+  std::atomic<int> next_thread{0};
+  std::chrono::steady_clock::time_point epoch =
+      std::chrono::steady_clock::now();
+};
+
+Collector &collector() {
+  static auto *instance = new Collector();
+  return *instance;
+}
+
+thread_local std::string label;
+thread_local const char *stage = nullptr;
+
+int thread_id() {
+  thread_local int id = collector().next_thread++;
+  return id;
+}
+
+int64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - collector().epoch)
+      .count();
+}
+
+size_t allocated_bytes() {
+  return BufferPool::detail::counters().allocated_bytes;
+}
+
+void record(Event &&event) {
+  auto &c = collector();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  c.events.push_back(std::move(event));
+}
+
+} // namespace detail
+
+bool enabled() { return detail::enabled.load(std::memory_order_relaxed); }
+
+void enable(bool on = true) { detail::enabled = on; }
+
+// Tags the events opened on this thread, e.g. with the image being processed
+void set_label(std::string label) { detail::label = std::move(label); }
+
+const std::string &label() { return detail::label; }
+
+// Records a sampled value, shown as a counter track in the Chrome trace
+void count(const char *name, double value) {
+  if (!enabled()) {
+    return;
+  }
+  detail::record({Kind::Counter, name, detail::stage, detail::label,
+                  detail::thread_id(), detail::now_us(), 0, 0, 0, 0, 0,
+                  value});
+}
+
+// Times the enclosing block as a stage; `items` is usually the pixel count
+struct Scope {
+  bool active = false;
+  const char *name;
+  const char *parent;
+  size_t items;
+  int64_t start_us;
+  size_t start_bytes;
+
+  explicit Scope(const char *name, size_t items = 0) {
+    if (!enabled()) {
+      return;
+    }
+    active = true;
+    this->name = name;
+    this->items = items;
+    parent = detail::stage;
+    detail::stage = name;
+    start_bytes = detail::allocated_bytes();
+    start_us = detail::now_us();
+  }
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+  ~Scope() {
+    if (!active) {
+      return;
+    }
+    int64_t end_us = detail::now_us();
+    detail::stage = parent;
+    detail::record({Kind::Stage, name, parent, detail::label,
+                    detail::thread_id(), start_us, end_us - start_us, items,
+                    detail::allocated_bytes() - start_bytes});
+    if (!parent) {
+      count("pooled_bytes", BufferPool::pooled_bytes());
+    }
+  }
+};
+
+// Wraps one parallel loop. Workers run on fresh threads, so each worker()
+// copies the caller's label and stage over before timing its chunk.
+struct Loop {
+  bool active = false;
+  size_t size;
+  int workers;
+  const char *stage;
+  std::string label;
+  int64_t start_us;
+  std::atomic<int64_t> busy_us{0};
+
+  struct Worker {
+    Loop *loop = nullptr;
+    int index;
+    size_t items;
+    int64_t start_us;
+
+    Worker(Loop *loop, int index, size_t items)
+        : loop(loop), index(index), items(items) {
+      if (loop) {
+        detail::label = loop->label;
+        detail::stage = loop->stage;
+        start_us = detail::now_us();
+      }
+    }
+
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+
+    ~Worker() {
+      if (!loop) {
+        return;
+      }
+      int64_t duration = detail::now_us() - start_us;
+      loop->busy_us += duration;
+      detail::record({Kind::Worker, "worker", loop->stage, loop->label,
+                      detail::thread_id(), start_us, duration, items, 0,
+                      index});
+    }
+  };
+
+  Loop(size_t size, int workers) {
+    if (!enabled()) {
+      return;
+    }
+    active = true;
+    this->size = size;
+    this->workers = workers;
+    stage = detail::stage;
+    label = detail::label;
+    start_us = detail::now_us();
+  }
+
+  Loop(const Loop &) = delete;
+  Loop &operator=(const Loop &) = delete;
+
+  Worker worker(int index, size_t items) {
+    return {active ? this : nullptr, index, items};
+  }
+
+  ~Loop() {
+    if (!active) {
+      return;
+    }
+    detail::record({Kind::Loop, "parallel_for", stage, label,
+                    detail::thread_id(), start_us,
+                    detail::now_us() - start_us, size, 0, workers,
+                    busy_us});
+  }
+};
+
+// Removes and returns the events recorded under `label`
+std::vector<Event> take_events(const std::string &label = "") {
+  auto &c = detail::collector();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  std::vector<Event> taken;
+  auto kept = std::stable_partition(
+      c.events.begin(), c.events.end(),
+      [&](const Event &event) { return event.label != label; });
+  std::move(kept, c.events.end(), std::back_inserter(taken));
+  c.events.erase(kept, c.events.end());
+  std::sort(taken.begin(), taken.end(), [](const Event &a, const Event &b) {
+    return a.start_us < b.start_us;
+  });
+  return taken;
+}
+
+std::string json_escape(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+// Chrome trace_event format, viewable in chrome://tracing or Perfetto
+void write_chrome_trace(std::ostream &out, const std::vector<Event> &events) {
+  const char *categories[] = {"stage", "loop", "worker", "counter"};
+  out << "{\"traceEvents\": [\n";
+  for (size_t i = 0; i < events.size(); i++) {
+    auto &e = events[i];
+    std::string args;
+    switch (e.kind) {
+    case Kind::Stage:
+      args = std::format("\"pixels\": {}, \"bytes\": {}", e.items, e.bytes);
+      break;
+    case Kind::Loop:
+      args = std::format(
+          "\"stage\": \"{}\", \"items\": {}, \"workers\": {}, "
+          "\"utilization\": {:.3f}",
+          e.parent ? e.parent : "", e.items, e.workers,
+          e.duration_us > 0
+              ? static_cast<double>(e.busy_us) / (e.duration_us * e.workers)
+              : 1.0);
+      break;
+    case Kind::Worker:
+      args = std::format("\"stage\": \"{}\", \"items\": {}, \"index\": {}",
+                         e.parent ? e.parent : "", e.items, e.workers);
+      break;
+    case Kind::Counter:
+      args = std::format("\"value\": {}", e.value);
+      break;
+    }
+    out << std::format(
+        "  {{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"{}\", "
+        "\"ts\": {}, {}\"pid\": 1, \"tid\": {}, \"args\": {{{}}}}}{}\n",
+        e.name, categories[static_cast<int>(e.kind)],
+        e.kind == Kind::Counter ? "C" : "X", e.start_us,
+        e.kind == Kind::Counter ? ""
+                                : std::format("\"dur\": {}, ", e.duration_us),
+        e.thread, args, i + 1 < events.size() ? "," : "");
+  }
+  out << std::format("], \"otherData\": {{\"label\": \"{}\"}}}}\n",
+                     json_escape(events.empty() ? "" : events[0].label));
+}
+
+// Per stage: calls, wall time, pixels, throughput, pooled allocations and
+// the utilization of its parallel loops; then busy time per worker index
+std::string summary(const std::vector<Event> &events) {
+  struct Row {
+    int calls = 0;
+    int64_t total_us = 0;
+    size_t items = 0;
+    size_t bytes = 0;
+    int64_t loop_us = 0;
+    int64_t capacity_us = 0;
+    int64_t busy_us = 0;
+  };
+  std::map<std::string, Row> stages;
+  std::map<int, std::pair<int, int64_t>> workers;
+  for (auto &e : events) {
+    switch (e.kind) {
+    case Kind::Stage: {
+      auto &row = stages[e.name];
+      row.calls++;
+      row.total_us += e.duration_us;
+      row.items += e.items;
+      row.bytes += e.bytes;
+      break;
+    }
+    case Kind::Loop: {
+      auto &row = stages[e.parent ? e.parent : "(outside stages)"];
+      row.loop_us += e.duration_us;
+      row.capacity_us += e.duration_us * e.workers;
+      row.busy_us += e.busy_us;
+      break;
+    }
+    case Kind::Worker:
+      workers[e.workers].first++;
+      workers[e.workers].second += e.duration_us;
+      break;
+    case Kind::Counter:
+      break;
+    }
+  }
+
+  std::string table = std::format("{:<28}{:>7}{:>11}{:>12}{:>10}{:>10}{:>8}\n",
+                                  "stage", "calls", "total ms", "pixels",
+                                  "Mpx/s", "alloc MB", "util");
+  for (auto &[name, row] : stages) {
+    double ms = row.total_us / 1000.0;
+    table += std::format(
+        "{:<28}{:>7}{:>11.2f}{:>12}{:>10.1f}{:>10.1f}{:>8}\n", name, row.calls,
+        ms, row.items, ms > 0 ? row.items / ms / 1000.0 : 0.0,
+        row.bytes / 1048576.0,
+        row.capacity_us > 0
+            ? std::format("{:.0f}%", 100.0 * row.busy_us / row.capacity_us)
+            : std::string("-"));
+  }
+  if (!workers.empty()) {
+    table += std::format("\n{:<10}{:>8}{:>11}\n", "worker", "chunks",
+                         "busy ms");
+    for (auto &[index, worker] : workers) {
+      table += std::format("{:<10}{:>8}{:>11.2f}\n", index, worker.first,
+                           worker.second / 1000.0);
+    }
+  }
+  return table;
+}
+
+} // namespace Trace
+
+#endif
@@ -1,21 +1,37 @@
 #include "lib/bmp_image.hxx"
+#include "lib/buffer_pool.hxx"
+#include "lib/cache.hxx"
 #include "lib/convolution.hxx"
+#include "lib/edge.hxx"
+#include "lib/equalization.hxx"
 #include "lib/frequency.hxx"
 #include "lib/hough.hxx"
+#include "lib/indexed_image.hxx"
+#include "lib/integral_image.hxx"
 #include "lib/linalg.hxx"
 #include "lib/linear_transform.hxx"
+#include "lib/morphology.hxx"
 #include "lib/numeric_array.hxx"
+#include "lib/pipeline.hxx"
 #include "lib/plot.hxx"
+#include "lib/pyramid.hxx"
 #include "lib/segmentation.hxx"
+#include "lib/trace.hxx"
 // #include "lib/terminal_print.hxx"
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <filesystem>
+#include <format>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <thread>
 #include <vector>
 
@@ -27,6 +43,28 @@
 #define BLUE "\033[34m"
 #define CYAN "\033[36m"
 
+// Directory the running job writes its results to. Each job sets its own, so
+// several jobs can run at once without sharing a staging directory.
+thread_local std::string output_dir = "output";
+
+std::string output_path(const std::string &name) {
+  return output_dir + "/" + name;
+}
+
+// An input decoded ahead of time by the batch runner for the running job
+thread_local std::optional<std::pair<std::string, BmpImage::BmpImage>>
+    prefetched_input;
+
+BmpImage::BmpImage load_input(const std::string &path) {
+  if (prefetched_input && prefetched_input->first == path) {
+    auto image = std::move(prefetched_input->second);
+    prefetched_input.reset();
+    return image;
+  }
+  std::ifstream in_file(path, std::ios::binary);
+  return BmpImage::read_bmp(in_file);
+}
+
 std::vector<BmpImage::BmpPixel> random_colors = std::vector<BmpImage::BmpPixel>{
     BmpImage::BmpPixel{255, 0, 0, 255},
     BmpImage::BmpPixel{0, 255, 0, 255},
@@ -55,8 +93,7 @@ std::vector<BmpImage::BmpPixel> random_colors = std::vector<BmpImage::BmpPixel>{
 };
 
 void task1(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
   // copy the img
   auto gray_img = raw_img;
   gray_img.image.data.foreach ([](BmpImage::BmpPixel &pixel) {
@@ -70,86 +107,76 @@ void task1(std::string path) {
   });
   gray_img.change_to_eight_bit();
 
-  std::ofstream gray_img_file("output/gray_img.bmp", std::ios::binary);
+  std::ofstream gray_img_file(output_path("gray_img.bmp"), std::ios::binary);
   BmpImage::write_bmp(gray_img_file, gray_img);
-  // invert the image
-  auto inverted_grey_img = gray_img;
-  inverted_grey_img.image.data.foreach ([](BmpImage::BmpPixel &pixel) {
-    pixel = BmpImage::BmpPixel{
-        .red = static_cast<uint8_t>(255 - pixel.red),
-        .green = static_cast<uint8_t>(255 - pixel.green),
-        .blue = static_cast<uint8_t>(255 - pixel.blue),
-        .alpha = pixel.alpha,
-    };
-  });
-  inverted_grey_img.change_to_eight_bit();
+  // invert the image in the palette domain
+  auto inverted_grey_img =
+      IndexedImage::invert(IndexedImage::to_indexed(gray_img));
 
-  std::ofstream inverted_img_file("output/inverted_img.bmp", std::ios::binary);
-  BmpImage::write_bmp(inverted_img_file, inverted_grey_img);
+  std::ofstream inverted_img_file(output_path("inverted_img.bmp"),
+                                  std::ios::binary);
+  IndexedImage::write_bmp(inverted_img_file, inverted_grey_img);
 
   // split the RGB channels
-  auto r_img = raw_img;
-  r_img.image.data.foreach ([](BmpImage::BmpPixel &pixel) {
-    pixel = BmpImage::BmpPixel{
-        .red = pixel.red,
-        .green = pixel.red,
-        .blue = pixel.red,
-        .alpha = pixel.alpha,
-    };
-  });
-  r_img.change_to_eight_bit();
-
-  std::ofstream r_img_file("output/r_img.bmp", std::ios::binary);
-  BmpImage::write_bmp(r_img_file, r_img);
-  auto g_img = raw_img;
-  g_img.image.data.foreach ([](BmpImage::BmpPixel &pixel) {
-    pixel = BmpImage::BmpPixel{
-        .red = pixel.green,
-        .green = pixel.green,
-        .blue = pixel.green,
-        .alpha = pixel.alpha,
-    };
-  });
-  g_img.change_to_eight_bit();
-
-  std::ofstream g_img_file("output/g_img.bmp", std::ios::binary);
-  BmpImage::write_bmp(g_img_file, g_img);
-  auto b_img = raw_img;
-  b_img.image.data.foreach ([](BmpImage::BmpPixel &pixel) {
-    pixel = BmpImage::BmpPixel{
-        .red = pixel.blue,
-        .green = pixel.blue,
-        .blue = pixel.blue,
-        .alpha = pixel.alpha,
-    };
-  });
-  b_img.change_to_eight_bit();
-
-  std::ofstream b_img_file("output/b_img.bmp", std::ios::binary);
-  BmpImage::write_bmp(b_img_file, b_img);
+  auto split_channel = [&](uint8_t BmpImage::BmpPixel::*channel,
+                           const std::string &file_name) {
+    std::ofstream channel_file(file_name, std::ios::binary);
+    if (BmpImage::has_palette(raw_img.header.infoHeader.bitsPerPixel)) {
+      auto channel_img = IndexedImage::select_channel(
+          IndexedImage::to_indexed(raw_img), channel);
+      IndexedImage::write_bmp(channel_file, channel_img);
+      return;
+    }
+    auto channel_img = raw_img;
+    channel_img.image.data.foreach ([&](BmpImage::BmpPixel &pixel) {
+      pixel = BmpImage::BmpPixel{
+          .red = pixel.*channel,
+          .green = pixel.*channel,
+          .blue = pixel.*channel,
+          .alpha = pixel.alpha,
+      };
+    });
+    channel_img.change_to_eight_bit();
+    BmpImage::write_bmp(channel_file, channel_img);
+  };
+  split_channel(&BmpImage::BmpPixel::red, output_path("r_img.bmp"));
+  split_channel(&BmpImage::BmpPixel::green, output_path("g_img.bmp"));
+  split_channel(&BmpImage::BmpPixel::blue, output_path("b_img.bmp"));
 }
 
 void task2(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto hist = Plot::generate_gray_scale_histogram(raw_img);
 
-  std::ofstream hist_file("output/hist_before.bmp", std::ios::binary);
+  std::ofstream hist_file(output_path("hist_before.bmp"), std::ios::binary);
   BmpImage::write_bmp(hist_file, hist);
-  auto balanced_img = BmpImage::gray_balanced_image(raw_img);
+  auto balanced_img =
+      IndexedImage::gray_balanced_image(IndexedImage::to_indexed(raw_img));
 
-  std::ofstream balanced_img_file("output/balanced_img.bmp", std::ios::binary);
-  BmpImage::write_bmp(balanced_img_file, balanced_img);
-  auto balanced_hist = Plot::generate_gray_scale_histogram(balanced_img);
+  std::ofstream balanced_img_file(output_path("balanced_img.bmp"),
+                                  std::ios::binary);
+  IndexedImage::write_bmp(balanced_img_file, balanced_img);
+  auto balanced_expanded = balanced_img.expand();
+  auto balanced_hist = Plot::generate_gray_scale_histogram(balanced_expanded);
 
-  std::ofstream balanced_hist_file("output/hist_after.bmp", std::ios::binary);
+  std::ofstream balanced_hist_file(output_path("hist_after.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(balanced_hist_file, balanced_hist);
+
+  auto gray_img = BmpImage::to_gray(raw_img);
+  auto clahe_img = BmpImage::to_bmp(Equalization::clahe(gray_img.view()));
+  std::ofstream clahe_file(output_path("clahe.bmp"), std::ios::binary);
+  BmpImage::write_bmp(clahe_file, clahe_img);
+  auto clahe_sliding_img =
+      BmpImage::to_bmp(Equalization::clahe_sliding(gray_img.view()));
+  std::ofstream clahe_sliding_file(output_path("clahe_sliding.bmp"),
+                                   std::ios::binary);
+  BmpImage::write_bmp(clahe_sliding_file, clahe_sliding_img);
 }
 
 void task3(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto value = 1.0 / 25;
   auto avg_filtered_image = Convolution::apply_kernel(
@@ -161,18 +188,19 @@ void task3(std::string path) {
                    {value, value, value, value, value},
                });
 
-  std::ofstream avg_filtered_file("output/avg_filtered.bmp", std::ios::binary);
+  std::ofstream avg_filtered_file(output_path("avg_filtered.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(avg_filtered_file, avg_filtered_image);
   auto mid_filtered_image =
       Convolution::apply_mid_value_kernel(raw_img, 5, (5 * 5) / 2);
 
-  std::ofstream mid_filtered_file("output/mid_filtered.bmp", std::ios::binary);
+  std::ofstream mid_filtered_file(output_path("mid_filtered.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(mid_filtered_file, mid_filtered_image);
 }
 
 void task3_with_parameters(std::string path, int kernel_size) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto value = 1.0 / kernel_size;
   std::vector<std::vector<double>> kernel(
@@ -180,33 +208,36 @@ void task3_with_parameters(std::string path, int kernel_size) {
 
   auto avg_filtered_image = Convolution::apply_kernel(raw_img, kernel);
 
-  std::ofstream avg_filtered_file("output/avg_filtered.bmp", std::ios::binary);
+  std::ofstream avg_filtered_file(output_path("avg_filtered.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(avg_filtered_file, avg_filtered_image);
   auto mid_filtered_image = Convolution::apply_mid_value_kernel(
       raw_img, kernel_size, (kernel_size * kernel_size) / 2);
 
-  std::ofstream mid_filtered_file("output/mid_filtered.bmp", std::ios::binary);
+  std::ofstream mid_filtered_file(output_path("mid_filtered.bmp"),
+                                  std::ios::binary);
 }
 
 void task4(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   raw_img.change_to_twenty_four_bit();
   auto scaled_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix().scale(0.5, 0.5).take());
 
-  std::ofstream scaled_img_file("output/scaled_img.bmp", std::ios::binary);
+  std::ofstream scaled_img_file(output_path("scaled_img.bmp"),
+                                std::ios::binary);
   BmpImage::write_bmp(scaled_img_file, scaled_img);
 
   auto rotated_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix().rotate(3.14 / 4).take());
-  std::ofstream rotated_img_file("output/rotated_img.bmp", std::ios::binary);
+  std::ofstream rotated_img_file(output_path("rotated_img.bmp"),
+                                 std::ios::binary);
   BmpImage::write_bmp(rotated_img_file, rotated_img);
 
   auto translated_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix().translate(100, 100).take());
-  std::ofstream translated_img_file("output/translated_img.bmp",
+  std::ofstream translated_img_file(output_path("translated_img.bmp"),
                                     std::ios::binary);
   BmpImage::write_bmp(translated_img_file, translated_img);
 
@@ -215,7 +246,8 @@ void task4(std::string path) {
                    .translate(-raw_img.header.infoHeader.width, 0)
                    .scale(-1, 1)
                    .take());
-  std::ofstream flipped_img_file("output/flipped_img.bmp", std::ios::binary);
+  std::ofstream flipped_img_file(output_path("flipped_img.bmp"),
+                                 std::ios::binary);
   BmpImage::write_bmp(flipped_img_file, flipped_image);
 
   auto half_height = static_cast<double>(raw_img.header.infoHeader.height) / 2;
@@ -233,7 +265,7 @@ void task4(std::string path) {
                                raw_img.header.infoHeader.height),
                std::make_tuple(raw_img.header.infoHeader.width, 0.)})
           .take());
-  std::ofstream perspective_img_file("output/perspective_img.bmp",
+  std::ofstream perspective_img_file(output_path("perspective_img.bmp"),
                                      std::ios::binary);
   BmpImage::write_bmp(perspective_img_file, perspective_img);
 
@@ -243,30 +275,32 @@ void task4(std::string path) {
                                                      .translate(10, -10)
                                                      .rotate(3.14 / 4)
                                                      .take());
-  std::ofstream combined_img_file("output/combined_img.bmp", std::ios::binary);
+  std::ofstream combined_img_file(output_path("combined_img.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(combined_img_file, combined);
 }
 
 void task4_with_parameters(std::string path, double scale, double translate_x,
                            double translate_y, double rotate) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   raw_img.change_to_twenty_four_bit();
   auto scaled_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix().scale(scale, scale).take());
-  std::ofstream scaled_img_file("output/scaled_img.bmp", std::ios::binary);
+  std::ofstream scaled_img_file(output_path("scaled_img.bmp"),
+                                std::ios::binary);
   BmpImage::write_bmp(scaled_img_file, scaled_img);
 
   auto rotated_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix().rotate(rotate).take());
-  std::ofstream rotated_img_file("output/rotated_img.bmp", std::ios::binary);
+  std::ofstream rotated_img_file(output_path("rotated_img.bmp"),
+                                 std::ios::binary);
 
   auto translated_img = LinearTransform::linear_transform(
       raw_img, Linalg::LinearTransformMatrix()
                    .translate(translate_x, translate_y)
                    .take());
-  std::ofstream translated_img_file("output/translated_img.bmp",
+  std::ofstream translated_img_file(output_path("translated_img.bmp"),
                                     std::ios::binary);
   BmpImage::write_bmp(translated_img_file, translated_img);
 
@@ -275,24 +309,25 @@ void task4_with_parameters(std::string path, double scale, double translate_x,
                    .translate(-raw_img.header.infoHeader.width, 0)
                    .scale(-1, 1)
                    .take());
-  std::ofstream flipped_img_file("output/flipped_img.bmp", std::ios::binary);
+  std::ofstream flipped_img_file(output_path("flipped_img.bmp"),
+                                 std::ios::binary);
   BmpImage::write_bmp(flipped_img_file, flipped_image);
 }
 
 void task5(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto segmented_img =
       Segmentation::SegmentationByThreshold::segment_by_threshold(raw_img, 128);
 
-  std::ofstream segmented_img_file("output/segmented.bmp", std::ios::binary);
+  std::ofstream segmented_img_file(output_path("segmented.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(segmented_img_file, segmented_img);
   BmpImage::BmpImage segmented_img_histogram =
       Plot::generate_gray_scale_histogram(raw_img);
   Plot::draw_line(segmented_img_histogram, 128, 256, 128, 0);
-  std::ofstream segmented_img_histogram_file("output/segmented_histogram.bmp",
-                                             std::ios::binary);
+  std::ofstream segmented_img_histogram_file(
+      output_path("segmented_histogram.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_img_histogram_file, segmented_img_histogram);
   auto th_by_iteration =
       Segmentation::SegmentationByThreshold::auto_find_threshold_by_iteration(
@@ -302,7 +337,7 @@ void task5(std::string path) {
           raw_img, th_by_iteration);
 
   std::ofstream segmented_img_by_iteration_file(
-      "output/segmented_img_by_iteration.bmp", std::ios::binary);
+      output_path("segmented_img_by_iteration.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_img_by_iteration_file,
                       segmented_img_by_iteration);
   auto segmented_by_iteration_histogram =
@@ -310,7 +345,7 @@ void task5(std::string path) {
   Plot::draw_line(segmented_by_iteration_histogram, th_by_iteration, 256,
                   th_by_iteration, 0);
   std::ofstream segmented_by_iteration_histogram_file(
-      "output/segmented_by_iteration_histogram.bmp", std::ios::binary);
+      output_path("segmented_by_iteration_histogram.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_iteration_histogram_file,
                       segmented_by_iteration_histogram);
   auto th_by_otsu =
@@ -320,34 +355,58 @@ void task5(std::string path) {
       Segmentation::SegmentationByThreshold::segment_by_threshold(raw_img,
                                                                   th_by_otsu);
 
-  std::ofstream segmented_img_by_otsu_file("output/segmented_img_by_otsu.bmp",
-                                           std::ios::binary);
+  std::ofstream segmented_img_by_otsu_file(
+      output_path("segmented_img_by_otsu.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_img_by_otsu_file, segmented_img_by_otsu);
   auto segmented_by_otsu_histogram =
       Plot::generate_gray_scale_histogram(raw_img);
   Plot::draw_line(segmented_by_otsu_histogram, th_by_otsu, 256, th_by_otsu, 0);
   std::ofstream segmented_by_otsu_histogram_file(
-      "output/segmented_by_otsu_histogram.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_histogram.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_histogram_file,
                       segmented_by_otsu_histogram);
+
+  // Local thresholds follow uneven lighting that a global one cannot. The
+  // Sauvola and Bradley defaults suit documents; low-contrast inputs such as
+  // dim.bmp need gentler ones.
+  auto gray_img = BmpImage::to_gray(raw_img);
+  int window =
+      std::max(15, std::min(gray_img.size.width, gray_img.size.height) / 4) |
+      1;
+  auto write_segmented = [](const char *name,
+                            const BmpImage::GrayImage &segmented) {
+    auto segmented_image = BmpImage::to_bmp(segmented);
+    std::ofstream segmented_file(
+        output_path(std::format("segmented_img_by_{}.bmp", name)),
+        std::ios::binary);
+    BmpImage::write_bmp(segmented_file, segmented_image);
+  };
+  write_segmented("niblack",
+                  Segmentation::SegmentationByThreshold::segment_by_niblack(
+                      gray_img.view(), window));
+  write_segmented("sauvola",
+                  Segmentation::SegmentationByThreshold::segment_by_sauvola(
+                      gray_img.view(), window, 0.1));
+  write_segmented("bradley",
+                  Segmentation::SegmentationByThreshold::segment_by_bradley(
+                      gray_img.view(), window, 0.05));
 }
 
 void task5_with_parameters(std::string path, int threshold) {
   task5(path);
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto segmented_img =
       Segmentation::SegmentationByThreshold::segment_by_threshold(raw_img,
                                                                   threshold);
 
-  std::ofstream segmented_img_file("output/segmented.bmp", std::ios::binary);
+  std::ofstream segmented_img_file(output_path("segmented.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(segmented_img_file, segmented_img);
 }
 
 void task6(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
   raw_img.change_to_twenty_four_bit();
 
   auto seed_segmented_img = raw_img;
@@ -410,49 +469,27 @@ void task6(std::string path) {
   Plot::draw_points(seed_segmented_img, res2, {0, 128, 0, 255});
   Plot::draw_points(seed_segmented_img, seed2, {128, 255, 128, 255});
 
-  std::ofstream seed_segmented_img_file("output/seed_segmented_img.bmp",
+  std::ofstream seed_segmented_img_file(output_path("seed_segmented_img.bmp"),
                                         std::ios::binary);
   BmpImage::write_bmp(seed_segmented_img_file, seed_segmented_img);
 
+  // Box variances come from the integral image in O(1)
+  auto integral =
+      IntegralImage::integral_image(BmpImage::to_gray(raw_img).view());
   Segmentation::SegmentationByQuadTree::HomogeneousFunction func =
-      [](const BmpImage::BmpImage &img,
-         std::vector<Segmentation::SegmentationByQuadTree::Box> boxes) {
-        auto is_homogeneous = true;
-
+      [&integral](
+          const BmpImage::BmpImage &img,
+          std::vector<Segmentation::SegmentationByQuadTree::Box> boxes) {
         for (auto box : boxes) {
           auto [l, r, t, b] = box;
-          auto width = r - l;
-          auto height = b - t;
-          if (width <= 8 || height <= 8) {
+          if (r - l <= 8 || b - t <= 8) {
             continue;
           }
-
-          double sum = 0.0;
-          double sum_squared = 0.0;
-          int count = 0;
-
-          for (int y = t; y < b; ++y) {
-            for (int x = l; x < r; ++x) {
-              auto gray =
-                  img.image.data.data[y * img.image.size.width + x].gray();
-              sum += gray;
-              sum_squared += gray * gray;
-              ++count;
-            }
-          }
-
-          if (count > 0) {
-            double mean = sum / count;
-            double variance = (sum_squared / count) - (mean * mean);
-
-            if (variance > 64.0) {
-              is_homogeneous = false;
-              break;
-            }
+          if (integral.box_variance(l, t, r, b) > 64.0) {
+            return false;
           }
         }
-
-        return is_homogeneous;
+        return true;
       };
 
   auto quad_tree_segmented_img = raw_img;
@@ -467,34 +504,32 @@ void task6(std::string path) {
   }
 
   std::ofstream quad_tree_segmented_img_before_merge_file(
-      "output/quad_tree_segmented_img.bmp", std::ios::binary);
+      output_path("quad_tree_segmented_img.bmp"), std::ios::binary);
   BmpImage::write_bmp(quad_tree_segmented_img_before_merge_file,
                       quad_tree_segmented_img);
 }
 
 void task7(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto sobel_filtered_image =
       Convolution::apply_kernel(raw_img, {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}});
 
-  std::ofstream sobel_filtered_file("output/sobel_filtered.bmp",
+  std::ofstream sobel_filtered_file(output_path("sobel_filtered.bmp"),
                                     std::ios::binary);
   BmpImage::write_bmp(sobel_filtered_file, sobel_filtered_image);
 
-  auto otsu_sobel_filtered_image = sobel_filtered_image;
-
   auto th_by_otsu_sobel_filtered_image =
       Segmentation::SegmentationByThreshold::auto_find_threshold_by_otsu(
-          otsu_sobel_filtered_image);
+          sobel_filtered_image);
 
+  // The filtered images are already written, so threshold them in place
   auto segmented_by_otsu_sobel_filtered_image =
       Segmentation::SegmentationByThreshold::segment_by_threshold(
-          otsu_sobel_filtered_image, th_by_otsu_sobel_filtered_image);
+          std::move(sobel_filtered_image), th_by_otsu_sobel_filtered_image);
 
   std::ofstream segmented_by_otsu_sobel_filtered_file(
-      "output/segmented_by_otsu_sobel_filtered.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_sobel_filtered.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_sobel_filtered_file,
                       segmented_by_otsu_sobel_filtered_image);
 
@@ -503,7 +538,7 @@ void task7(std::string path) {
   auto prewitt_filtered_image =
       Convolution::apply_kernel(raw_img, {{1, 1, 1}, {0, 0, 0}, {-1, -1, -1}});
 
-  std::ofstream prewitt_filtered_file("output/prewitt_filtered.bmp",
+  std::ofstream prewitt_filtered_file(output_path("prewitt_filtered.bmp"),
                                       std::ios::binary);
   BmpImage::write_bmp(prewitt_filtered_file, prewitt_filtered_image);
 
@@ -513,10 +548,10 @@ void task7(std::string path) {
 
   auto segmented_by_otsu_prewitt_filtered_image =
       Segmentation::SegmentationByThreshold::segment_by_threshold(
-          prewitt_filtered_image, th_by_otsu_prewitt_filtered_image);
+          std::move(prewitt_filtered_image), th_by_otsu_prewitt_filtered_image);
 
   std::ofstream segmented_by_otsu_prewitt_filtered_file(
-      "output/segmented_by_otsu_prewitt_filtered.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_prewitt_filtered.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_prewitt_filtered_file,
                       segmented_by_otsu_prewitt_filtered_image);
 
@@ -528,7 +563,8 @@ void task7(std::string path) {
                                           {0, -1, -2, -1, 0},
                                           {0, 0, -1, 0, 0}});
 
-  std::ofstream log_filtered_file("output/log_filtered.bmp", std::ios::binary);
+  std::ofstream log_filtered_file(output_path("log_filtered.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(log_filtered_file, log_filtered_image);
 
   auto th_by_otsu_log_filtered_image =
@@ -537,17 +573,43 @@ void task7(std::string path) {
 
   auto segmented_by_otsu_log_filtered_image =
       Segmentation::SegmentationByThreshold::segment_by_threshold(
-          log_filtered_image, th_by_otsu_log_filtered_image);
+          std::move(log_filtered_image), th_by_otsu_log_filtered_image);
 
   std::ofstream segmented_by_otsu_log_filtered_file(
-      "output/segmented_by_otsu_log_filtered.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_log_filtered.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_log_filtered_file,
                       segmented_by_otsu_log_filtered_image);
+
+  // |Gx| + |Gy| on the gray image, keeping both signs of both derivatives
+  auto gray_img = BmpImage::to_gray(raw_img);
+  for (auto [name, kernel] : {std::pair{"sobel", Edge::sobel},
+                              std::pair{"prewitt", Edge::prewitt}}) {
+    auto magnitude =
+        Edge::saturate(Edge::edge_map(gray_img.view(), kernel).magnitude);
+    auto magnitude_image = BmpImage::to_bmp(magnitude);
+    std::ofstream magnitude_file(
+        output_path(std::format("{}_magnitude.bmp", name)), std::ios::binary);
+    BmpImage::write_bmp(magnitude_file, magnitude_image);
+
+    int threshold =
+        Segmentation::SegmentationByThreshold::auto_find_threshold_by_otsu(
+            magnitude.view());
+    auto segmented_magnitude_image = BmpImage::to_bmp(
+        Segmentation::SegmentationByThreshold::segment_by_threshold(
+            magnitude.view(), threshold));
+    std::ofstream segmented_magnitude_file(
+        output_path(std::format("segmented_by_otsu_{}_magnitude.bmp", name)),
+        std::ios::binary);
+    BmpImage::write_bmp(segmented_magnitude_file, segmented_magnitude_image);
+  }
+
+  auto canny_image = BmpImage::to_bmp(Edge::canny(gray_img.view()));
+  std::ofstream canny_file(output_path("canny.bmp"), std::ios::binary);
+  BmpImage::write_bmp(canny_file, canny_image);
 }
 
 void task8(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto hough_data = raw_img.get_channel([&](BmpImage::BmpPixel pixel) {
     return static_cast<double>(pixel.gray()) / 256;
@@ -555,32 +617,33 @@ void task8(std::string path) {
 
   auto hough_param = Hough::HoughLineParam{};
   auto hough_transformed = Hough::hough_linear_transform(
-      hough_data.interpret(raw_img.header.infoHeader.height,
-                           raw_img.header.infoHeader.width),
+      hough_data.view(raw_img.header.infoHeader.height,
+                      raw_img.header.infoHeader.width),
       hough_param);
   auto img = Hough::plot(hough_transformed);
   img.regenerate_header();
 
-  std::ofstream hough_file("output/hough.bmp", std::ios::binary);
+  std::ofstream hough_file(output_path("hough.bmp"), std::ios::binary);
   BmpImage::write_bmp(hough_file, img);
 
   auto lines = Hough::get_lines(hough_transformed, hough_param);
 
   Hough::draw_lines(lines, raw_img);
 
-  std::ofstream lines_file("output/lines.bmp", std::ios::binary);
+  std::ofstream lines_file(output_path("lines.bmp"), std::ios::binary);
   BmpImage::write_bmp(lines_file, raw_img);
 }
 
 void task9(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   raw_img =
       Segmentation::SegmentationByThreshold::segment_by_threshold(raw_img, 64);
 
-  std::ofstream segmented_img_file("output/segmented.bmp", std::ios::binary);
+  std::ofstream segmented_img_file(output_path("segmented.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(segmented_img_file, raw_img);
+  auto segmented_img = raw_img;
 
   auto split = Segmentation::SegmentationByGrowth::split_region(raw_img);
   int c = 0;
@@ -589,18 +652,52 @@ void task9(std::string path) {
     Plot::draw_points(raw_img, group, random_colors[c]);
   }
 
-  std::ofstream split_file("output/split.bmp", std::ios::binary);
+  std::ofstream split_file(output_path("split.bmp"), std::ios::binary);
   BmpImage::write_bmp(split_file, raw_img);
+
+  // Touching regions split at the necks of their distance transform
+  auto regions = Segmentation::SegmentationByGrowth::label_regions(
+      segmented_img.image.view());
+  auto distance =
+      Segmentation::SegmentationByWatershed::distance_transform(regions.view());
+  float max_distance = 0;
+  for (float d : distance.data.data) {
+    max_distance = std::isinf(d) ? max_distance : std::max(max_distance, d);
+  }
+  BmpImage::GrayImage distance_img{
+      distance.size,
+      NumericArray::NumericArray<uint8_t>(distance.data.data.size(), 0)};
+  for (size_t i = 0; i < distance.data.data.size(); i++) {
+    distance_img.data.data[i] = static_cast<uint8_t>(
+        std::min(distance.data.data[i] * 255 / std::max(max_distance, 1.0f),
+                 255.0f));
+  }
+  auto distance_image = BmpImage::to_bmp(distance_img);
+  std::ofstream distance_file(output_path("distance.bmp"), std::ios::binary);
+  BmpImage::write_bmp(distance_file, distance_image);
+
+  auto separated =
+      Segmentation::SegmentationByWatershed::separate_regions(regions.view());
+  auto separated_img = segmented_img;
+  for (size_t i = 0; i < separated.data.data.size(); i++) {
+    if (separated.data.data[i] != 0) {
+      separated_img.image.data.data[i] =
+          random_colors[separated.data.data[i] % random_colors.size()];
+    }
+  }
+  std::ofstream separated_file(output_path("separated.bmp"),
+                               std::ios::binary);
+  BmpImage::write_bmp(separated_file, separated_img);
 }
 
 void task10(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   raw_img =
       Segmentation::SegmentationByThreshold::segment_by_threshold(raw_img, 64);
 
-  std::ofstream segmented_img_file("output/segmented.bmp", std::ios::binary);
+  std::ofstream segmented_img_file(output_path("segmented.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(segmented_img_file, raw_img);
 
   auto split = Segmentation::SegmentationByGrowth::get_borders(
@@ -612,80 +709,107 @@ void task10(std::string path) {
   }
 
   canvas.regenerate_header();
-  std::ofstream split_file("output/split.bmp", std::ios::binary);
+  std::ofstream split_file(output_path("split.bmp"), std::ios::binary);
   BmpImage::write_bmp(split_file, canvas);
 }
 
 void task12(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
-
-  auto scale_channel = raw_img.get_channel([&](BmpImage::BmpPixel pixel) {
-    return std::clamp<double>(
-        static_cast<double>(pixel.blue - (pixel.red + pixel.green) / 2), 0,
-        256);
-  });
-  auto scaled_img = raw_img;
-  scaled_img.image.data.foreach ([&](BmpImage::BmpPixel &pixel, size_t idx) {
-    pixel = BmpImage::BmpPixel(pixel.red * scale_channel.data[idx] / 256,
-                               pixel.green * scale_channel.data[idx] / 256,
-                               pixel.blue * scale_channel.data[idx] / 256,
-                               pixel.alpha);
-    pixel = BmpImage::BmpPixel(pixel.gray(), pixel.gray(), pixel.gray(),
-                               pixel.alpha);
-  });
-
-  std::ofstream scale_channel_file("output/scaled_img.bmp", std::ios::binary);
+  auto raw_img = load_input(path);
+
+  // Scale, median, LoG and Otsu run as one fused, tiled pipeline; only the
+  // images written below are materialized
+  auto outputs =
+      Pipeline::Pipeline()
+          .map([](BmpImage::BmpPixel pixel) {
+            double scale = std::clamp<double>(
+                static_cast<double>(pixel.blue -
+                                    (pixel.red + pixel.green) / 2),
+                0, 256);
+            pixel = BmpImage::BmpPixel(pixel.red * scale / 256,
+                                       pixel.green * scale / 256,
+                                       pixel.blue * scale / 256, pixel.alpha);
+            return BmpImage::BmpPixel(pixel.gray(), pixel.gray(),
+                                      pixel.gray(), pixel.alpha);
+          })
+          .output("scaled")
+          .median(5, 1)
+          .convolve({{0, 0, -1, 0, 0},
+                     {0, -1, -2, -1, 0},
+                     {-1, -2, 16, -2, -1},
+                     {0, -1, -2, -1, 0},
+                     {0, 0, -1, 0, 0}})
+          .output("log")
+          .threshold_by_otsu()
+          .output("segmented")
+          .run(raw_img.image);
+  BmpImage::BmpImage scaled_img{raw_img.header, outputs.at("scaled"),
+                                raw_img.palette};
+  BmpImage::BmpImage log_filtered_image{raw_img.header, outputs.at("log"),
+                                        raw_img.palette};
+  BmpImage::BmpImage segmented_by_otsu_log_filtered_image{
+      raw_img.header, outputs.at("segmented"), raw_img.palette};
+
+  std::ofstream scale_channel_file(output_path("scaled_img.bmp"),
+                                   std::ios::binary);
   BmpImage::write_bmp(scale_channel_file, scaled_img);
 
-  // LOG
-  auto mid_filtered_image =
-      Convolution::apply_mid_value_kernel(scaled_img, 5, 1);
-  auto log_filtered_image =
-      Convolution::apply_kernel(mid_filtered_image, {{0, 0, -1, 0, 0},
-                                                     {0, -1, -2, -1, 0},
-                                                     {-1, -2, 16, -2, -1},
-                                                     {0, -1, -2, -1, 0},
-                                                     {0, 0, -1, 0, 0}});
-
-  std::ofstream log_filtered_file("output/log_filtered.bmp", std::ios::binary);
+  std::ofstream log_filtered_file(output_path("log_filtered.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(log_filtered_file, log_filtered_image);
-  auto th_by_otsu_log_filtered_image =
-      Segmentation::SegmentationByThreshold::auto_find_threshold_by_otsu(
-          log_filtered_image);
-
-  auto segmented_by_otsu_log_filtered_image =
-      Segmentation::SegmentationByThreshold::segment_by_threshold(
-          log_filtered_image, th_by_otsu_log_filtered_image);
 
   std::ofstream segmented_by_otsu_log_filtered_image_file(
-      "output/segmented_by_otsu_log_filtered_image.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_log_filtered_image.bmp"),
+      std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_log_filtered_image_file,
                       segmented_by_otsu_log_filtered_image);
 
-  // Hough
-
-  auto hough_data = segmented_by_otsu_log_filtered_image.get_channel(
-      [](BmpImage::BmpPixel pixel) { return pixel.gray(); });
-
+  // Blue areas found at 1/8 scale; Otsu then runs at full resolution only
+  // inside them
+  Pyramid::Pyramid scaled_pyramid(BmpImage::to_gray(scaled_img.image));
+  int candidate_level = std::min(3, scaled_pyramid.levels - 1);
+  auto candidates = Segmentation::SegmentationByPyramid::candidate_regions(
+      scaled_pyramid, candidate_level,
+      Segmentation::SegmentationByThreshold::auto_find_threshold_by_otsu(
+          scaled_pyramid.view(candidate_level)));
+  auto candidates_image =
+      BmpImage::to_bmp(Segmentation::SegmentationByPyramid::segment_by_otsu(
+          scaled_pyramid.view(0), candidates));
+  std::ofstream candidates_file(output_path("plate_candidates.bmp"),
+                                std::ios::binary);
+  BmpImage::write_bmp(candidates_file, candidates_image);
+
+  // Closing bridges small gaps in the thresholded strokes, opening then drops
+  // isolated specks
+  auto mask = Morphology::pack(
+      BmpImage::to_gray(segmented_by_otsu_log_filtered_image).view());
+  auto cleaned_mask_image = BmpImage::to_bmp(Morphology::unpack(
+      Morphology::open(Morphology::close(mask, {5, 5}), {3, 3})));
+  std::ofstream cleaned_mask_file(output_path("cleaned_mask.bmp"),
+                                  std::ios::binary);
+  BmpImage::write_bmp(cleaned_mask_file, cleaned_mask_image);
+
+  // Hough: votes on a quarter-scale copy first, then at full resolution only
+  // near the coarse peaks
+  Pyramid::Pyramid edge_pyramid(
+      BmpImage::to_gray(segmented_by_otsu_log_filtered_image.image),
+      Pyramid::Reduce::Area);
   auto hough_param = Hough::HoughLineParam{
       .theta_steps = 360,
   };
-  auto hough_transformed = Hough::hough_linear_transform(
-      hough_data.interpret(scaled_img.header.infoHeader.height,
-                           scaled_img.header.infoHeader.width),
-      hough_param, true);
+  auto hough_transformed =
+      Hough::hough_linear_transform(edge_pyramid, hough_param, {}, true);
   auto img = Hough::plot(hough_transformed);
   img.regenerate_header();
 
-  std::ofstream hough_file("output/hough.bmp", std::ios::binary);
+  std::ofstream hough_file(output_path("hough.bmp"), std::ios::binary);
   BmpImage::write_bmp(hough_file, img);
 
   auto raw_lines =
       Hough::get_lines_bfs(hough_transformed, hough_param, 1, -1, 0.2, true);
   Hough::draw_lines(raw_lines, segmented_by_otsu_log_filtered_image);
 
-  std::ofstream hough_lines_file("output/hough_lines.bmp", std::ios::binary);
+  std::ofstream hough_lines_file(output_path("hough_lines.bmp"),
+                                 std::ios::binary);
   BmpImage::write_bmp(hough_lines_file, segmented_by_otsu_log_filtered_image);
 
   auto intersects = Hough::all_intersects(raw_lines);
@@ -698,7 +822,8 @@ void task12(std::string path) {
     Plot::draw_line(hull_image, y, x, y2, x2);
   }
 
-  std::ofstream closing_hull_file("output/closing_hull.bmp", std::ios::binary);
+  std::ofstream closing_hull_file(output_path("closing_hull.bmp"),
+                                  std::ios::binary);
   BmpImage::write_bmp(closing_hull_file, hull_image);
 
   auto boxed_area_r = -hull_image.header.infoHeader.width;
@@ -712,19 +837,20 @@ void task12(std::string path) {
     boxed_area_b = std::min(boxed_area_b, y);
   }
 
-  auto boxed_area_only = Plot::generate_blank_canvas(
-      boxed_area_r - boxed_area_l, boxed_area_t - boxed_area_b);
-  for (int i = boxed_area_l; i < boxed_area_r; i++) {
-    for (int j = boxed_area_b; j < boxed_area_t; j++) {
-      boxed_area_only.image.data
-          .data[(j - boxed_area_b) * (boxed_area_r - boxed_area_l) +
-                (i - boxed_area_l)] =
-          raw_img.image.data.data[j * raw_img.header.infoHeader.width + i];
-    }
-  }
-
+  boxed_area_l = std::max(boxed_area_l, 0);
+  boxed_area_b = std::max(boxed_area_b, 0);
+  boxed_area_r = std::min(boxed_area_r, raw_img.image.size.width);
+  boxed_area_t = std::min(boxed_area_t, raw_img.image.size.height);
+  auto boxed_area = raw_img.image.view().sub_view(
+      boxed_area_l, boxed_area_b, boxed_area_r - boxed_area_l,
+      boxed_area_t - boxed_area_b);
+
+  // Crop and convert in one pass over the plate rows
+  auto boxed_area_only =
+      Plot::generate_blank_canvas(boxed_area.width, boxed_area.height);
   boxed_area_only.image.data.foreach ([&](BmpImage::BmpPixel &pxl, size_t idx) {
-    auto v = (pxl.red + pxl.green) / 2;
+    auto &src = boxed_area(idx % boxed_area.width, idx / boxed_area.width);
+    auto v = (src.red + src.green) / 2;
     pxl = BmpImage::BmpPixel(v, v, v, 255);
   });
 
@@ -734,7 +860,7 @@ void task12(std::string path) {
         max_val = std::max(max_val, static_cast<int>(pxl.gray()));
       });
 
-  std::ofstream boxed_area_only_file("output/boxed_area_only.bmp",
+  std::ofstream boxed_area_only_file(output_path("boxed_area_only.bmp"),
                                      std::ios::binary);
   BmpImage::write_bmp(boxed_area_only_file, boxed_area_only);
 
@@ -747,7 +873,7 @@ void task12(std::string path) {
           boxed_area_only, (max_val + 2 * th_by_otsu_boxed) / 3);
 
   std::ofstream segmented_by_otsu_boxed_file(
-      "output/segmented_by_otsu_boxed.bmp", std::ios::binary);
+      output_path("segmented_by_otsu_boxed.bmp"), std::ios::binary);
   BmpImage::write_bmp(segmented_by_otsu_boxed_file, segmented_by_otsu_boxed);
 
   int tolerance = segmented_by_otsu_boxed.header.infoHeader.height / 32;
@@ -787,7 +913,7 @@ void task12(std::string path) {
   int j = 0;
   bool drawing_flag = true;
   for (int i = 0; i < segmented_by_otsu_boxed.header.infoHeader.width; i++) {
-    if (i == split_at[j]) {
+    if (j < split_at.size() && i == split_at[j]) {
       drawing_flag = !drawing_flag;
       ++j;
     }
@@ -797,23 +923,20 @@ void task12(std::string path) {
     }
   }
 
-  std::ofstream split_at_file("output/split_at.bmp", std::ios::binary);
+  std::ofstream split_at_file(output_path("split_at.bmp"), std::ios::binary);
   BmpImage::write_bmp(split_at_file, segmented_by_otsu_boxed);
 }
 
 void task13(std::string path) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
+  auto raw_img = load_input(path);
 
   auto fft_img = raw_img;
-  auto gray = fft_img
-                  .get_channel([&](BmpImage::BmpPixel pixel) {
-                    return (pixel.red + pixel.green) / 2;
-                  })
-                  .interpret(fft_img.header.infoHeader.height,
-                             fft_img.header.infoHeader.width);
-  Frequency::pad(gray);
-  std::ofstream fft_img_gray("output/fft_img_gray.bmp", std::ios::binary);
+  auto gray_channel = fft_img.get_channel([&](BmpImage::BmpPixel pixel) {
+    return (pixel.red + pixel.green) / 2;
+  });
+  auto gray = Frequency::pad(gray_channel.view(
+      fft_img.header.infoHeader.height, fft_img.header.infoHeader.width));
+  std::ofstream fft_img_gray(output_path("fft_img_gray.bmp"), std::ios::binary);
   auto gray_img = Frequency::plot(gray);
   gray_img.regenerate_header();
   BmpImage::write_bmp(fft_img_gray, gray_img);
@@ -822,19 +945,19 @@ void task13(std::string path) {
 
   Frequency::cutoff_freq(fft_transformed, 100);
   auto [mag, phase] = Frequency::polar_transform(fft_transformed);
-  std::ofstream fft_mag("output/fft_mag.bmp", std::ios::binary);
+  std::ofstream fft_mag(output_path("fft_mag.bmp"), std::ios::binary);
   auto fft_mag_img = Frequency::plot(mag);
   fft_mag_img.regenerate_header();
   BmpImage::write_bmp(fft_mag, fft_mag_img);
 
-  std::ofstream fft_phase("output/fft_phase.bmp", std::ios::binary);
+  std::ofstream fft_phase(output_path("fft_phase.bmp"), std::ios::binary);
   auto fft_phase_img = Frequency::plot(phase);
   fft_phase_img.regenerate_header();
   BmpImage::write_bmp(fft_phase, fft_phase_img);
 
   auto ifft_transformed = Frequency::ifft(fft_transformed);
   auto ifft_img = Frequency::plot(ifft_transformed);
-  std::ofstream ifft_img_file("output/ifft_img.bmp", std::ios::binary);
+  std::ofstream ifft_img_file(output_path("ifft_img.bmp"), std::ios::binary);
   BmpImage::write_bmp(ifft_img_file, ifft_img);
 }
 
@@ -940,9 +1063,7 @@ void showProgressBar(int current, int total) {
   std::cout.flush();
 }
 void process_task(const std::string &path, int choice) {
-  std::ifstream in_file(path, std::ios::binary);
-  auto raw_img = BmpImage::read_bmp(in_file);
-  in_file.close();
+  auto raw_img = load_input(path);
   // std::cout << "原始图像预览" << std::endl;
   // print_image(raw_img);
   std::cout << "原始图像信息" << std::endl;
@@ -1006,37 +1127,74 @@ void process_task(const std::string &path, int choice) {
   }
 }
 
-void moveProcessedFiles(const std::string &path,
-                        const std::string &output_dir) {
-  std::string file_name_without_ext =
-      std::filesystem::path(path).filename().string();
-  file_name_without_ext.erase(file_name_without_ext.find(".bmp"));
-
-  std::string new_dir = output_dir + "/" + file_name_without_ext;
-  if (!std::filesystem::exists(new_dir)) {
-    std::filesystem::create_directory(new_dir);
+// Each input's results go to <output_root>/<file name without extension>.
+// Inputs that share a name, e.g. from different directories, get -2, -3, ...
+// in input order, so no two jobs write into the same directory.
+std::vector<std::string>
+job_output_dirs(const std::vector<std::string> &paths,
+                const std::string &output_root) {
+  std::set<std::string> taken;
+  std::vector<std::string> dirs;
+  for (const auto &path : paths) {
+    auto stem = std::filesystem::path(path).stem().string();
+    auto name = stem;
+    for (int n = 2; !taken.insert(name).second; n++) {
+      name = std::format("{}-{}", stem, n);
+    }
+    dirs.push_back(output_root + "/" + name);
   }
+  return dirs;
+}
 
-  for (const auto &entry : std::filesystem::directory_iterator(output_dir)) {
-    if (entry.path().filename().string().find(".bmp") != std::string::npos) {
-      std::string new_path = new_dir + "/" + entry.path().filename().string();
-      std::filesystem::copy(entry.path(), new_path);
-      std::filesystem::remove(entry.path());
-    }
+// Default-parameter version of each task, as used for batches
+std::function<void(std::string)> get_batch_task(int choice) {
+  switch (choice) {
+  case 1:
+    return task1;
+  case 2:
+    return task2;
+  case 3:
+    return task3;
+  case 4:
+    return task4;
+  case 5:
+    return task5;
+  case 6:
+    return task6;
+  case 7:
+    return task7;
+  case 8:
+    return task8;
+  case 9:
+    return task9;
+  case 10:
+    return task10;
+  case 12:
+    return task12;
+  default:
+    return nullptr;
   }
 }
 
 void processBatchTask(const std::vector<std::string> &files,
                       std::function<void(std::string)> task) {
   int total = files.size();
+  auto dirs = job_output_dirs(files, "output");
   for (int i = 0; i < total; ++i) {
     std::cout << std::endl;
     std::cout << BLUE << "正在处理文件 " << (i + 1) << "/" << total << ": "
               << files[i] << RESET << std::endl;
+    output_dir = dirs[i];
+    std::filesystem::create_directories(output_dir);
+    auto before = BufferPool::counters();
     task(files[i]);
+    auto after = BufferPool::counters();
+    std::cout << "大块缓冲区: 新分配 " << after.allocations - before.allocations
+              << " 次, 复用 " << after.reused - before.reused << " 次"
+              << std::endl;
     showProgressBar(i + 1, total);
-    moveProcessedFiles(files[i], "output");
   }
+  output_dir = "output";
   std::cout << std::endl;
   std::cout << GREEN << "✔ 批量处理完成！" << RESET << std::endl;
 }
@@ -1088,46 +1246,7 @@ void task() {
         continue;
       }
 
-      std::function<void(std::string)> task;
-      switch (choice) {
-      case 1:
-        task = task1;
-        break;
-      case 2:
-        task = task2;
-        break;
-      case 3:
-        task = task3;
-        break;
-      case 4:
-        task = task4;
-        break;
-      case 5:
-        task = task5;
-        break;
-      case 6:
-        task = task6;
-        break;
-      case 7:
-        task = task7;
-        break;
-      case 8:
-        task = task8;
-        break;
-      case 9:
-        task = task9;
-        break;
-      case 10:
-        task = task10;
-        break;
-      case 12:
-        task = task12;
-        break;
-      default:
-        break;
-      }
-
-      processBatchTask(files, task);
+      processBatchTask(files, get_batch_task(choice));
     } else {
       std::string file_path = getPath("请输入文件路径: ");
       process_task(file_path, choice);
@@ -1135,7 +1254,276 @@ void task() {
   }
 }
 
-int main() {
+// Command line mode. Progress is written to stdout as one JSON object per
+// line, e.g. {"event":"done","file":"input/car.bmp",...}.
+
+std::string json_string(const std::string &text) {
+  std::string result = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      result += std::format("\\u{:04x}", c);
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+// Matches `*` and `?` wildcards against a whole file name
+bool glob_match(const char *pattern, const char *name) {
+  if (*pattern == '\0') {
+    return *name == '\0';
+  }
+  if (*pattern == '*') {
+    return glob_match(pattern + 1, name) ||
+           (*name != '\0' && glob_match(pattern, name + 1));
+  }
+  return *name != '\0' && (*pattern == '?' || *pattern == *name) &&
+         glob_match(pattern + 1, name + 1);
+}
+
+// A directory (its .bmp files), a file, or a pattern like input/car*.bmp
+std::vector<std::string> expand_input(const std::string &input) {
+  namespace fs = std::filesystem;
+  std::vector<std::string> files;
+  if (fs::is_directory(input)) {
+    for (const auto &entry : fs::directory_iterator(input)) {
+      if (entry.path().extension() == ".bmp") {
+        files.push_back(entry.path().string());
+      }
+    }
+  } else if (fs::exists(input)) {
+    files.push_back(input);
+  } else {
+    fs::path pattern(input);
+    fs::path dir = pattern.has_parent_path() ? pattern.parent_path() : ".";
+    if (fs::is_directory(dir)) {
+      auto name_pattern = pattern.filename().string();
+      for (const auto &entry : fs::directory_iterator(dir)) {
+        auto name = entry.path().filename().string();
+        if (glob_match(name_pattern.c_str(), name.c_str())) {
+          files.push_back(entry.path().string());
+        }
+      }
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+void print_usage(std::ostream &out) {
+  out << "Usage: main --task <1-10|12> --input <dir|file|glob>... "
+         "[--output <dir>] [--jobs <n>] [--trace <chrome|summary>] "
+         "[--cache <dir>] [--cache-size <MiB>]\n"
+         "--trace writes trace.json (chrome://tracing) or trace.txt per "
+         "image.\n"
+         "--cache keeps Hough, FFT and label results across runs, up to "
+         "--cache-size (default 256) MiB.\n"
+         "Without arguments the interactive menu is shown.\n";
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Moves the events recorded for `file` into its output directory
+void write_trace(const std::string &format, const std::string &file,
+                 const std::string &dir) {
+  if (format.empty()) {
+    return;
+  }
+  auto events = Trace::take_events(file);
+  if (format == "chrome") {
+    std::ofstream out(std::filesystem::path(dir) / "trace.json");
+    Trace::write_chrome_trace(out, events);
+  } else {
+    std::ofstream out(std::filesystem::path(dir) / "trace.txt");
+    out << Trace::summary(events);
+  }
+}
+
+// Runs the task over every input, `jobs` files at a time. Each job writes
+// straight into its own directory under the output root, and the input a
+// worker will take next is decoded while it processes the current one.
+int run_cli(int argc, char **argv) {
+  int choice = 0;
+  std::vector<std::string> inputs;
+  std::string output_root = "output";
+  int jobs = std::thread::hardware_concurrency();
+  std::string trace_format;
+  std::string cache_dir;
+  size_t cache_mib = 256;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--help" || arg == "-h") {
+      print_usage(std::cout);
+      return 0;
+    } else if (arg == "--task" && has_value) {
+      choice = std::atoi(argv[++i]);
+    } else if (arg == "--input" && has_value) {
+      inputs.push_back(argv[++i]);
+    } else if (arg == "--output" && has_value) {
+      output_root = argv[++i];
+    } else if (arg == "--jobs" && has_value) {
+      jobs = std::atoi(argv[++i]);
+    } else if (arg == "--trace" && has_value) {
+      trace_format = argv[++i];
+      if (trace_format != "chrome" && trace_format != "summary") {
+        std::cerr << "Unknown trace format: " << trace_format << std::endl;
+        return 2;
+      }
+    } else if (arg == "--cache" && has_value) {
+      cache_dir = argv[++i];
+    } else if (arg == "--cache-size" && has_value) {
+      cache_mib = std::max(std::atoi(argv[++i]), 0);
+    } else if (!arg.starts_with("--") && !inputs.empty()) {
+      // Extra inputs, e.g. from a glob the shell already expanded
+      inputs.push_back(arg);
+    } else {
+      std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+      print_usage(std::cerr);
+      return 2;
+    }
+  }
+
+  auto task = get_batch_task(choice);
+  if (!task) {
+    std::cerr << "Unknown task: " << choice << std::endl;
+    print_usage(std::cerr);
+    return 2;
+  }
+  // A file named twice, e.g. by its directory and by its path, runs once
+  std::vector<std::string> files;
+  std::set<std::filesystem::path> seen;
+  for (const auto &input : inputs) {
+    for (auto &file : expand_input(input)) {
+      std::error_code error;
+      auto canonical = std::filesystem::canonical(file, error);
+      if (seen.insert(error ? std::filesystem::path(file) : canonical)
+              .second) {
+        files.push_back(std::move(file));
+      }
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "No input files found" << std::endl;
+    return 2;
+  }
+  auto dirs = job_output_dirs(files, output_root);
+  jobs = std::clamp<int>(jobs, 1, files.size());
+  Trace::enable(!trace_format.empty());
+  if (!cache_dir.empty()) {
+    Cache::enable(cache_dir, cache_mib << 20);
+  }
+
+  struct Decoded {
+    BmpImage::BmpImage image;
+    double decode_ms;
+  };
+  std::vector<std::future<Decoded>> decoded(files.size());
+  std::vector<char> launched(files.size(), false);
+  std::mutex decode_mutex;
+  auto prefetch = [&](size_t i) {
+    std::lock_guard<std::mutex> lock(decode_mutex);
+    if (i >= files.size() || launched[i]) {
+      return;
+    }
+    launched[i] = true;
+    decoded[i] = std::async(std::launch::async, [path = files[i]]() {
+      Trace::set_label(path);
+      auto start = std::chrono::steady_clock::now();
+      std::ifstream in_file(path, std::ios::binary);
+      if (!in_file) {
+        throw std::runtime_error("Cannot open " + path);
+      }
+      auto image = BmpImage::read_bmp(in_file);
+      return Decoded{std::move(image), elapsed_ms(start)};
+    });
+  };
+  auto take = [&](size_t i) {
+    prefetch(i);
+    std::lock_guard<std::mutex> lock(decode_mutex);
+    return std::move(decoded[i]);
+  };
+
+  std::mutex output_mutex;
+  auto emit = [&](const std::string &line) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    std::cout << line << std::endl;
+  };
+
+  std::atomic<size_t> next = 0;
+  std::atomic<int> completed = 0;
+  std::atomic<int> failed = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      auto input = take(i);
+      prefetch(i + jobs);
+      const auto &dir = dirs[i];
+      emit(std::format(R"({{"event":"start","index":{},"file":{}}})", i,
+                       json_string(files[i])));
+      try {
+        auto wait_start = std::chrono::steady_clock::now();
+        auto [image, decode_ms] = input.get();
+        double wait_ms = elapsed_ms(wait_start);
+
+        std::filesystem::create_directories(dir);
+        output_dir = dir;
+        prefetched_input.emplace(files[i], std::move(image));
+        Trace::set_label(files[i]);
+        auto start = std::chrono::steady_clock::now();
+        task(files[i]);
+        double task_ms = elapsed_ms(start);
+        prefetched_input.reset();
+        write_trace(trace_format, files[i], dir);
+
+        emit(std::format(
+            R"({{"event":"done","index":{},"file":{},"output":{},)"
+            R"("decode_ms":{:.2f},"wait_ms":{:.2f},"task_ms":{:.2f},)"
+            R"("completed":{},"total":{}}})",
+            i, json_string(files[i]), json_string(dir), decode_ms, wait_ms,
+            task_ms, ++completed, files.size()));
+      } catch (const std::exception &e) {
+        prefetched_input.reset();
+        Trace::take_events(files[i]);
+        failed++;
+        emit(std::format(
+            R"({{"event":"error","index":{},"file":{},"message":{},)"
+            R"("completed":{},"total":{}}})",
+            i, json_string(files[i]), json_string(e.what()), ++completed,
+            files.size()));
+      }
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < jobs; i++) {
+    prefetch(i);
+  }
+  std::vector<std::future<void>> workers;
+  for (int i = 0; i < jobs; i++) {
+    workers.emplace_back(std::async(std::launch::async, worker));
+  }
+  for (auto &future : workers) {
+    future.get();
+  }
+  emit(std::format(
+      R"({{"event":"summary","task":{},"files":{},"failed":{},"jobs":{},)"
+      R"("wall_ms":{:.2f}}})",
+      choice, files.size(), failed.load(), jobs, elapsed_ms(start)));
+  return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    return run_cli(argc, argv);
+  }
   task();
   return 0;
-}
\ No newline at end of file
+}